@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <cassert>
 #include <type_traits> // std::is_integral<T>::value
+#include <new> // std::align_val_t
 
 #include "Bytes.h"
 
@@ -9,11 +10,17 @@ Bytes& Bytes::copy(const Bytes& b)
 {
     if (&b == this)
         return *this;
-    delete[] m_bytes;
+    if (m_bytes != nullptr)
+        release();
+    m_bytes = nullptr;
+    m_alignment = b.m_alignment;
     if (b == nullptr)
         m_size = 0;
     else
+    {
         m_size = b.length();
+        m_bytes = allocate(m_size);
+    }
     for (size_t i = 0; i < m_size; ++i)
     {
         *(m_bytes + i) = *(b + i);
@@ -21,17 +28,40 @@ Bytes& Bytes::copy(const Bytes& b)
     return *this;
 }
 
+auto Bytes::allocate(size_t size) -> char*
+{
+    if (m_alignment == 0)
+        return new char[size];
+    return static_cast<char*>(::operator new[]
+        (size, std::align_val_t(m_alignment)));
+}
+
+auto Bytes::release() -> void
+{
+    if (m_alignment == 0)
+        delete[] m_bytes;
+    else
+        ::operator delete[](m_bytes, std::align_val_t(m_alignment));
+}
+
 auto Bytes::clear() -> Bytes&
 {
     if (m_bytes != nullptr)
     {
-        delete[] m_bytes;
+        release();
         m_bytes = nullptr;
     }
     m_size = 0;
     return *this;
 }
 
+auto Bytes::swap(Bytes& b) -> void
+{
+    std::swap(m_bytes, b.m_bytes);
+    std::swap(m_size, b.m_size);
+    std::swap(m_alignment, b.m_alignment);
+}
+
 auto Bytes::resize(size_t length) -> Bytes&
 {
     if (length == 0)
@@ -41,13 +71,13 @@ auto Bytes::resize(size_t length) -> Bytes&
     
     if (m_bytes == nullptr)
     {
-        m_bytes = new char[length];
+        m_bytes = allocate(length);
         m_size = length;
     }
     else
     {
-        delete[] m_bytes;
-        m_bytes = new char[length];
+        release();
+        m_bytes = allocate(length);
         m_size = length;
     }
     return *this;
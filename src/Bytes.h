@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <cassert>
+#include <string> // std::string
 #include <type_traits> // std::is_integral<T>::value
 
 // Контейнерный класс для хранения байт. Используется, в основном,
@@ -14,17 +15,27 @@ class Bytes
         char* m_bytes;
         // Переменная, хранящая размер массива.
         size_t m_size;
+        // Требуемое выравнивание адреса массива (0 - без требований).
+        // Выровненные буферы нужны для чтения и записи в обход кэша.
+        size_t m_alignment = 0;
 
         // Скрытый метод копирования для реализации глубокого
         // копирования (чтобы избежать копирования адресов).
         Bytes& copy(const Bytes& b);
 
+        // Выделение и освобождение памяти с учётом выравнивания.
+        auto allocate(size_t size) -> char*;
+        auto release() -> void;
+
     public:
         Bytes() : m_size(0)
             {   m_bytes = nullptr;   }
         Bytes(size_t size) : m_size(size)
             {   m_bytes = new char[size];   }
-        Bytes(const Bytes& b)
+        Bytes(size_t size, size_t alignment) 
+            : m_size(size), m_alignment(alignment)
+            {   m_bytes = allocate(size);   }
+        Bytes(const Bytes& b) : m_bytes(nullptr), m_size(0)
             {   copy(b);   }
 
         // Перегрузка данных операторов позволяет при передаче
@@ -54,6 +65,9 @@ class Bytes
         // Очищение (освобождение) выделенной памяти. Обнуление размера.
         auto clear() -> Bytes&;
 
+        // Обмен содержимым с другим контейнером без копирования байт.
+        auto swap(Bytes& b) -> void;
+
         // Изменяет размер выделенной памяти для буфера.
         auto resize(size_t length) -> Bytes&;
 
@@ -100,7 +114,7 @@ class Bytes
         ~Bytes()
         {
             if (m_bytes != nullptr)
-                delete[] m_bytes;
+                release();
         }
 };
 
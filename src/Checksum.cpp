@@ -0,0 +1,119 @@
+#include <cstring> // memcpy
+
+#include "Checksum.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h> // _mm_crc32_u64, _mm_crc32_u8
+#define CHECKSUM_HW_CRC
+#endif
+
+namespace
+{
+    const uint32_t polynomial = 0x82F63B78U; // CRC32C, обратный порядок бит
+
+    // Таблицы для табличного алгоритма "slicing-by-8".
+    struct Tables
+    {
+        uint32_t t[8][256];
+        Tables()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t crc = i;
+                for (int j = 0; j < 8; ++j)
+                    crc = (crc >> 1) ^ ((crc & 1U) ? polynomial : 0U);
+                t[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; ++i)
+                for (int k = 1; k < 8; ++k)
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFFU];
+        }
+    };
+
+    const Tables& tables()
+    {
+        static const Tables instance;
+        return instance;
+    }
+
+    uint32_t crc32c_table(const unsigned char* p, size_t size, uint32_t crc)
+    {
+        const Tables& tb = tables();
+        while (size >= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p, 8);
+            word ^= crc;
+            crc = tb.t[7][word & 0xFFU] ^ tb.t[6][(word >> 8) & 0xFFU]
+                ^ tb.t[5][(word >> 16) & 0xFFU] ^ tb.t[4][(word >> 24) & 0xFFU]
+                ^ tb.t[3][(word >> 32) & 0xFFU] ^ tb.t[2][(word >> 40) & 0xFFU]
+                ^ tb.t[1][(word >> 48) & 0xFFU] ^ tb.t[0][word >> 56];
+            p += 8;
+            size -= 8;
+        }
+        while (size--)
+            crc = (crc >> 8) ^ tb.t[0][(crc ^ *p++) & 0xFFU];
+        return crc;
+    }
+
+#ifdef CHECKSUM_HW_CRC
+    __attribute__((target("sse4.2")))
+    uint32_t crc32c_hw(const unsigned char* p, size_t size, uint32_t crc)
+    {
+        uint64_t crc64 = crc;
+        while (size >= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p, 8);
+            crc64 = _mm_crc32_u64(crc64, word);
+            p += 8;
+            size -= 8;
+        }
+        crc = static_cast<uint32_t>(crc64);
+        while (size--)
+            crc = _mm_crc32_u8(crc, *p++);
+        return crc;
+    }
+#endif
+}
+
+uint32_t Checksum::crc32c(const char* data, size_t size, uint32_t crc)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    crc = ~crc;
+#ifdef CHECKSUM_HW_CRC
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware)
+        return ~crc32c_hw(p, size, crc);
+#endif
+    return ~crc32c_table(p, size, crc);
+}
+
+uint64_t Checksum::hash64(const char* data, size_t size)
+{
+    const uint64_t m = 0xC6A4A7935BD1E995ULL;
+    const int r = 47;
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ (size * m);
+    size_t i = 0;
+    for (; i + 8U <= size; i += 8U)
+    {
+        uint64_t k;
+        std::memcpy(&k, data + i, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (i < size)
+    {
+        uint64_t k = 0;
+        std::memcpy(&k, data + i, size - i);
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
@@ -0,0 +1,22 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstdint>
+#include <cstddef> // size_t
+
+// Подсчёт контрольных сумм CRC32C (полином Кастаньоли) для проверки
+// перенесённых данных. На процессорах x86 с поддержкой SSE4.2
+// используется аппаратная инструкция crc32, иначе - табличный
+// алгоритм с обработкой восьми байт за шаг.
+namespace Checksum
+{
+    // Возвращает контрольную сумму блока. Параметр crc позволяет
+    // продолжить подсчёт для следующего блока того же потока.
+    uint32_t crc32c(const char* data, size_t size, uint32_t crc = 0);
+    // 64-разрядный хеш блока (MurmurHash64A) для сравнения содержимого
+    // с сохранённым ранее, когда вероятности совпадения 32-разрядных
+    // сумм недостаточно.
+    uint64_t hash64(const char* data, size_t size);
+}
+
+#endif // CHECKSUM_H
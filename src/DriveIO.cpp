@@ -0,0 +1,188 @@
+#include <cerrno>
+#include <fcntl.h> // open(), O_DIRECT, F_NOCACHE, sync_file_range()
+#include <unistd.h> // pread(), pwrite(), close()
+#include <sys/stat.h> // fstat()
+#include <sys/ioctl.h> // ioctl()
+#ifdef __linux__
+#include <linux/fs.h> // BLKSSZGET, BLKDISCARD
+#include <linux/falloc.h> // FALLOC_FL_PUNCH_HOLE
+#endif
+
+#include "DriveIO.h"
+
+bool DriveIO::open(const std::string& path, Mode mode, size_t alignment)
+{
+    close();
+    m_path = path;
+    m_alignment = alignment ? alignment : 512U;
+    if (!open_fd(mode) && (mode == BUFFERED || !open_fd(BUFFERED)))
+        return false;
+
+#ifdef BLKSSZGET
+    // Для блочного устройства выравнивание не меньше логического блока.
+    struct stat st;
+    int block_size = 0;
+    if (fstat(m_fd, &st) == 0 && S_ISBLK(st.st_mode)
+        && ioctl(m_fd, BLKSSZGET, &block_size) == 0
+        && static_cast<size_t>(block_size) > m_alignment)
+        m_alignment = block_size;
+#endif
+    return true;
+}
+
+bool DriveIO::open_fd(Mode mode)
+{
+    int flags = O_RDWR;
+#ifdef O_DIRECT
+    if (mode == DIRECT)
+        flags |= O_DIRECT;
+#endif
+    m_fd = ::open(m_path.c_str(), flags);
+    if (m_fd < 0)
+        return false;
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    // В macOS обход кэша включается для уже открытого дескриптора.
+    if (mode == DIRECT && fcntl(m_fd, F_NOCACHE, 1) != 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+#endif
+#if !defined(O_DIRECT) && !defined(F_NOCACHE)
+    if (mode == DIRECT)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+#endif
+    m_mode = mode;
+    return true;
+}
+
+bool DriveIO::reopen(Mode mode)
+{
+    close();
+    return open_fd(mode);
+}
+
+void DriveIO::close()
+{
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+}
+
+bool DriveIO::read(char* buff, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t result = pread(m_fd, buff + done, size - done, offset + done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0 && errno == EINVAL && m_mode == DIRECT)
+        {
+            // Запрос не удовлетворяет требованиям устройства к выравниванию.
+            if (!reopen(BUFFERED))
+                return false;
+            continue;
+        }
+        if (result <= 0)
+            return false;
+        done += result;
+    }
+    return true;
+}
+
+bool DriveIO::write(const char* buff, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t result = pwrite(m_fd, buff + done, size - done, offset + done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0 && errno == EINVAL && m_mode == DIRECT)
+        {
+            if (!reopen(BUFFERED))
+                return false;
+            continue;
+        }
+        if (result <= 0)
+            return false;
+        done += result;
+    }
+    return true;
+}
+
+bool DriveIO::copy(uint64_t source, uint64_t destination, size_t size)
+{
+#ifdef __linux__
+    loff_t in = source;
+    loff_t out = destination;
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t result = copy_file_range(m_fd, &in, m_fd, &out,
+            size - done, 0);
+        if (result < 0 && errno == EINTR)
+            continue;
+        // EXDEV, EINVAL, EOPNOTSUPP, ENOSYS - копирование ядром
+        // недоступно для этого файла.
+        if (result <= 0)
+            return false;
+        done += result;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void DriveIO::sync()
+{
+    if (m_fd >= 0)
+        fsync(m_fd);
+}
+
+void DriveIO::sync(uint64_t offset, size_t size)
+{
+    if (m_fd < 0)
+        return;
+#ifdef SYNC_FILE_RANGE_WRITE
+    if (sync_file_range(m_fd, offset, size, SYNC_FILE_RANGE_WAIT_BEFORE
+        | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == 0)
+        return;
+#endif
+    fsync(m_fd);
+}
+
+void DriveIO::drop_cache(uint64_t offset, size_t size)
+{
+#ifdef POSIX_FADV_DONTNEED
+    if (m_fd >= 0)
+        posix_fadvise(m_fd, offset, size, POSIX_FADV_DONTNEED);
+#endif
+}
+
+bool DriveIO::discard(uint64_t offset, uint64_t size)
+{
+    if (m_fd < 0)
+        return false;
+#ifdef BLKDISCARD
+    struct stat st;
+    if (fstat(m_fd, &st) == 0 && S_ISBLK(st.st_mode))
+    {
+        uint64_t range[2] = { offset, size };
+        return ioctl(m_fd, BLKDISCARD, &range) == 0;
+    }
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+    return fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        offset, size) == 0;
+#else
+    return false;
+#endif
+}
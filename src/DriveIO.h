@@ -0,0 +1,88 @@
+#ifndef DRIVE_IO_H
+#define DRIVE_IO_H
+
+#include <cstdint>
+#include <string>
+
+// Класс позиционного ввода-вывода для файла устройства или образа.
+// В отличие от std::fstream, не имеет общего указателя позиции,
+// поэтому допускает обращения из нескольких потоков, и позволяет
+// работать с накопителем в обход страничного кэша ядра (O_DIRECT).
+class DriveIO
+{
+    public:
+        // Режим работы: через страничный кэш или в обход него.
+        enum Mode
+        {
+            BUFFERED,
+            DIRECT
+        };
+
+    private:
+        // Дескриптор открытого файла (-1, если файл не открыт).
+        int m_fd = -1;
+        Mode m_mode = BUFFERED;
+        // Путь к файлу, сохраняемый для переоткрытия в другом режиме.
+        std::string m_path;
+        // Требуемое выравнивание смещений, размеров и адресов буферов
+        // для режима DIRECT.
+        size_t m_alignment = 512;
+
+        // Открытие дескриптора в указанном режиме.
+        auto open_fd(Mode mode) -> bool;
+
+    public:
+        DriveIO() {}
+        DriveIO(const DriveIO&) = delete;
+        DriveIO& operator=(const DriveIO&) = delete;
+        ~DriveIO() { close(); }
+
+        // Метод открывает файл для чтения и записи. Если режим DIRECT
+        // не поддерживается устройством или файловой системой образа,
+        // файл открывается в режиме BUFFERED. Выравнивание не может
+        // быть меньше размера логического блока устройства.
+        auto open(const std::string& path, Mode mode,
+            size_t alignment) -> bool;
+        auto close() -> void;
+        auto is_open() const -> bool { return m_fd >= 0; }
+        auto get_mode() const -> Mode { return m_mode; }
+        auto get_alignment() const -> size_t { return m_alignment; }
+        auto get_fd() const -> int { return m_fd; }
+
+        // Переоткрытие файла в другом режиме. Не допускает
+        // одновременных обращений к файлу из других потоков.
+        auto reopen(Mode mode) -> bool;
+
+        // Чтение и запись блока по указанному смещению. В режиме
+        // DIRECT смещение, размер и адрес буфера должны быть кратны
+        // выравниванию. Если устройство всё же отвергает запрос,
+        // файл переоткрывается в режиме BUFFERED и запрос повторяется.
+        // Переоткрытие не защищено от обращений из других потоков:
+        // одновременные запросы допустимы после того, как устройство
+        // приняло первый запрос в текущем режиме.
+        auto read(char* buff, size_t size, uint64_t offset) -> bool;
+        auto write(const char* buff, size_t size, uint64_t offset) -> bool;
+        // Копирование участка внутри файла средствами ядра
+        // (copy_file_range), без переноса данных через память процесса.
+        // Участки не должны перекрываться. Возвращает false, если
+        // копирование не поддерживается файлом или системой - тогда
+        // участок следует скопировать чтением и записью.
+        auto copy(uint64_t source, uint64_t destination,
+            size_t size) -> bool;
+        // Сброс записанных данных на накопитель.
+        auto sync() -> void;
+        // Сброс записанных данных участка. Там, где участок нельзя
+        // указать (sync_file_range), сбрасывается весь файл.
+        auto sync(uint64_t offset, size_t size) -> void;
+        // Удаление участка из страничного кэша, чтобы следующее
+        // чтение обратилось к накопителю. Используется при замерах.
+        auto drop_cache(uint64_t offset, size_t size) -> void;
+        // Сообщение накопителю, что участок больше не содержит данных:
+        // BLKDISCARD для блочного устройства, для файла образа -
+        // удаление участка из файла (fallocate с FALLOC_FL_PUNCH_HOLE)
+        // без изменения размера. Возвращает false, если операция
+        // не поддерживается. Содержимое участка после неё не определено.
+        auto discard(uint64_t offset, uint64_t size) -> bool;
+};
+
+#endif // DRIVE_IO_H
@@ -0,0 +1,302 @@
+#ifndef FAT_LAYOUT_H
+#define FAT_LAYOUT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring> // std::memcpy
+#include <string>
+#include <bit> // std::endian
+
+/* Описание структур FAT на накопителе и представления (view) над ними.
+ * Представление не владеет памятью и ничего не копирует: оно
+ * накладывается на любой участок байт - Bytes, отображённый в память
+ * файл или буфер чтения. Каждое поле задано смещением и типом на этапе
+ * компиляции, поэтому чтение поля сводится к одной загрузке из памяти.
+ * Правильность раскладки проверяется static_assert ниже. */
+namespace FAT_Layout
+{
+    // Поле структуры: смещение от начала структуры и тип значения.
+    template <size_t Offset, typename T, size_t Size = sizeof(T)>
+    struct Field
+    {
+        using Type = T;
+        static constexpr size_t offset = Offset;
+        static constexpr size_t size = Size;
+        static constexpr size_t end = Offset + Size;
+    };
+
+    // Поля следуют друг за другом без промежутков и перекрытий.
+    template <typename First, typename Second, typename... Rest>
+    constexpr bool is_contiguous()
+    {
+        if constexpr (sizeof...(Rest) == 0)
+            return First::end == Second::offset;
+        else
+            return First::end == Second::offset
+                && is_contiguous<Second, Rest...>();
+    }
+
+    // Значения на накопителе хранятся в порядке little-endian. На таких
+    // платформах чтение - одна загрузка, на остальных байты собираются
+    // по одному.
+    template <typename F>
+    inline auto load(const char* data) -> typename F::Type
+    {
+        using T = typename F::Type;
+        static_assert(F::size == sizeof(T), "Field is not a scalar.");
+        T value = 0;
+        if constexpr (std::endian::native == std::endian::little)
+            std::memcpy(&value, data + F::offset, sizeof(T));
+        else
+            for (size_t i = 0; i < sizeof(T); ++i)
+                value |= static_cast<T>(static_cast<unsigned char>
+                    (data[F::offset + i])) << 8 * i;
+        return value;
+    }
+
+    template <typename F>
+    inline void store(char* data, typename F::Type value)
+    {
+        using T = typename F::Type;
+        static_assert(F::size == sizeof(T), "Field is not a scalar.");
+        if constexpr (std::endian::native == std::endian::little)
+            std::memcpy(data + F::offset, &value, sizeof(T));
+        else
+            for (size_t i = 0; i < sizeof(T); ++i)
+                data[F::offset + i] = static_cast<char>(value >> 8 * i);
+    }
+
+    // Поле из нескольких символов (метка тома, имя файла).
+    template <typename F>
+    inline auto load_string(const char* data) -> std::string
+    {
+        return std::string(data + F::offset, F::size);
+    }
+
+    // Блок параметров BIOS (BPB), общий для FAT12, FAT16 и FAT32.
+    namespace BPB
+    {
+        using bytes_per_sector    = Field<0x0B, uint16_t>;
+        using sectors_per_cluster = Field<0x0D, uint8_t>;
+        using reserved_sectors    = Field<0x0E, uint16_t>;
+        using fat_number          = Field<0x10, uint8_t>;
+        using root_entries        = Field<0x11, uint16_t>;
+        using small_sector_count  = Field<0x13, uint16_t>;
+        using media               = Field<0x15, uint8_t>;
+        using sectors_per_fat     = Field<0x16, uint16_t>;
+        using sectors_per_track   = Field<0x18, uint16_t>;
+        using heads               = Field<0x1A, uint16_t>;
+        using hidden_sectors      = Field<0x1C, uint32_t>;
+        using large_sector_count  = Field<0x20, uint32_t>;
+        using signature           = Field<0x1FE, uint16_t>;
+        constexpr size_t size = 512;
+        constexpr uint16_t signature_value = 0xAA55;
+
+        static_assert(is_contiguous<bytes_per_sector, sectors_per_cluster,
+            reserved_sectors, fat_number, root_entries, small_sector_count,
+            media, sectors_per_fat, sectors_per_track, heads, hidden_sectors,
+            large_sector_count>(), "BPB fields must be contiguous.");
+        static_assert(large_sector_count::end == 0x24, "BPB ends at 0x24.");
+        static_assert(signature::end == size, "Signature ends the sector.");
+    }
+
+    // Расширенный блок параметров FAT12/FAT16 (следует сразу за BPB).
+    namespace EBPB16
+    {
+        using drive_number   = Field<0x24, uint8_t>;
+        using reserved       = Field<0x25, uint8_t>;
+        using signature      = Field<0x26, uint8_t>;
+        using serial_number  = Field<0x27, uint32_t>;
+        using label          = Field<0x2B, char, 11>;
+        using fs_type        = Field<0x36, char, 8>;
+
+        static_assert(BPB::large_sector_count::end == drive_number::offset,
+            "EBPB follows BPB.");
+        static_assert(is_contiguous<drive_number, reserved, signature,
+            serial_number, label, fs_type>(), "EBPB fields must be contiguous.");
+        static_assert(fs_type::end == 0x3E, "FAT16 boot code starts at 0x3E.");
+    }
+
+    // Расширенный блок параметров FAT32.
+    namespace EBPB32
+    {
+        using sectors_per_fat  = Field<0x24, uint32_t>;
+        using ext_flags        = Field<0x28, uint16_t>;
+        using version          = Field<0x2A, uint16_t>;
+        using root_dir_cluster = Field<0x2C, uint32_t>;
+        using fsinfo_sector    = Field<0x30, uint16_t>;
+        using backup_sector    = Field<0x32, uint16_t>;
+        using reserved         = Field<0x34, char, 12>;
+        using drive_number     = Field<0x40, uint8_t>;
+        using reserved_1       = Field<0x41, uint8_t>;
+        using signature        = Field<0x42, uint8_t>;
+        using serial_number    = Field<0x43, uint32_t>;
+        using label            = Field<0x47, char, 11>;
+        using fs_type          = Field<0x52, char, 8>;
+
+        static_assert(BPB::large_sector_count::end == sectors_per_fat::offset,
+            "EBPB follows BPB.");
+        static_assert(is_contiguous<sectors_per_fat, ext_flags, version,
+            root_dir_cluster, fsinfo_sector, backup_sector, reserved,
+            drive_number, reserved_1, signature, serial_number, label,
+            fs_type>(), "EBPB fields must be contiguous.");
+        static_assert(fs_type::end == 0x5A, "FAT32 boot code starts at 0x5A.");
+    }
+
+    // Сектор FSInfo (только FAT32).
+    namespace FSInfo
+    {
+        using lead_signature   = Field<0x000, uint32_t>;
+        using struct_signature = Field<0x1E4, uint32_t>;
+        using free_count       = Field<0x1E8, uint32_t>;
+        using next_free        = Field<0x1EC, uint32_t>;
+        using trail_signature  = Field<0x1FC, uint32_t>;
+        constexpr size_t size = 512;
+        constexpr uint32_t lead_value = 0x41615252;
+        constexpr uint32_t struct_value = 0x61417272;
+        constexpr uint32_t trail_value = 0xAA550000;
+
+        static_assert(is_contiguous<struct_signature, free_count,
+            next_free>(), "FSInfo counters must be contiguous.");
+        static_assert(trail_signature::end == size,
+            "Trail signature ends the sector.");
+    }
+
+    // 32-байтовая запись директории.
+    namespace DirEntry
+    {
+        using name                = Field<0x00, char, 8>;
+        using extension           = Field<0x08, char, 3>;
+        using attributes          = Field<0x0B, uint8_t>;
+        using reserved            = Field<0x0C, uint8_t>;
+        using create_time_tenths  = Field<0x0D, uint8_t>;
+        using create_time         = Field<0x0E, uint16_t>;
+        using create_date         = Field<0x10, uint16_t>;
+        using access_date         = Field<0x12, uint16_t>;
+        using first_cluster_high  = Field<0x14, uint16_t>;
+        using write_time          = Field<0x16, uint16_t>;
+        using write_date          = Field<0x18, uint16_t>;
+        using first_cluster_low   = Field<0x1A, uint16_t>;
+        using file_size           = Field<0x1C, uint32_t>;
+        constexpr size_t size = 32;
+        // Наибольшая длина имени вида "ИМЯ.РАС".
+        constexpr size_t short_name_max = 12;
+        constexpr uint8_t free_mark = 0xE5;
+        constexpr uint8_t end_mark = 0x00;
+        constexpr uint8_t directory = 0x10;
+        constexpr uint8_t archive = 0x20;
+
+        static_assert(is_contiguous<name, extension, attributes, reserved,
+            create_time_tenths, create_time, create_date, access_date,
+            first_cluster_high, write_time, write_date, first_cluster_low,
+            file_size>(), "Directory entry fields must be contiguous.");
+        static_assert(name::offset == 0 && file_size::end == size,
+            "Directory entry is 32 bytes.");
+    }
+
+    // Представление загрузочной записи раздела.
+    class BootSectorView
+    {
+        private:
+            const char* m_data;
+        public:
+            explicit BootSectorView(const char* data) : m_data(data) {}
+            template <typename F>
+            auto get() const -> typename F::Type { return load<F>(m_data); }
+            template <typename F>
+            auto get_string() const -> std::string
+                { return load_string<F>(m_data); }
+    };
+
+    // Представление сектора FSInfo. Изменяемое - если наложено
+    // на изменяемую память.
+    template <typename Char>
+    class BasicFsInfoView
+    {
+        private:
+            Char* m_data;
+        public:
+            explicit BasicFsInfoView(Char* data) : m_data(data) {}
+            auto is_valid() const -> bool
+            {
+                return load<FSInfo::lead_signature>(m_data) == FSInfo::lead_value
+                    && load<FSInfo::struct_signature>(m_data) == FSInfo::struct_value
+                    && load<FSInfo::trail_signature>(m_data) == FSInfo::trail_value;
+            }
+            auto free_count() const -> uint32_t
+                { return load<FSInfo::free_count>(m_data); }
+            auto next_free() const -> uint32_t
+                { return load<FSInfo::next_free>(m_data); }
+            void set_free_count(uint32_t value)
+                { store<FSInfo::free_count>(m_data, value); }
+            void set_next_free(uint32_t value)
+                { store<FSInfo::next_free>(m_data, value); }
+    };
+    using FsInfoView = BasicFsInfoView<const char>;
+    using MutableFsInfoView = BasicFsInfoView<char>;
+
+    // Представление записи директории.
+    template <typename Char>
+    class BasicDirEntryView
+    {
+        private:
+            Char* m_data;
+        public:
+            explicit BasicDirEntryView(Char* data) : m_data(data) {}
+            auto marker() const -> uint8_t
+                { return static_cast<uint8_t>(m_data[0]); }
+            auto is_end() const -> bool { return marker() == DirEntry::end_mark; }
+            auto is_free() const -> bool { return marker() == DirEntry::free_mark; }
+            auto is_dot() const -> bool { return marker() == '.'; }
+            auto attributes() const -> uint8_t
+                { return load<DirEntry::attributes>(m_data); }
+            // Номер первого кластера. Старшее слово используется только
+            // в FAT32: в FAT12/FAT16 его байты могут быть заняты
+            // (атрибуты доступа OS/2, NT) и не учитываются.
+            auto first_cluster(bool is_fat32) const -> uint32_t
+            {
+                uint32_t low = load<DirEntry::first_cluster_low>(m_data);
+                if (!is_fat32)
+                    return low;
+                return static_cast<uint32_t>
+                    (load<DirEntry::first_cluster_high>(m_data)) << 16U | low;
+            }
+            auto file_size() const -> uint32_t
+                { return load<DirEntry::file_size>(m_data); }
+            // Имя в виде "ИМЯ.РАС" без дополняющих пробелов. Записывается
+            // в буфер длиной не менее DirEntry::short_name_max, возвращается
+            // длина имени.
+            auto short_name(char* out) const -> size_t
+            {
+                size_t length = 0;
+                for (size_t i = 0; i < DirEntry::name::size
+                    && m_data[DirEntry::name::offset + i] != ' '; ++i)
+                    out[length++] = m_data[DirEntry::name::offset + i];
+                if ((attributes() & DirEntry::directory) == 0)
+                {
+                    out[length++] = '.';
+                    for (size_t i = 0; i < DirEntry::extension::size
+                        && m_data[DirEntry::extension::offset + i] != ' '; ++i)
+                        out[length++] = m_data[DirEntry::extension::offset + i];
+                }
+                return length;
+            }
+            auto short_name() const -> std::string
+            {
+                char name[DirEntry::short_name_max];
+                return std::string(name, short_name(name));
+            }
+            void set_first_cluster(uint32_t cluster, bool is_fat32)
+            {
+                store<DirEntry::first_cluster_low>(m_data,
+                    static_cast<uint16_t>(cluster & 0xFFFFU));
+                if (is_fat32)
+                    store<DirEntry::first_cluster_high>(m_data,
+                        static_cast<uint16_t>(cluster >> 16U));
+            }
+    };
+    using DirEntryView = BasicDirEntryView<const char>;
+    using MutableDirEntryView = BasicDirEntryView<char>;
+}
+
+#endif // FAT_LAYOUT_H
@@ -0,0 +1,340 @@
+#include "FatRuns.h"
+
+#include <algorithm> // std::min
+#include <cstring> // std::memset
+#include <iterator> // std::prev, std::next
+#include <utility> // std::move
+
+namespace
+{
+    // Элемент с номером index в таблице исходного формата.
+    uint32_t decode_entry(const char* fat, uint64_t size, uint32_t bits,
+        uint32_t index)
+    {
+        uint64_t offset = static_cast<uint64_t>(index) * bits / 8U;
+        uint32_t bytes = bits == 32U ? 4U : 2U;
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < bytes; ++i)
+            if (offset + i < size)
+                value |= static_cast<uint32_t>
+                    (static_cast<unsigned char>(fat[offset + i])) << 8U * i;
+        if (bits == 12U)
+            return (index & 1U) ? (value >> 4U) & 0xFFFU : value & 0xFFFU;
+        return value;
+    }
+
+    // Запись байта таблицы в буфер, начинающийся с байта base таблицы.
+    // Изменяются только биты маски; байты вне буфера пропускаются.
+    void put_byte(Bytes& buff, uint64_t base, uint64_t position,
+        uint32_t value, uint32_t mask)
+    {
+        if (position < base || position - base >= buff.length())
+            return;
+        char& byte = buff[position - base];
+        byte = static_cast<char>((static_cast<unsigned char>(byte) & ~mask)
+            | (value & mask));
+    }
+
+    void encode_entry(Bytes& buff, uint64_t base, uint32_t bits,
+        uint32_t index, uint32_t value)
+    {
+        uint64_t offset = static_cast<uint64_t>(index) * bits / 8U;
+        if (bits == 12U)
+        {
+            // Элемент FAT12 занимает полтора байта: нечётный элемент
+            // начинается со старшей половины байта.
+            if (index & 1U)
+            {
+                put_byte(buff, base, offset, value << 4U, 0xF0U);
+                put_byte(buff, base, offset + 1U, value >> 4U, 0xFFU);
+            }
+            else
+            {
+                put_byte(buff, base, offset, value, 0xFFU);
+                put_byte(buff, base, offset + 1U, value >> 8U, 0x0FU);
+            }
+            return;
+        }
+        for (uint32_t i = 0; i < bits / 8U; ++i)
+            put_byte(buff, base, offset + i, value >> 8U * i, 0xFFU);
+    }
+}
+
+void FatRuns::assign(const Bytes& fat, uint32_t entry_bits,
+    uint32_t sector_size)
+{
+    clear();
+    m_entry_bits = entry_bits;
+    m_sector_size = sector_size;
+    m_size = fat.length();
+    // Неполный последний элемент FAT12 тоже хранится, чтобы его
+    // биты не потерялись при записи сектора.
+    m_entries_number = static_cast<uint32_t>
+        ((m_size * 8U + entry_bits - 1U) / entry_bits);
+    const char* bytes = fat;
+    // Сначала подсчитывается количество участков: если они займут
+    // больше памяти, чем массив элементов, таблица хранится массивом.
+    Run last;
+    size_t runs_number = 0;
+    for (uint32_t i = 0; i < m_entries_number; ++i)
+    {
+        uint32_t value = decode_entry(bytes, m_size, entry_bits, i);
+        if (runs_number == 0 || !extend(last, i, value))
+        {
+            last = Run{ 1U, value, false };
+            ++runs_number;
+        }
+    }
+    if (runs_memory(runs_number)
+        > static_cast<size_t>(m_entries_number) * sizeof(uint32_t))
+    {
+        m_flat.resize(m_entries_number);
+        for (uint32_t i = 0; i < m_entries_number; ++i)
+            m_flat[i] = decode_entry(bytes, m_size, entry_bits, i);
+        return;
+    }
+    for (uint32_t i = 0; i < m_entries_number; ++i)
+        append(i, decode_entry(bytes, m_size, entry_bits, i));
+}
+
+void FatRuns::clear()
+{
+    m_runs.clear();
+    m_flat.clear();
+    m_flat.shrink_to_fit();
+    m_dirty.clear();
+    m_size = 0;
+    m_entries_number = 0;
+}
+
+bool FatRuns::extend(Run& last, uint32_t index, uint32_t value)
+{
+    if (is_sequential(last) && last.tail == index)
+    {
+        last.sequential = true;
+        ++last.length;
+        last.tail = value;
+        return true;
+    }
+    if (!last.sequential && last.tail == value)
+    {
+        ++last.length;
+        return true;
+    }
+    return false;
+}
+
+void FatRuns::append(uint32_t index, uint32_t value)
+{
+    if (!m_runs.empty() && extend(std::prev(m_runs.end())->second,
+        index, value))
+        return;
+    m_runs.emplace_hint(m_runs.end(), index, Run{ 1U, value, false });
+}
+
+uint32_t FatRuns::get(uint32_t index) const
+{
+    if (index >= m_entries_number)
+        return 0;
+    if (!m_flat.empty())
+        return m_flat[index];
+    auto it = std::prev(m_runs.upper_bound(index));
+    const Run& run = it->second;
+    if (!run.sequential || index == it->first + run.length - 1U)
+        return run.tail;
+    return index + 1U;
+}
+
+void FatRuns::split(uint32_t index)
+{
+    auto it = m_runs.upper_bound(index);
+    if (it == m_runs.begin())
+        return;
+    --it;
+    if (it->first == index || index >= it->first + it->second.length)
+        return;
+    Run& left = it->second;
+    Run right;
+    right.length = left.length - (index - it->first);
+    right.tail = left.tail;
+    right.sequential = left.sequential && right.length > 1U;
+    left.length = index - it->first;
+    if (left.sequential)
+    {
+        // Последний элемент левой части ссылается на первый правой.
+        left.tail = index;
+        left.sequential = left.length > 1U;
+    }
+    m_runs.emplace_hint(std::next(it), index, right);
+}
+
+std::map<uint32_t, FatRuns::Run>::iterator FatRuns::merge
+    (std::map<uint32_t, Run>::iterator it)
+{
+    auto next = std::next(it);
+    if (next == m_runs.end()
+        || it->first + it->second.length != next->first)
+        return it;
+    Run& first = it->second;
+    const Run& second = next->second;
+    if (is_sequential(first) && first.tail == next->first
+        && is_sequential(second))
+    {
+        first.sequential = true;
+        first.length += second.length;
+        first.tail = second.tail;
+    }
+    else if (!first.sequential && !second.sequential
+        && first.tail == second.tail)
+        first.length += second.length;
+    else
+        return it;
+    m_runs.erase(next);
+    return it;
+}
+
+void FatRuns::set(uint32_t index, uint32_t value)
+{
+    if (index >= m_entries_number || get(index) == value)
+        return;
+    mark_entry(index);
+    if (!m_flat.empty())
+    {
+        m_flat[index] = value;
+        return;
+    }
+    split(index);
+    split(index + 1U);
+    auto it = m_runs.find(index);
+    it->second = Run{ 1U, value, false };
+    merge(it);
+    if (it != m_runs.begin())
+        merge(std::prev(it));
+    // Если участки стали занимать больше памяти, чем массив, таблица
+    // переводится в массив. Обратный переход не выполняется.
+    if (runs_memory(m_runs.size())
+        > static_cast<size_t>(m_entries_number) * sizeof(uint32_t))
+        flatten();
+}
+
+void FatRuns::flatten()
+{
+    std::vector<uint32_t> flat(m_entries_number);
+    for (auto span = runs_from(0); !span.at_end(); ++span)
+        for (uint32_t i = 0; i < span->length; ++i)
+            flat[span->first + i] = span->value(span->first + i);
+    m_runs.clear();
+    m_flat = std::move(flat);
+}
+
+FatRuns::RunIterator::RunIterator(const FatRuns& table, uint32_t index)
+    : m_table(&table)
+{
+    if (index >= table.m_entries_number)
+        return;
+    if (!table.m_flat.empty())
+    {
+        load_flat(index);
+        return;
+    }
+    m_run = std::prev(table.m_runs.upper_bound(index));
+    const Run& run = m_run->second;
+    m_span.first = index;
+    m_span.length = m_run->first + run.length - index;
+    m_span.tail = run.tail;
+    m_span.sequential = run.sequential && m_span.length > 1U;
+}
+
+FatRuns::RunIterator& FatRuns::RunIterator::operator++()
+{
+    uint32_t next = m_span.first + m_span.length;
+    m_span = Span();
+    if (next >= m_table->m_entries_number)
+        return *this;
+    if (!m_table->m_flat.empty())
+    {
+        load_flat(next);
+        return *this;
+    }
+    ++m_run;
+    m_span.first = m_run->first;
+    m_span.length = m_run->second.length;
+    m_span.tail = m_run->second.tail;
+    m_span.sequential = m_run->second.sequential;
+    return *this;
+}
+
+void FatRuns::RunIterator::load_flat(uint32_t index)
+{
+    // Участок выделяется так же, как при разборе таблицы: цепочка
+    // ссылок на следующие элементы или повторяющееся значение.
+    const std::vector<uint32_t>& flat = m_table->m_flat;
+    uint32_t last = index;
+    bool sequential = flat[index] == index + 1U && index + 1U < flat.size();
+    if (sequential)
+        while (last + 1U < flat.size() && flat[last] == last + 1U)
+            ++last;
+    else
+        while (last + 1U < flat.size() && flat[last + 1U] == flat[index])
+            ++last;
+    m_span.first = index;
+    m_span.length = last - index + 1U;
+    m_span.tail = flat[last];
+    m_span.sequential = sequential;
+}
+
+void FatRuns::mark_entry(uint32_t index)
+{
+    uint64_t first = static_cast<uint64_t>(index) * m_entry_bits / 8U;
+    uint64_t last = (static_cast<uint64_t>(index) * m_entry_bits
+        + m_entry_bits - 1U) / 8U;
+    last = std::min(last, m_size - 1U);
+    for (uint64_t sector = first / m_sector_size;
+        sector <= last / m_sector_size; ++sector)
+        m_dirty.insert(static_cast<uint32_t>(sector));
+}
+
+void FatRuns::mark_sector(uint32_t sector)
+{
+    if (static_cast<uint64_t>(sector) * m_sector_size < m_size)
+        m_dirty.insert(sector);
+}
+
+Bytes FatRuns::serialize(uint32_t first_sector, uint32_t sectors_number) const
+{
+    uint64_t begin = static_cast<uint64_t>(first_sector) * m_sector_size;
+    uint64_t end = std::min(m_size, begin
+        + static_cast<uint64_t>(sectors_number) * m_sector_size);
+    if (begin >= end)
+        return Bytes();
+    Bytes buff(end - begin);
+    std::memset(buff, 0, buff.length());
+    // Элементы FAT12 на границах секторов попадают в буфер частично.
+    uint32_t first = static_cast<uint32_t>(begin * 8U / m_entry_bits);
+    uint32_t last = std::min<uint64_t>(m_entries_number,
+        end * 8U / m_entry_bits + 1U);
+    if (first > 0)
+        --first;
+    for (auto span = runs_from(first); !span.at_end()
+        && span->first < last; ++span)
+    {
+        uint32_t end = std::min(last, span->first + span->length);
+        for (uint32_t i = span->first; i < end; ++i)
+            encode_entry(buff, begin, m_entry_bits, i, span->value(i));
+    }
+    return buff;
+}
+
+size_t FatRuns::runs_memory(size_t runs_number)
+{
+    // Узел дерева: участок с ключом, три указателя и цвет.
+    return runs_number * (sizeof(std::pair<const uint32_t, Run>)
+        + 4U * sizeof(void*));
+}
+
+size_t FatRuns::memory_usage() const
+{
+    if (!m_flat.empty())
+        return m_flat.size() * sizeof(uint32_t);
+    return runs_memory(m_runs.size());
+}
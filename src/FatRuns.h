@@ -0,0 +1,151 @@
+#ifndef FAT_RUNS_H
+#define FAT_RUNS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "Bytes.h"
+
+/* Таблица FAT в памяти в виде участков. Большинство элементов таблицы
+ * ссылается на следующий по порядку кластер, а свободное место
+ * занимает протяжённые области нулей, поэтому таблица хранится как
+ * упорядоченный набор участков:
+ * - последовательный участок: каждый элемент, кроме последнего,
+ *   ссылается на следующий кластер, последний хранит значение tail
+ *   (конец цепочки или переход к другому участку файла);
+ * - постоянный участок: все элементы равны tail (свободное место,
+ *   повреждённые кластеры, подряд идущие файлы из одного кластера).
+ * Поиск элемента и его изменение выполняются за O(log n) от числа
+ * участков. Если участки заняли бы больше памяти, чем сама таблица
+ * (сильно фрагментированный раздел), таблица хранится как массив
+ * элементов. Изменённые сектора отмечаются, и на накопитель
+ * записываются только они. */
+class FatRuns
+{
+    private:
+        struct Run
+        {
+            uint32_t length = 0;
+            uint32_t tail = 0;
+            bool sequential = false;
+        };
+
+        // Участки по номеру первого элемента.
+        std::map<uint32_t, Run> m_runs;
+        // Элементы таблицы, если она хранится массивом (m_runs пуст).
+        std::vector<uint32_t> m_flat;
+        // Разрядность элемента (12, 16 или 32), размер таблицы в байтах
+        // и размер сектора.
+        uint32_t m_entry_bits = 16U;
+        uint64_t m_size = 0;
+        uint32_t m_sector_size = 512U;
+        uint32_t m_entries_number = 0;
+        // Номера изменённых секторов от начала таблицы.
+        std::set<uint32_t> m_dirty;
+
+        // Участок можно продолжить ссылкой на следующий кластер.
+        static bool is_sequential(const Run& run)
+            { return run.sequential || run.length == 1U; }
+        // Продление последнего участка элементом при разборе.
+        // Возвращает false, если элемент начинает новый участок.
+        static auto extend(Run& last, uint32_t index, uint32_t value)
+            -> bool;
+        // Примерный объём памяти, занимаемый участками.
+        static auto runs_memory(size_t runs_number) -> size_t;
+        // Переход к хранению таблицы массивом.
+        auto flatten() -> void;
+        // Разделение участка, содержащего элемент, так, чтобы элемент
+        // стал первым в своём участке.
+        auto split(uint32_t index) -> void;
+        // Объединение участка с последующим, если это возможно.
+        // Возвращает итератор на участок, содержащий оба.
+        auto merge(std::map<uint32_t, Run>::iterator it)
+            -> std::map<uint32_t, Run>::iterator;
+        // Добавление элемента в конец таблицы при разборе.
+        auto append(uint32_t index, uint32_t value) -> void;
+        // Отмечает сектора, занятые элементом.
+        auto mark_entry(uint32_t index) -> void;
+
+    public:
+        // Участок таблицы при переборе: элементы с first
+        // по first + length - 1.
+        struct Span
+        {
+            uint32_t first = 0;
+            uint32_t length = 0;
+            uint32_t tail = 0;
+            bool sequential = false;
+
+            // Значение элемента участка.
+            auto value(uint32_t index) const -> uint32_t
+            {
+                return sequential && index + 1U != first + length
+                    ? index + 1U : tail;
+            }
+        };
+
+        // Перебор участков по возрастанию номеров элементов. Для таблицы,
+        // хранящейся массивом, участки выделяются при переборе. Изменение
+        // таблицы делает итератор недействительным.
+        class RunIterator
+        {
+            public:
+                auto operator*() const -> const Span& { return m_span; }
+                auto operator->() const -> const Span* { return &m_span; }
+                auto operator++() -> RunIterator&;
+                // Участки закончились.
+                auto at_end() const -> bool { return m_span.length == 0; }
+
+            private:
+                friend class FatRuns;
+                RunIterator(const FatRuns& table, uint32_t index);
+                // Участок массива, начинающийся с элемента index.
+                auto load_flat(uint32_t index) -> void;
+
+                const FatRuns* m_table;
+                std::map<uint32_t, Run>::const_iterator m_run;
+                Span m_span;
+        };
+
+        FatRuns() = default;
+
+        // Разбор таблицы в исходном формате. Разрядность элемента -
+        // 12, 16 или 32 бита.
+        auto assign(const Bytes& fat, uint32_t entry_bits,
+            uint32_t sector_size) -> void;
+        auto clear() -> void;
+        auto empty() const -> bool { return m_runs.empty() && m_flat.empty(); }
+
+        // Значение элемента целиком (для FAT32 - вместе
+        // с зарезервированными битами). Для номеров за пределами
+        // таблицы возвращается 0.
+        auto get(uint32_t index) const -> uint32_t;
+        // Изменение элемента. Сектора элемента отмечаются изменёнными.
+        auto set(uint32_t index, uint32_t value) -> void;
+        // Перебор участков, начиная с участка, содержащего элемент
+        // index; первый участок обрезается так, чтобы начинаться с него.
+        auto runs_from(uint32_t index) const -> RunIterator
+            { return RunIterator(*this, index); }
+
+        // Изменённые сектора и их сброс после записи.
+        auto dirty_sectors() const -> const std::set<uint32_t>&
+            { return m_dirty; }
+        auto mark_sector(uint32_t sector) -> void;
+        auto clear_dirty() -> void { m_dirty.clear(); }
+        // Байты указанных секторов таблицы в исходном формате.
+        auto serialize(uint32_t first_sector, uint32_t sectors_number) const
+            -> Bytes;
+
+        // Размер таблицы: элементы, участки, байты на накопителе
+        // и примерный объём памяти, занимаемый участками или массивом.
+        auto entries_number() const -> uint32_t { return m_entries_number; }
+        auto runs_number() const -> size_t { return m_runs.size(); }
+        auto is_flat() const -> bool { return !m_flat.empty(); }
+        auto size() const -> uint64_t { return m_size; }
+        auto memory_usage() const -> size_t;
+};
+
+#endif // FAT_RUNS_H
@@ -5,61 +5,18 @@
 #include <iomanip>
 
 #include "PBR.h"
+#include "FAT_Layout.h"
 
 namespace Constants
 {
-    namespace Offsets
-    {
-        extern const size_t bytes_per_sector = 0x0B;
-        extern const size_t sectors_per_cluster = 0x0D;
-        extern const size_t reserved_sectors = 0x0E;
-        extern const size_t fat_number = 0x10;
-        extern const size_t root_entries = 0x11;
-        extern const size_t small_sector_count = 0x13;
-        extern const size_t sectors_per_fat_12_16 = 0x16;
-        extern const size_t hidden_sectors = 0x1C;
-        extern const size_t large_sector_count = 0x20;
-        extern const size_t sectors_per_fat_32 = 0x24;
-        extern const size_t root_dir_cluster = 0x2C;
-        extern const size_t serial_number_12_16 = 0x27;
-        extern const size_t serial_number_32 = 0x43;
-        extern const size_t volume_label_12_16 = 0x2B;
-        extern const size_t volume_label_32 = 0x47;
-        extern const size_t fat_signature_12_16 = 0x26;
-        extern const size_t fat_signature_32 = 0x42;
-        extern const size_t signature = 0x1FE;
-    }
-    namespace Sizes
-    {
-        extern const Bytes::TypeSize bytes_per_sector = Bytes::WORD;
-        extern const Bytes::TypeSize sectors_per_cluster = Bytes::BYTE;
-        extern const Bytes::TypeSize reserved_sectors = Bytes::WORD;
-        extern const Bytes::TypeSize fat_number = Bytes::BYTE;
-        extern const Bytes::TypeSize root_entries = Bytes::WORD;
-        extern const Bytes::TypeSize small_sector_count = Bytes::WORD;
-        extern const Bytes::TypeSize sectors_per_fat_12_16 = Bytes::WORD;
-        extern const Bytes::TypeSize hidden_sectors = Bytes::DOUBLE_WORD;
-        extern const Bytes::TypeSize large_sector_count = Bytes::DOUBLE_WORD;
-        extern const Bytes::TypeSize sectors_per_fat_32 = Bytes::DOUBLE_WORD;
-        extern const Bytes::TypeSize root_dir_cluster = Bytes::DOUBLE_WORD;
-        extern const Bytes::TypeSize serial_number_12_16 = Bytes::DOUBLE_WORD;
-        extern const Bytes::TypeSize serial_number_32 = Bytes::DOUBLE_WORD;
-        extern const uint8_t volume_label_12_16 = 11;
-        extern const uint8_t volume_label_32 = 11;
-        extern const Bytes::TypeSize fat_signature_12_16 = Bytes::BYTE;
-        extern const Bytes::TypeSize fat_signature_32 = Bytes::BYTE;
-        extern const uint16_t partition_boot_record = 512;
-        extern const Bytes::TypeSize signature = Bytes::WORD;
-    }
     namespace Values
     {
-        extern const uint16_t signature = 0xAA55;
         extern const uint8_t fat_signature_0x28 = 0x28;
         extern const uint8_t fat_signature_0x29 = 0x29;
-        extern const uint8_t root_entry = 32;
         extern const uint32_t root_dir_cluster_12_16 = 1;
         extern const uint64_t Gb = 1'073'741'824;
         extern const uint32_t Mb = 1'048'576;
+        extern const uint32_t fsinfo_unknown = 0xFFFFFFFF;
     }
 }
 
@@ -79,35 +36,37 @@ void PBR::init(const std::string& path, uint64_t offset)
     file.open(path, std::ios::binary | std::ios::in | std::ios::out);
     if (file.is_open())
     {
-        namespace CS = Constants::Sizes;
-        m_buff.resize(CS::partition_boot_record);
+        m_buff.resize(FAT_Layout::BPB::size);
         file.seekg(offset, file.beg);
-        file.read(m_buff, CS::partition_boot_record);
+        file.read(m_buff, FAT_Layout::BPB::size);
         if (is_pbr())
         {
             set_pbr(offset);
+            read_fsinfo(file);
         }
 
         file.close();
     }
 }
 
-void PBR::init(std::fstream& drive)
+void PBR::init(std::fstream& drive, uint64_t offset)
 {
-    namespace CS = Constants::Sizes;
     m_parameters = {};
-    m_buff.resize(CS::partition_boot_record);
-    drive.seekg(0, drive.beg);
-    drive.read(m_buff, CS::partition_boot_record);
+    m_buff.resize(FAT_Layout::BPB::size);
+    drive.seekg(offset, drive.beg);
+    drive.read(m_buff, FAT_Layout::BPB::size);
     if (is_pbr())
     {
-        set_pbr();
+        set_pbr(offset);
+        read_fsinfo(drive);
     }
 }
 
 PBR& PBR::clear()
 {
     m_buff.clear();
+    m_fsinfo.clear();
+    m_backup_fsinfo.clear();
     m_parameters = {};
     return *this;
 }
@@ -118,75 +77,52 @@ void PBR::set(const std::string& path, uint64_t offset)
     init(path, offset);
 }
 
-void PBR::set(std::fstream& drive)
+void PBR::set(std::fstream& drive, uint64_t offset)
+{
+    clear();
+    init(drive, offset);
+}
+
+void PBR::set(const Bytes& boot_record, uint64_t offset)
 {
     clear();
-    init(drive);
+    m_buff = boot_record;
+    if (is_pbr())
+        set_pbr(offset);
 }
 
 bool PBR::is_pbr() const
 {
-    namespace CO = Constants::Offsets;
-    namespace CS = Constants::Sizes;
     namespace CV = Constants::Values;
+    namespace FL = FAT_Layout;
 
-    uint16_t sign = 0;
-    uint8_t fat_sign_12_16 = 0;
-    uint8_t fat_sign_32 = 0;
+    if (m_buff.length() != FL::BPB::size)
+        return false;
+    FL::BootSectorView boot(m_buff);
+    if (boot.get<FL::BPB::signature>() != FL::BPB::signature_value)
+        return false;
 
-    if (m_buff.length() == CS::partition_boot_record)
-    {
-        sign = m_buff.get_value<uint16_t>
-            (CO::signature, CS::signature);
-        if (sign != CV::signature)
-            return false;
-
-        fat_sign_12_16 = m_buff.get_value<uint8_t>
-            (CO::fat_signature_12_16, CS::fat_signature_12_16);
-        fat_sign_32 = m_buff.get_value<uint8_t>
-            (CO::fat_signature_32, CS::fat_signature_32);
-    
-        if (   fat_sign_12_16 == CV::fat_signature_0x28 
-            || fat_sign_12_16 == CV::fat_signature_0x29 
-            || fat_sign_32 == CV::fat_signature_0x28
-            || fat_sign_32 == CV::fat_signature_0x29 )
-            return true;
-    }
-    return false;
+    uint8_t fat_sign_12_16 = boot.get<FL::EBPB16::signature>();
+    uint8_t fat_sign_32 = boot.get<FL::EBPB32::signature>();
+    return fat_sign_12_16 == CV::fat_signature_0x28
+        || fat_sign_12_16 == CV::fat_signature_0x29
+        || fat_sign_32 == CV::fat_signature_0x28
+        || fat_sign_32 == CV::fat_signature_0x29;
 }
 
 void PBR::set_pbr(uint64_t offset)
 {
-    namespace CO = Constants::Offsets;
-    namespace CS = Constants::Sizes;
     namespace CV = Constants::Values;
-
-    uint16_t b_p_s = m_buff.get_value<uint16_t>
-        ( CO::bytes_per_sector, CS::bytes_per_sector );
-
-
-    uint8_t  s_p_c = m_buff.get_value<uint8_t>
-        ( CO::sectors_per_cluster, CS::sectors_per_cluster );
-
-    uint16_t fs_12_16 = m_buff.get_value<uint16_t>
-        ( CO::sectors_per_fat_12_16, CS::sectors_per_fat_12_16);
-
-    uint32_t fs_32 = m_buff.get_value<uint32_t>
-            ( CO::sectors_per_fat_32, CS::sectors_per_fat_32 );
-
-    uint16_t s_s_c = m_buff.get_value<uint16_t>
-        ( CO::small_sector_count, CS::small_sector_count );
-
-    uint32_t l_s_c = m_buff.get_value<uint32_t>
-        ( CO::large_sector_count, CS::large_sector_count ); 
-
-    uint64_t hidden_sectors = 0;
-    if (offset != 0)
-        hidden_sectors = m_buff.get_value<uint64_t>
-            ( CO::hidden_sectors, CS::hidden_sectors );
-
-    uint16_t root_entries = m_buff.get_value<uint16_t>
-        ( CO::root_entries, CS::root_entries );
+    namespace FL = FAT_Layout;
+
+    FL::BootSectorView boot(m_buff);
+    uint16_t b_p_s = boot.get<FL::BPB::bytes_per_sector>();
+    uint8_t  s_p_c = boot.get<FL::BPB::sectors_per_cluster>();
+    uint16_t fs_12_16 = boot.get<FL::BPB::sectors_per_fat>();
+    uint32_t fs_32 = boot.get<FL::EBPB32::sectors_per_fat>();
+    uint16_t s_s_c = boot.get<FL::BPB::small_sector_count>();
+    uint32_t l_s_c = boot.get<FL::BPB::large_sector_count>();
+    uint16_t root_entries = boot.get<FL::BPB::root_entries>();
     
     /*
     std::cout   << std::hex     << std::uppercase 
@@ -196,19 +132,21 @@ void PBR::set_pbr(uint64_t offset)
                 << "sectors_per_fat_32: "       << fs_32 << '\n'
                 << "small_sector_count: "       << s_s_c << '\n'
                 << "large_sector_count: "       << l_s_c << '\n'
-                << "hidden_sectors: "           << hidden_sectors << '\n'
                 << "root_entries: "             << root_entries << '\n';
     std::cout   << std::dec << '\n';
     */
 
+    m_parameters.bytes_per_sector = b_p_s;
     m_parameters.cluster_size = static_cast<uint32_t>(b_p_s) * s_p_c;
 
-    m_parameters.fat_offset = b_p_s * ( hidden_sectors
-        + m_buff.get_value<uint64_t>
-        ( CO::reserved_sectors, CS::reserved_sectors ) );
+    // Смещения отсчитываются от начала файла устройства: offset -
+    // положение загрузочной записи. Поле hidden_sectors для этого
+    // не используется, поскольку в образах оно часто не заполнено.
+    m_parameters.volume_offset = offset;
+    m_parameters.fat_offset = offset + static_cast<uint64_t>(b_p_s)
+        * boot.get<FL::BPB::reserved_sectors>();
 
-    m_parameters.fat_number = m_buff.get_value<uint8_t>
-        ( CO::fat_number, CS::fat_number );
+    m_parameters.fat_number = boot.get<FL::BPB::fat_number>();
 
     if (fs_12_16 == 0) 
         m_parameters.fat_size = static_cast<uint64_t>(fs_32) * b_p_s;
@@ -223,10 +161,10 @@ void PBR::set_pbr(uint64_t offset)
     else
         m_parameters.partition_size = static_cast<uint64_t>(s_s_c) * b_p_s;
 
-    m_parameters.root_dir_size = root_entries * CV::root_entry;
+    m_parameters.root_dir_size = root_entries * FL::DirEntry::size;
 
     m_parameters.clusters_number = (m_parameters.partition_size 
-            - m_parameters.data_offset + hidden_sectors 
+            - (m_parameters.data_offset - offset)
             - m_parameters.root_dir_size) / m_parameters.cluster_size;
 
     if (fs_12_16 != 0)
@@ -241,26 +179,108 @@ void PBR::set_pbr(uint64_t offset)
         m_parameters.fat_type = FAT32;
 
     if (m_parameters.fat_type == FAT32)
-        m_parameters.root_dir_cluster = m_buff.get_value<uint32_t>
-            ( CO::root_dir_cluster, CS::root_dir_cluster);
+        m_parameters.root_dir_cluster
+            = boot.get<FL::EBPB32::root_dir_cluster>();
     else if (m_parameters.fat_type == FAT12 || m_parameters.fat_type == FAT16)
-        m_parameters.root_dir_cluster = 1;
+        m_parameters.root_dir_cluster = CV::root_dir_cluster_12_16;
 
     m_parameters.last_cluster = m_parameters.clusters_number + 1; // root_dir
 
     if (m_parameters.fat_type == FAT12 || m_parameters.fat_type == FAT16)
-        m_parameters.serial_number = m_buff.get_value<uint32_t>
-            (CO::serial_number_12_16, CS::serial_number_12_16);
+        m_parameters.serial_number = boot.get<FL::EBPB16::serial_number>();
     else
-        m_parameters.serial_number = m_buff.get_value<uint32_t>
-            (CO::serial_number_32, CS::serial_number_32);
+        m_parameters.serial_number = boot.get<FL::EBPB32::serial_number>();
+
+    // Номер сектора FSInfo: 0 и 0xFFFF означают его отсутствие.
+    if (m_parameters.fat_type == FAT32)
+    {
+        uint16_t fsinfo_sector = boot.get<FL::EBPB32::fsinfo_sector>();
+        if (fsinfo_sector != 0 && fsinfo_sector != 0xFFFFU)
+            m_parameters.fsinfo_offset = offset
+                + static_cast<uint64_t>(b_p_s) * fsinfo_sector;
+        // Резервная копия FSInfo следует за резервной копией
+        // загрузочного сектора на том же расстоянии.
+        uint16_t backup_sector = boot.get<FL::EBPB32::backup_sector>();
+        if (m_parameters.fsinfo_offset != 0 && backup_sector != 0
+            && backup_sector != 0xFFFFU)
+            m_parameters.backup_fsinfo_offset = offset
+                + static_cast<uint64_t>(b_p_s)
+                    * (backup_sector + fsinfo_sector);
+    }
 
     if (m_parameters.fat_type == FAT12 || m_parameters.fat_type == FAT16)
-        m_parameters.label = m_buff.get_string
-            (CO::volume_label_12_16, CS::volume_label_12_16);
+        m_parameters.label = boot.get_string<FL::EBPB16::label>();
     if (m_parameters.fat_type == FAT32)
-        m_parameters.label = m_buff.get_string
-            (CO::volume_label_32, CS::volume_label_32);    
+        m_parameters.label = boot.get_string<FL::EBPB32::label>();
+}
+
+void PBR::read_fsinfo(std::istream& drive)
+{
+    namespace FL = FAT_Layout;
+
+    if (m_parameters.fsinfo_offset == 0)
+        return;
+    m_fsinfo.resize(FL::FSInfo::size);
+    drive.seekg(m_parameters.fsinfo_offset, drive.beg);
+    drive.read(m_fsinfo, FL::FSInfo::size);
+    if (!drive)
+    {
+        drive.clear();
+        m_fsinfo.clear();
+        return;
+    }
+
+    FL::FsInfoView fsinfo(m_fsinfo);
+    if (!fsinfo.is_valid())
+    {
+        m_fsinfo.clear();
+        return;
+    }
+    m_parameters.fsinfo_valid = true;
+
+    // Резервная копия обновляется, только если её сигнатуры верны.
+    m_backup_fsinfo.clear();
+    if (m_parameters.backup_fsinfo_offset != 0)
+    {
+        m_backup_fsinfo.resize(FL::FSInfo::size);
+        drive.seekg(m_parameters.backup_fsinfo_offset, drive.beg);
+        drive.read(m_backup_fsinfo, FL::FSInfo::size);
+        if (!drive || !FL::FsInfoView(m_backup_fsinfo).is_valid())
+        {
+            drive.clear();
+            m_backup_fsinfo.clear();
+        }
+    }
+
+    // Значения вне допустимого диапазона считаются неизвестными.
+    uint32_t free_clusters = fsinfo.free_count();
+    uint32_t next_free = fsinfo.next_free();
+    if (free_clusters <= m_parameters.clusters_number)
+        m_parameters.free_clusters = free_clusters;
+    if (next_free >= 2U && next_free <= m_parameters.last_cluster)
+        m_parameters.next_free = next_free;
+}
+
+void PBR::write_fsinfo(std::fstream& drive, uint32_t free_clusters,
+    uint32_t next_free)
+{
+    if (!m_parameters.fsinfo_valid)
+        return;
+    FAT_Layout::MutableFsInfoView fsinfo(m_fsinfo);
+    fsinfo.set_free_count(free_clusters);
+    fsinfo.set_next_free(next_free);
+    drive.seekp(m_parameters.fsinfo_offset, drive.beg);
+    drive.write(m_fsinfo, m_fsinfo.length());
+    if (m_backup_fsinfo.length() != 0)
+    {
+        FAT_Layout::MutableFsInfoView backup(m_backup_fsinfo);
+        backup.set_free_count(free_clusters);
+        backup.set_next_free(next_free);
+        drive.seekp(m_parameters.backup_fsinfo_offset, drive.beg);
+        drive.write(m_backup_fsinfo, m_backup_fsinfo.length());
+    }
+    m_parameters.free_clusters = free_clusters;
+    m_parameters.next_free = next_free;
 }
 
 bool PBR::is_fat() const
@@ -300,6 +320,13 @@ void PBR::print_parameters() const
     std::cout << "root_dir_cluster: " << m_parameters.root_dir_cluster << "\n";
     std::cout << "clusters_number: " << m_parameters.clusters_number << "\n";
     std::cout << "last_cluster: " << m_parameters.last_cluster << "\n";
+    if (m_parameters.fsinfo_valid)
+    {
+        std::cout << "fsinfo offset: " << m_parameters.fsinfo_offset << '\n';
+        std::cout << "fsinfo free clusters: " 
+            << m_parameters.free_clusters << '\n';
+        std::cout << "fsinfo next free: " << m_parameters.next_free << '\n';
+    }
 }
 
 void PBR::print() const
@@ -319,6 +346,11 @@ void PBR::print() const
     std::cout << "Доступная память: " 
         << m_parameters.clusters_number * m_parameters.cluster_size 
             / static_cast<double>(CV::Mb) << " Mb\n";
+    if (m_parameters.free_clusters != CV::fsinfo_unknown)
+        std::cout << "Свободная память: "
+            << static_cast<uint64_t>(m_parameters.free_clusters)
+                * m_parameters.cluster_size
+                / static_cast<double>(CV::Mb) << " Mb\n";
     std::cout << std::resetiosflags(std::ios::fixed);
 
     if (m_parameters.fat_type == FAT12)
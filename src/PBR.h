@@ -37,11 +37,26 @@ class PBR // Partition Boot Record (Загрузочная запись разд
             uint32_t last_cluster = 0;
             uint32_t serial_number = 0;
             std::string label;
+            uint16_t bytes_per_sector = 0;
+            // Смещение загрузочной записи раздела в файле устройства.
+            uint64_t volume_offset = 0;
+            // Сведения сектора FSInfo (только FAT32). Значение 0xFFFFFFFF
+            // означает, что количество или подсказка неизвестны.
+            uint64_t fsinfo_offset = 0;
+            bool fsinfo_valid = false;
+            // Смещение резервной копии сектора FSInfo (0 - копии нет).
+            uint64_t backup_fsinfo_offset = 0;
+            uint32_t free_clusters = 0xFFFFFFFFU;
+            uint32_t next_free = 0xFFFFFFFFU;
         };
 
     private:
         // Контейнер для хранения байт записи раздела.
         Bytes m_buff;
+        // Контейнер для хранения байт сектора FSInfo и его резервной
+        // копии (пуст, если копия отсутствует или повреждена).
+        Bytes m_fsinfo;
+        Bytes m_backup_fsinfo;
         // Экземпляр структуры.
         Parameters m_parameters;
 
@@ -49,12 +64,18 @@ class PBR // Partition Boot Record (Загрузочная запись разд
         // Они открывают специальный файл устройства (раздела)
         // и переносят загрузочную запись в контейнер.
         void init(const std::string& path, uint64_t offset = 0);
-        void init(std::fstream& drive);
+        void init(std::fstream& drive, uint64_t offset = 0);
 
         // Главный метод класса - он инициализирует структуру
         // данными, извлекаемыми из байт загрузочной записи раздела.
         void set_pbr(uint64_t offset = 0);
 
+        // Метод считывает сектор FSInfo раздела FAT32, проверяет его
+        // сигнатуры и корректность значений, и при успехе переносит
+        // количество свободных кластеров и подсказку о первом
+        // свободном кластере в структуру.
+        void read_fsinfo(std::istream& drive);
+
     public:
         // Конструкторы класса.
         PBR();
@@ -69,9 +90,13 @@ class PBR // Partition Boot Record (Загрузочная запись разд
         bool is_fat() const;
 
         // Два метода для считывания указанного раздела и перезаписи
-        // информации в экземпляре. 
+        // информации в экземпляре. Смещение offset - положение
+        // загрузочной записи раздела в файле устройства.
         auto set(const std::string& path, uint64_t offset = 0) -> void;
-        auto set(std::fstream& drive) -> void;
+        auto set(std::fstream& drive, uint64_t offset = 0) -> void;
+        // Разбор уже считанной загрузочной записи без обращения
+        // к накопителю. Сектор FSInfo при этом не считывается.
+        auto set(const Bytes& boot_record, uint64_t offset) -> void;
 
         // Метод для очистки (обнуления) данных экземпляра. Используется
         // перед переинициализацией методами set(). 
@@ -83,6 +108,12 @@ class PBR // Partition Boot Record (Загрузочная запись разд
         auto get_parameters() const -> const Parameters&
          { return m_parameters; }
 
+        // Метод обновляет сектор FSInfo и его резервную копию
+        // на накопителе и в структуре. Для разделов без сектора FSInfo
+        // ничего не делает.
+        auto write_fsinfo(std::fstream& drive, uint32_t free_clusters,
+            uint32_t next_free) -> void;
+
         // Метод возвращает ссылку на контейнер. Не востребован.
         Bytes& get_bytes() { return m_buff; }
 
@@ -3,8 +3,20 @@
 
 #include <cstdint> // uint_t
 #include <fstream> // std::fstream
+#include <vector> // std::vector
+#include <functional> // std::function
+#include <unordered_set> // std::unordered_set
+#include <unordered_map> // std::unordered_map
+#include <map> // std::map
+#include <array> // std::array
+#include <atomic> // std::atomic
+#include <chrono> // std::chrono::steady_clock
 #include "PBR.h"
 #include "Bytes.h"
+#include "DriveIO.h"
+#include "ScanArena.h"
+#include "FatRuns.h"
+#include "ScanCache.h"
 
 // Класс, отвечающий за взаимодействие с разделом.
 // Функции поиска файла и дефрагментации лежат в его реализации.
@@ -42,32 +54,428 @@ class Partition
             { return name; }
             const FileType get_type() const
             { return type; }
+            uint32_t get_size() const
+            { return size; }
+            uint32_t get_first_cluster() const
+            { return first_cluster; }
         };
         // Функция вывода информации об обнаруженном файле.
         void print_file_info(const FileInfo&);
+
+        // Итоги размещения файлов по профилю доступа. Количество
+        // перемещений головки считается по последовательному чтению
+        // файлов профиля в заданном порядке.
+        struct ProfileReport
+        {
+            uint32_t files = 0;
+            uint32_t placed = 0;
+            uint32_t evicted = 0;
+            uint32_t seeks_before = 0;
+            uint32_t seeks_after = 0;
+        };
+        // Перенос файла при уплотнении: прежний и новый первый
+        // кластер, длина файла, свободный участок, образовавшийся
+        // на его месте вместе с соседними промежутками, и наибольший
+        // свободный участок до и после переноса.
+        struct PackMove
+        {
+            std::string name;
+            uint32_t from = 0;
+            uint32_t to = 0;
+            uint32_t clusters = 0;
+            uint32_t freed_run = 0;
+            uint32_t largest_before = 0;
+            uint32_t largest_after = 0;
+        };
+        // Итоги уплотнения мелких файлов в свободные промежутки.
+        // Размеры свободных участков указаны в кластерах.
+        struct PackReport
+        {
+            uint32_t files = 0;
+            uint64_t bytes_moved = 0;
+            uint32_t largest_hole_before = 0;
+            uint32_t largest_hole_after = 0;
+            uint32_t holes_before = 0;
+            uint32_t holes_after = 0;
+            std::vector<PackMove> moves;
+        };
+        // Вывод итогов уплотнения.
+        void print_pack_report(const PackReport& report) const;
+        // Выбор основной копии таблицы FAT при расхождении копий.
+        enum FatPolicy
+        {
+            FAT_VALID, // копия с наименьшим числом недопустимых ссылок
+            FAT_FIRST, // первая копия, как при чтении одной копии
+            FAT_STRICT // первая копия, перемещение файлов запрещено
+        };
+        // Итоги сравнения копий таблицы FAT при открытии раздела.
+        // Номера секторов отсчитываются от начала таблицы. Для каждой
+        // копии указано число недопустимых ссылок в различающихся
+        // секторах (0xFFFFFFFF - копия не считана).
+        struct FatMirrorReport
+        {
+            uint32_t copies = 0;
+            uint32_t chosen = 0;
+            std::vector<uint32_t> mismatched_sectors;
+            std::vector<uint32_t> invalid_entries;
+        };
+        // Вывод итогов сравнения копий таблицы FAT.
+        void print_fat_mirror_report() const;
+        // Вывод объёма памяти, занимаемого таблицей FAT.
+        void print_fat_memory() const;
+        // Категории кластеров на карте тома. К прочим относятся
+        // повреждённые кластеры, кластеры нескольких файлов и занятые
+        // кластеры, не принадлежащие найденным файлам.
+        enum MapCategory
+        {
+            MAP_FREE,
+            MAP_CONTIGUOUS,
+            MAP_FRAGMENTED,
+            MAP_DIRECTORY,
+            MAP_OTHER,
+            MAP_CATEGORIES
+        };
+        // Карта тома: количество кластеров каждой категории в участках
+        // по clusters_per_bucket кластеров. Участки выводятся точками
+        // изображения width x height построчно.
+        struct ClusterMap
+        {
+            uint32_t clusters = 0;
+            uint32_t cluster_size = 0;
+            uint32_t clusters_per_bucket = 0;
+            uint32_t width = 0;
+            uint32_t height = 0;
+            std::vector<std::array<uint32_t, MAP_CATEGORIES>> buckets;
+            uint64_t totals[MAP_CATEGORIES] = {};
+        };
+        // Сохранение карты в изображение <path>.ppm (формат P6) и её
+        // описания в <path>.json. Возвращает false при ошибке записи.
+        static bool export_cluster_map(const ClusterMap& map,
+            const std::string& path);
+        // Виды нарушений, обнаруживаемых проверкой таблицы FAT.
+        enum IssueType
+        {
+            CHAIN_CYCLE,    // цепочка зациклена
+            CROSS_LINK,     // кластер принадлежит нескольким файлам
+            LOST_CHAIN,     // занятая цепочка не принадлежит ни одному файлу
+            SIZE_MISMATCH,  // длина цепочки не соответствует размеру файла
+            BAD_CLUSTER,    // кластер помечен как повреждённый
+            INVALID_LINK    // ссылка за пределы области данных
+        };
+        struct FatIssue
+        {
+            IssueType type;
+            uint32_t cluster = 0;
+            std::string name;
+        };
+        // Итоги проверки таблицы FAT.
+        struct CheckReport
+        {
+            std::vector<FatIssue> issues;
+            uint32_t lost_clusters = 0;
+            uint32_t bad_clusters = 0;
+            uint32_t blocked_files = 0;
+        };
+        // Вывод итогов проверки таблицы FAT.
+        void print_check_report(const CheckReport& report);
+
+        // Способы переноса данных кластеров.
+        enum CopyMethod
+        {
+            USER_COPY,   // чтение и запись через память процесса
+            KERNEL_COPY, // copy_file_range внутри файла устройства
+            COPY_METHODS
+        };
+        // Объём и время переноса данных одним способом.
+        struct CopyStats
+        {
+            uint64_t bytes = 0;
+            uint64_t nanoseconds = 0;
+            uint32_t requests = 0;
+        };
+        // Вывод объёма и скорости переноса данных по способам.
+        void print_copy_stats() const;
+        // Освобождение на накопителе кластеров, оставленных
+        // перенесёнными файлами: запросы, байты и отказы.
+        struct DiscardStats
+        {
+            uint32_t requests = 0;
+            uint64_t bytes = 0;
+            uint32_t failures = 0;
+        };
+        void print_discard_stats() const;
+        // Использование снимка прошлого обхода тома: изменённые
+        // сектора таблицы FAT, директории, взятые из снимка и
+        // разобранные заново, и файлы, цепочки которых не
+        // просматривались.
+        struct ScanCacheStats
+        {
+            bool loaded = false;
+            uint32_t fat_sectors = 0;
+            uint32_t fat_sectors_changed = 0;
+            uint32_t dirs_reused = 0;
+            uint32_t dirs_parsed = 0;
+            uint32_t chains_reused = 0;
+            uint32_t chains_walked = 0;
+        };
+        void print_scan_cache_stats() const;
+        // Ход длительной операции: обработанные файлы и байты (файлы,
+        // оставшиеся на месте, тоже учитываются), перенесённые байты,
+        // текущая скорость переноса (по завершении - средняя) и оценка
+        // оставшегося времени в секундах по текущей скорости
+        // (отрицательная - оценки ещё нет). При обходе дерева каталогов
+        // общее количество растёт по мере обхода.
+        struct Progress
+        {
+            uint32_t files_done = 0;
+            uint32_t files_total = 0;
+            uint64_t bytes_done = 0;
+            uint64_t bytes_total = 0;
+            uint64_t bytes_moved = 0;
+            double megabytes_per_second = 0;
+            double eta_seconds = -1;
+            std::string file;
+            bool finished = false;
+            bool cancelled = false;
+        };
+        using ProgressCallback = std::function<void(const Progress&)>;
+        // Параметры переноса данных через память: размер запроса
+        // в кластерах и количество одновременных запросов. Подбираются
+        // калибровкой накопителя.
+        struct IoProfile
+        {
+            uint32_t chunk_clusters = 64U;
+            uint32_t queue_depth = 1U;
+            double megabytes_per_second = 0;
+            bool calibrated = false;
+            bool cached = false;
+        };
+        // Вывод параметров переноса данных.
+        void print_io_profile() const;
+
+        // Кандидат на дефрагментацию с оценкой выгоды: сокращение
+        // времени чтения файла в микросекундах на мегабайт данных,
+        // которые придётся перенести.
+        struct ScheduleEntry
+        {
+            FileInfo file;
+            uint32_t fragments = 0;
+            uint32_t clusters = 0;
+            double score = 0;
+            bool moved = false;
+        };
+        // Вывод очереди последней дефрагментации директории.
+        void print_schedule() const;
+
+        // Файл, частично дефрагментированный из-за нехватки
+        // непрерывного свободного места.
+        struct PartialMove
+        {
+            FileInfo file;
+            uint32_t fragments_before = 0;
+            uint32_t fragments_after = 0;
+        };
+        // Вывод частично дефрагментированных файлов.
+        void print_partial_moves() const;
+
     protected:
+        // Непрерывный участок кластеров.
+        struct Extent
+        {
+            uint32_t first = 0;
+            uint32_t count = 0;
+        };
+        // Результат копирования цепочки.
+        enum CopyResult
+        {
+            COPY_DONE,
+            COPY_FAILED,  // ошибка чтения или записи
+            COPY_MISMATCH // данные, считанные обратно, не совпали
+        };
+
+        // Состояние цепочки, отмеченной в карте принадлежности.
+        struct ChainStatus
+        {
+            uint32_t length = 0;
+            uint32_t cross_owner = 0; // первый встреченный чужой владелец
+            bool cycle = false;
+            bool bad_cluster = false;
+            bool invalid_link = false;
+        };
+
         // Экземпляр класса PBR(Partition Boot Record).
         // Используется для хранения сведений о разделе.
         // К нему регулярно приходится обращаться для работы с разделом.
         PBR m_pbr;
 
-        // Контейнер для байт таблицы FAT. Из него считываются данные
+        // Таблица FAT в виде участков. Из неё считываются данные
         // о занимаемых файлами кластерах. При необходимости, в таблицу
-        // вносятся изменения, после чего, она может быть записана
-        // обратно в файл устройства для фиксации изменений.
-        Bytes m_FAT;
+        // вносятся изменения, после чего изменённые сектора
+        // записываются обратно в файл устройства во все копии.
+        FatRuns m_FAT;
+        // Контрольные суммы секторов таблицы в том виде, в котором
+        // она записана на накопителе. Считаются при чтении таблицы
+        // и обновляются для записываемых секторов.
+        std::vector<uint32_t> m_fat_hashes;
 
         // Экземпляр, реализующий доступ к файлу устройства.
         // Через него осуществляется доступ к файлам в разделе, его данным.
         // С помощью этого экземпляра также осуществляется запись
         // всех изменений на раздел.
         std::fstream m_drive;
+        // Путь к файлу устройства.
+        std::string m_path;
+        // Позиционный доступ к файлу устройства для переноса данных
+        // кластеров: единственный дескриптор, через который они
+        // записываются. Открывается в режиме BUFFERED вместе с разделом,
+        // режим меняется методом set_io_mode().
+        DriveIO m_io;
+        // Позиционный доступ через страничный кэш для упреждающего
+        // чтения директорий и копий таблицы FAT.
+        DriveIO m_reader;
+        // Параметры переноса данных и признак калибровки перед первым
+        // перемещением.
+        IoProfile m_io_profile;
+        bool m_auto_calibrate = true;
+        // Очередь дефрагментации директории и бюджет переноса.
+        std::vector<ScheduleEntry> m_schedule;
+        std::vector<PartialMove> m_partial_moves;
+        uint64_t m_move_budget = 0;
+        // Копирование ядром отключается после первой неудачи.
+        bool m_kernel_copy = true;
+        CopyStats m_copy_stats[COPY_METHODS];
+        // Освобождение кластеров, оставленных перенесёнными файлами,
+        // на накопителе. Участки накапливаются до фиксации прохода.
+        bool m_discard = false;
+        std::vector<Extent> m_freed;
+        DiscardStats m_discard_stats;
+        // Ход текущей операции. Обработчик вызывается не чаще, чем раз
+        // в progress_interval, и обязательно - по завершении операции.
+        ProgressCallback m_progress_callback;
+        Progress m_progress;
+        std::chrono::steady_clock::time_point m_progress_start;
+        std::chrono::steady_clock::time_point m_progress_reported;
+        static constexpr double progress_interval = 0.25;
+        // Текущая скорость переноса и обработки байт, байт/с:
+        // экспоненциальное скользящее среднее с постоянной времени
+        // progress_window (отрицательное значение - замеров ещё нет),
+        // и значения счётчиков при предыдущем замере.
+        double m_move_rate = -1;
+        double m_done_rate = -1;
+        uint64_t m_rate_moved = 0;
+        uint64_t m_rate_done = 0;
+        static constexpr double progress_window = 5.0;
+        // Запрос отмены. Проверяется перед каждым перемещением файла,
+        // поэтому операция останавливается между фиксациями таблицы.
+        std::atomic<bool> m_cancel{ false };
+        // Кэш директорий, найденных методом get_file(), по пути.
+        // Очищается при перемещении любой директории, поскольку
+        // при этом меняется её первый кластер.
+        std::unordered_map<std::string, FileInfo> m_dir_cache;
+        // Отложенные изменения первого кластера в записях файлов:
+        // смещение записи - новый номер кластера.
+        std::map<uint64_t, uint32_t> m_entry_patches;
+
+        // Обратная карта принадлежности кластеров: элемент с индексом,
+        // равным номеру кластера, хранит индекс владельца в таблице
+        // файлов m_files, увеличенный на единицу. Ноль означает, что
+        // кластер не принадлежит ни одному найденному файлу.
+        // Занимает 4 байта на кластер. Пуста, пока не построена
+        // методом build_owner_map().
+        std::vector<uint32_t> m_owners;
+        // Запись таблицы файлов тома. Имя хранится в арене обхода
+        // и задаётся номером.
+        struct ScanRecord
+        {
+            uint64_t entry_offset = 0;
+            uint32_t first_cluster = 0;
+            uint32_t size = 0;
+            uint32_t name = 0;
+            FileType type = NONE;
+        };
+        // Таблица файлов тома, заполняемая при обходе дерева каталогов.
+        // Освобождается целиком перед каждым обходом.
+        ScanArena<ScanRecord> m_files;
+        // Снимок прошлого обхода и сведения текущего обхода для
+        // следующего снимка. Списки origin и links идут параллельно
+        // таблице файлов: номер записи в прежнем снимке (NO_RECORD -
+        // записи нет) и ссылки записи на вложенные записи, участки
+        // цепочки и суммы кластеров директории.
+        struct ScanState
+        {
+            ScanCache snapshot;
+            // Суммы секторов таблицы FAT и количество изменённых
+            // секторов до каждого сектора (префиксные суммы).
+            std::vector<uint32_t> fat_hashes;
+            std::vector<uint32_t> changed_before;
+            // Записи прежнего снимка по первому кластеру и суммы
+            // кластеров директорий, считанных с накопителя заранее.
+            std::unordered_map<uint32_t, uint32_t> by_cluster;
+            std::unordered_map<uint32_t, uint64_t> dir_hashes;
+            std::vector<uint32_t> origin;
+            std::vector<ScanCache::Record> links;
+            std::vector<ScanCache::Extent> extents;
+            std::vector<ScanCache::DirCluster> hashes;
+            ScanCacheStats stats;
+        };
+        static constexpr uint32_t NO_RECORD = 0xFFFFFFFFU;
+        bool m_scan_cache = true;
+        ScanState m_scan;
+        // Кластеры, на которые ссылаются цепочки нескольких файлов.
+        std::vector<uint32_t> m_cross_links;
+        // Значение карты для кластера, принадлежащего нескольким файлам.
+        static const uint32_t CROSS_LINKED = 0xFFFFFFFFU;
+
+        // Проверка перенесённых данных по контрольным суммам
+        // и количество файлов, перенос которых был отменён из-за
+        // несовпадения сумм.
+        bool m_verify = false;
+        uint32_t m_verify_failures = 0;
+
+        // Первые кластеры файлов, цепочки которых повреждены.
+        // Такие файлы не перемещаются.
+        std::unordered_set<uint32_t> m_blocked;
+        // Признак выполненной проверки таблицы FAT.
+        bool m_checked = false;
+        CheckReport m_check_report;
+
+        // Количество свободных кластеров (0xFFFFFFFF - неизвестно) и
+        // кластер, с которого начинается поиск свободного места.
+        // Количество подсчитывается по таблице при её загрузке
+        // и изменяется в set_fat_entry(); подсказка при открытии
+        // раздела FAT32 берётся из сектора FSInfo.
+        uint32_t m_free_clusters = 0xFFFFFFFFU;
+        uint32_t m_next_free = 2U;
+
+        // Сравнение копий таблицы FAT. Копии сохраняются в памяти
+        // только при расхождении и только до первой записи таблицы,
+        // чтобы основную копию можно было выбрать заново.
+        FatPolicy m_fat_policy = FAT_VALID;
+        FatMirrorReport m_mirror_report;
+        std::vector<Bytes> m_fat_copies;
 
         // Метод для инициализации экземпляра класса:
         // - Открывается поток к файлу устройства для чтения и записи;
         // - Считывается загрузочная запись раздела, и если запись подлинная,
         // - Считывается таблица FAT в контейнер.
-        auto init(const std::string& path) -> void;
+        auto init(const std::string& path, uint64_t offset) -> void;
+
+        // Копии таблицы FAT:
+
+        // Метод считывает все копии таблицы параллельно, сравнивает
+        // их и переносит основную копию в m_FAT.
+        auto load_fat() -> void;
+        // Сравнение копий по секторам. Различающиеся сектора попадают
+        // в отчёт.
+        auto compare_fat_copies(const std::vector<Bytes>& copies,
+            const std::vector<bool>& readable) -> void;
+        // Выбор основной копии по m_fat_policy.
+        auto select_fat_copy() -> void;
+        // Число недопустимых ссылок копии в различающихся секторах.
+        auto count_invalid_entries(const Bytes& fat) const -> uint32_t;
+        // Запись изменённых секторов основной копии во все копии
+        // таблицы. Соседние сектора записываются одним запросом.
+        auto write_fat() -> void;
 
         // Поиск файла:
 
@@ -78,11 +486,6 @@ class Partition
         // до первого слэша ("/").
         auto cut_string(std::string& path, char ch) -> void;
 
-        // Метод ищет файл по указанному имени в кластере буферизованной
-        // директории. При нахождении, возвращает заполненный экземпляр
-        // класса FileInfo с данными файла.
-        auto search_file(std::string& filename, 
-            Bytes& dir_cluster) -> Partition::FileInfo;
         // Вспомогательный метод для извлечения имени файла из байт
         // в буфферизованной директории. Имя затем сравнивается с искомым.
         auto get_entry_name(Bytes& dir, size_t offset) -> std::string;
@@ -97,11 +500,136 @@ class Partition
         // изменений.
         auto get_file_from_entry(Bytes& dir,
             uint32_t dir_cluster_number, size_t offset) -> FileInfo;
+        // То же без имени: запись таблицы файлов тома.
+        auto get_record_from_entry(Bytes& dir,
+            uint32_t dir_cluster_number, size_t offset) -> ScanRecord;
 
         // Метод возвращает экземпляр, заполненный данными по корневой
         // директории. 
         auto get_root_dir() -> FileInfo;
 
+        // Метод считывает директорию непрерывными участками цепочки
+        // (для корневой директории FAT12/FAT16 - всю её область),
+        // каждый одним запросом, и передаёт буфер с номером первого
+        // кластера участка в функцию-обработчик. Следующий участок
+        // считывается заранее, пока обрабатывается текущий.
+        // Обработчик возвращает false, чтобы прекратить чтение.
+        auto for_each_dir_extent(const FileInfo& dir,
+            std::function<bool(Bytes&, uint32_t)> handler) -> void;
+        // Метод разбивает цепочку кластеров на непрерывные участки.
+        auto get_chain_extents(uint32_t first_cluster) 
+            -> std::vector<Extent>;
+
+        // Карта принадлежности кластеров:
+
+        // Метод заполняет таблицу файлов обходом дерева каталогов
+        // и подготавливает пустую карту принадлежности.
+        auto collect_tree() -> void;
+        // Рекурсивный обход директории, добавляющий вложенные файлы
+        // и директории в таблицу файлов. Параметр index - номер
+        // записи директории в таблице файлов.
+        auto collect_files(const FileInfo& dir, uint32_t index) -> void;
+        // Обход вложенной директории с указанным номером: из снимка,
+        // если она не изменилась, иначе - разбором.
+        auto collect_dir(uint32_t index) -> void;
+        // Добавление записи в таблицу файлов вместе со сведениями
+        // для снимка.
+        auto add_file_record(const ScanRecord& record, uint32_t origin)
+            -> void;
+        // Экземпляр FileInfo для записи таблицы файлов с указанным
+        // индексом. Имя копируется из арены только здесь.
+        auto make_file_info(uint32_t index) const -> FileInfo;
+        // Метод отмечает в карте все кластеры цепочки файла
+        // с указанным индексом в таблице файлов и возвращает
+        // обнаруженные при этом нарушения.
+        // Участки цепочки добавляются в extents, если он указан.
+        auto mark_chain(uint32_t index, uint32_t first_cluster,
+            std::vector<ScanCache::Extent>* extents = nullptr)
+            -> ChainStatus;
+        // Отметка кластера цепочки файла. Возвращает false, если
+        // кластер уже принадлежит этому файлу (цикл).
+        auto claim_cluster(uint32_t index, uint32_t cluster,
+            ChainStatus& status) -> bool;
+        // Отметка цепочки записи таблицы файлов: по участкам из снимка,
+        // если элементы цепочки не менялись, иначе - по таблице FAT.
+        auto mark_file(uint32_t index) -> ChainStatus;
+
+        // Снимок обхода тома (Partition_cache.cpp):
+
+        // Загрузка снимка и сравнение с ним таблицы FAT и директорий.
+        auto begin_scan() -> void;
+        // Сохранение снимка по итогам обхода и отметки цепочек.
+        auto save_scan() -> void;
+        // Суммы секторов текущей таблицы FAT, с учётом изменений,
+        // ещё не записанных на накопитель.
+        auto fat_sector_hashes() const -> std::vector<uint32_t>;
+        // Обновление сумм секторов таблицы, начиная с first_sector,
+        // по их содержимому.
+        auto update_fat_hashes(const Bytes& sectors, uint32_t first_sector)
+            -> void;
+        // Участки цепочки записи прежнего снимка действительны: первый
+        // кластер совпадает и элементы цепочки лежат в неизменных
+        // секторах таблицы.
+        auto is_chain_unchanged(uint32_t origin, uint32_t first_cluster) const
+            -> bool;
+        // Перенос вложенных записей неизменной директории из снимка.
+        // Возвращает false, если директория изменилась.
+        auto reuse_dir(uint32_t index) -> bool;
+        // Суммы кластеров директории, разобранных при обходе.
+        auto hash_dir_clusters(const char* data, uint32_t cluster,
+            uint32_t count) -> void;
+
+        // Доступ к таблице FAT:
+
+        // Значение элемента таблицы FAT для указанного кластера
+        // с учётом разрядности FAT12/FAT16/FAT32.
+        auto get_fat_entry(uint32_t cluster) const -> uint32_t;
+        // Значащие биты элемента: в FAT32 старшие 4 бита зарезервированы.
+        auto fat_entry_mask() const -> uint32_t;
+        // Первый участок свободных кластеров в диапазоне [first, last]
+        // (count == 0, если их нет). Таблица просматривается участками
+        // FatRuns, а не поэлементно.
+        auto next_free_run(uint32_t first, uint32_t last) const -> Extent;
+        // То же для произвольной копии таблицы.
+        auto read_fat_entry(const Bytes& fat, uint32_t cluster) const 
+            -> uint32_t;
+        auto set_fat_entry(uint32_t cluster, uint32_t value) -> void;
+        // Разрядность элемента таблицы: 12, 16 или 32 бита.
+        auto fat_entry_bits() const -> uint32_t;
+        // Значение, записываемое в последний элемент цепочки.
+        auto end_of_chain() const -> uint32_t;
+        // Проверки значения элемента: конец цепочки, повреждённый
+        // кластер, ссылка на кластер области данных.
+        auto is_chain_end(uint32_t value) const -> bool;
+        auto is_bad_cluster(uint32_t value) const -> bool;
+        auto is_next_cluster(uint32_t value) const -> bool;
+        // Возвращает индекс файла в таблице файлов, увеличенный на 1,
+        // по номеру его первого кластера (0 - если файл не найден).
+        auto find_owner(uint32_t first_cluster) const -> uint32_t;
+
+        // Упорядоченное размещение:
+
+        // Метод размещает цепочку файла в первом подходящем свободном
+        // участке не ранее кластера cursor, если файл фрагментирован
+        // или новое место ближе к началу раздела. Курсор сдвигается
+        // за конец файла, если файл занял место у курсора.
+        auto place_file(FileInfo& file, uint32_t& cursor) -> uint32_t;
+        // Метод подсчитывает разрывы при последовательном чтении
+        // цепочек файлов в указанном порядке.
+        auto count_seeks(const std::vector<FileInfo>& files) -> uint32_t;
+        // Метод освобождает окно [first, first + count) для файла
+        // профиля, вытесняя из него файлы, не входящие в профиль,
+        // в свободное место после кластера reserved_end.
+        // Возвращает false, если окно освободить невозможно.
+        auto clear_window(uint32_t first, uint32_t count,
+            uint32_t reserved_end, const std::vector<bool>& hot,
+            uint32_t& evicted) -> bool;
+        // Метод возвращает список свободных участков области данных.
+        auto collect_free_runs() -> std::vector<Extent>;
+        // Метод возвращает вложенные файлы и директории из записей
+        // указанной директории в порядке следования записей.
+        auto list_dir(const FileInfo& dir) -> std::vector<FileInfo>;
+
         // Обнаружение/устранение фрагментации
 
         // Главная функция дефрагментации - осуществляет проверку
@@ -109,18 +637,108 @@ class Partition
         // поскольку, каталоги также, в теории, могут быть фрагментированы. 
         auto defragment_file(FileInfo& file) -> uint32_t;
         // Вспомогательный метод при обработке директорий.
-        // Проходится по всем кластерам директории, вызывая
-        // для каждого кластера метод defragment_dir_cluster().
+        // Дефрагментирует файлы и директории, вложенные в указанную,
+        // в порядке, составленном методом build_schedule().
         auto defragment_dir(FileInfo& file) -> uint32_t;
-        // Метод, извлекающий из буферизованных кластеров директорий
-        // файлы, которые затем передаёт в метод defragment_file().
-        auto defragment_dir_cluster(Bytes& dir_cluster, 
-            uint32_t cluster_number) -> uint32_t;
-        // Метод, копирующий указанный кластер по указанному адресу.
-        auto copy_cluster(uint32_t source, uint32_t destination) -> void;
+        // Планирование дефрагментации:
+
+        // Метод оценивает выгоду дефрагментации файла: заполняет
+        // количество фрагментов и кластеров и оценку в записи.
+        auto estimate_benefit(ScheduleEntry& entry) -> void;
+        // Метод составляет очередь фрагментированных файлов указанной
+        // директории, упорядоченную по убыванию оценки.
+        auto build_schedule(const FileInfo& dir) -> void;
+
+        // Метод копирует непрерывный участок кластеров по указанному
+        // адресу. Сначала используется копирование ядром, при его
+        // недоступности - чтение и запись через память процесса.
+        // Время и объём переноса учитываются для каждого способа.
+        auto copy_extent(uint32_t source, uint32_t destination,
+            uint32_t count) -> bool;
+        // Чтение и запись непрерывного участка кластеров через m_io,
+        // если его удалось открыть, иначе через m_drive.
+        auto read_clusters(char* buff, uint32_t cluster,
+            uint32_t count) -> bool;
+        auto write_clusters(const char* buff, uint32_t cluster,
+            uint32_t count) -> bool;
+        // Выравнивание буферов для переноса данных кластеров.
+        auto io_alignment() const -> size_t;
+        // Перенос участка запросами по chunk кластеров, не более depth
+        // одновременно. При source == destination данные перезаписываются
+        // на место (используется при калибровке).
+        auto transfer_clusters(uint32_t source, uint32_t destination,
+            uint32_t count, uint32_t chunk, uint32_t depth) -> bool;
+        // Замер скорости чтения и записи участка свободных кластеров
+        // с указанными параметрами, Mb/s (0 - при ошибке).
+        auto probe_io(uint32_t first, uint32_t count, uint32_t chunk,
+            uint32_t depth) -> double;
+        // Сохранённые результаты калибровки по серийному номеру тома.
+        auto load_io_profile() -> bool;
+        auto save_io_profile() const -> void;
+        // Метод переносит цепочку файла в непрерывный участок свободных
+        // кластеров, начинающийся с указанного кластера, и фиксирует
+        // изменения в таблицах FAT и в записи файла.
+        // При включённой проверке возвращает false, если перенесённые
+        // данные не совпали с исходными, и изменения не фиксируются.
+        auto move_file(FileInfo& file, uint32_t destination) -> bool;
+        // Перенос цепочки файла в несколько непрерывных участков:
+        // кластеры файла размещаются в участках по порядку. Суммарная
+        // длина участков должна совпадать с длиной цепочки.
+        auto move_file(FileInfo& file, const std::vector<Extent>& destination)
+            -> bool;
+        // Частичная дефрагментация: файл собирается из наименьшего
+        // числа наибольших свободных участков, если непрерывного
+        // участка нужной длины нет. Возвращает true, если файл
+        // перенесён и число его фрагментов уменьшилось.
+        auto defragment_partially(FileInfo& file) -> bool;
+        // Метод копирует цепочку из указанного количества кластеров
+        // в непрерывный участок. При включённой проверке сравнивает
+        // контрольные суммы исходных и записанных данных.
+        auto copy_chain(uint32_t source, uint32_t destination,
+            uint32_t clusters_number) -> CopyResult;
+        // Метод откладывает запись номера первого кластера в запись
+        // файла. Изменения применяются методом flush_entry_patches().
+        auto write_entry_cluster(uint64_t entry_offset,
+            uint32_t cluster) -> void;
+        // Метод применяет отложенные изменения записей: каждый
+        // затронутый сектор директории считывается и записывается
+        // один раз, номер кластера записывается в оба слова записи
+        // (старшее по смещению 0x14 - только для FAT32).
+        auto flush_entry_patches() -> void;
+        // Метод обновляет записи "." перемещённой директории и ".."
+        // её вложенных директорий.
+        auto update_dir_links(const FileInfo& dir) -> void;
+        // Смещение кластера с указанным номером от начала раздела.
+        auto cluster_offset(uint32_t cluster) const -> uint64_t;
         // Метод, используемый для поиска требуемого свободного пространства
         // для дефрагментации файла.
         auto find_empty_space(uint32_t clusters_number) -> uint32_t;
+        // Поиск непрерывного участка свободных кластеров
+        // в диапазоне [first, last].
+        auto find_free_run(uint32_t first, uint32_t last, 
+            uint32_t clusters_number) -> uint32_t;
+        // Подсчёт свободных кластеров по таблице FAT из контейнера.
+        auto count_free_clusters() -> uint32_t;
+        // Метод фиксирует точные сведения о свободном месте
+        // в секторе FSInfo после завершённого прохода дефрагментации.
+        auto commit_fsinfo() -> void;
+        // Освобождение накопленных участков на накопителе. Перед этим
+        // таблица FAT и записи файлов, которые на них больше не
+        // ссылаются, сбрасываются на накопитель.
+        auto discard_freed() -> void;
+
+        // Ход операции:
+
+        // Начало операции: сброс счётчиков и запроса отмены.
+        auto begin_progress(uint32_t files_total, uint64_t bytes_total)
+            -> void;
+        // Увеличение общего объёма работы, найденной при обходе.
+        auto add_progress_total(uint32_t files, uint64_t bytes) -> void;
+        // Файл обработан: перенесён или оставлен на месте.
+        auto advance_progress(const FileInfo& file, uint64_t bytes) -> void;
+        // Пересчёт скорости и оценки времени и вызов обработчика.
+        auto report_progress(bool force) -> void;
+        auto end_progress() -> void;
         // Метод для подсчёта занимаемых файлом кластеров.
         // Универсален для любых типов файлов, поскольку высчитывает
         // кластеры по таблице FAT из контейнера.
@@ -131,7 +749,10 @@ class Partition
         // при указании пути. При некорректном пути, потребуется
         // создавать новый экземпляр. Это сказывается на гибкости,
         // но несколько сокращает возможные ошибки.
-        Partition(const std::string& path) { init(path); }
+        // Смещение offset указывается для раздела, открываемого через
+        // файл всего накопителя или образа с таблицей разделов.
+        Partition(const std::string& path, uint64_t offset = 0)
+            { init(path, offset); }
 
         // Метод для проверки, был ли инициализирован экземпляр корректно.
         auto is_open() const -> bool;
@@ -143,14 +764,141 @@ class Partition
 
         // Метод, используемый для проверки файла на фрагментацию.
         auto is_file_fragmented(const FileInfo& file) -> uint32_t;
+        // Количество свободных кластеров раздела. Для FAT32 берётся
+        // из сектора FSInfo без просмотра таблицы FAT.
+        auto get_free_clusters() -> uint32_t;
+
+        // Проверка целостности таблицы FAT перед дефрагментацией.
+        // Таблица просматривается параллельно по частям, затем
+        // цепочки файлов сверяются с деревом каталогов. Файлы
+        // с нарушениями блокируются для перемещения. Выполняется
+        // автоматически перед первым проходом дефрагментации.
+        auto check_fat() -> CheckReport;
+        auto get_check_report() const -> const CheckReport&
+            { return m_check_report; }
+
+        // Выбор режима ввода-вывода для переноса данных кластеров.
+        // Режим DIRECT работает в обход страничного кэша с буферами
+        // и смещениями, выровненными по размеру сектора. Возвращает
+        // фактически установленный режим: если устройство или образ
+        // не поддерживает O_DIRECT или кластеры раздела не выровнены
+        // для него, используется BUFFERED.
+        auto set_io_mode(DriveIO::Mode mode) -> DriveIO::Mode;
+        // Калибровка переноса данных: короткие замеры чтения и записи
+        // в свободном месте раздела при разных размерах запроса
+        // и количестве одновременных запросов. Результат сохраняется
+        // по серийному номеру тома и режиму ввода-вывода и при
+        // следующем открытии берётся без замеров. Выполняется
+        // автоматически перед первым перемещением.
+        auto calibrate_io() -> const IoProfile&;
+        auto get_io_profile() const -> const IoProfile&
+            { return m_io_profile; }
+        auto set_auto_calibration(bool enabled) -> void
+            { m_auto_calibrate = enabled; }
+
+        // Включение проверки перенесённых данных по контрольным суммам
+        // CRC32C перед фиксацией изменений в таблице FAT.
+        auto set_verify(bool verify) -> void { m_verify = verify; }
+        // Освобождение кластеров, оставленных перенесёнными файлами,
+        // на накопителе (TRIM для SSD и карт памяти, удаление участков
+        // из разреженного файла образа). Участки объединяются
+        // и освобождаются при фиксации прохода.
+        auto set_discard(bool discard) -> void { m_discard = discard; }
+        // Сохранение результатов обхода тома между запусками
+        // (включено по умолчанию). Снимок хранится в домашнем каталоге
+        // и выбирается по серийному номеру тома; при следующем обходе
+        // заново разбираются только изменившиеся директории и цепочки.
+        auto set_scan_cache(bool enabled) -> void { m_scan_cache = enabled; }
+        auto get_scan_cache_stats() const -> const ScanCacheStats&
+            { return m_scan.stats; }
+        // Количество файлов, перенос которых был отменён из-за
+        // несовпадения контрольных сумм. Ошибки чтения и записи
+        // сюда не входят.
+        auto get_verify_failures() const -> uint32_t
+            { return m_verify_failures; }
+        // Обработчик хода операций дефрагментации и размещения.
+        // Вызывается в потоке, выполняющем операцию.
+        auto set_progress_callback(ProgressCallback callback) -> void
+            { m_progress_callback = std::move(callback); }
+        // Запрос отмены текущей операции. Может вызываться из другого
+        // потока или обработчика сигнала. Операция завершается после
+        // перемещения текущего файла: изменения фиксируются, остальные
+        // файлы не перемещаются. Запрос действует до сброса методом
+        // clear_cancel(), поэтому отмена, поступившая до начала
+        // операции, не теряется. Сброс выполняет вызывающая сторона
+        // перед началом нового задания.
+        auto cancel() -> void { m_cancel = true; }
+        auto clear_cancel() -> void { m_cancel = false; }
+        auto is_cancelled() const -> bool { return m_cancel; }
+        // Ограничение объёма данных, переносимых за одну дефрагментацию
+        // директории, в байтах (0 - без ограничения).
+        auto set_move_budget(uint64_t bytes) -> void
+            { m_move_budget = bytes; }
+        // Частично дефрагментированные файлы последнего запуска.
+        auto get_partial_moves() const -> const std::vector<PartialMove>&
+            { return m_partial_moves; }
+        // Очередь последней дефрагментации директории с оценками.
+        auto get_schedule() const -> const std::vector<ScheduleEntry>&
+            { return m_schedule; }
+        // Статистика переноса данных указанным способом.
+        auto get_copy_stats(CopyMethod method) const -> const CopyStats&
+            { return m_copy_stats[method]; }
+        auto get_discard_stats() const -> const DiscardStats&
+            { return m_discard_stats; }
+        // Итоги сравнения копий таблицы FAT при открытии раздела.
+        auto get_fat_mirror_report() const -> const FatMirrorReport&
+            { return m_mirror_report; }
+        // Смена правила выбора основной копии таблицы FAT. Копия
+        // выбирается заново, если копии различаются и таблица ещё
+        // не изменялась.
+        auto set_fat_policy(FatPolicy policy) -> void;
         // Открытый метод, запускающий процесс дефрагментации файла.
         // Возвращает количество дефрагментированных файлов.
         auto defragment(FileInfo& file) -> uint32_t;
+        // Открытый метод дефрагментации дерева каталогов с упорядоченным
+        // размещением: цепочки директорий укладываются друг за другом
+        // в начале области данных в порядке обхода в ширину, а за ними
+        // следуют файлы каждой директории в порядке записей.
+        // Возвращает количество перемещённых файлов и директорий.
+        auto defragment_tree(FileInfo& dir) -> uint32_t;
+        // Метод размещает файлы профиля доступа непрерывно, один за
+        // другим, в начале области данных в порядке следования путей.
+        // Мешающие файлы, не входящие в профиль, вытесняются.
+        auto place_by_profile(const std::vector<std::string>& paths)
+            -> ProfileReport;
+
+        // Метод переносит небольшие непрерывные файлы (не более
+        // max_clusters кластеров, 0 - не более 1 Mb) в свободные
+        // промежутки ближе к началу раздела, чтобы увеличить наибольший
+        // свободный участок. Переносятся только файлы хвоста раздела
+        // и файлы между двумя промежутками, и только если наибольший
+        // участок от этого растёт. Каждый файл переносится
+        // в наименьший подходящий промежуток перед ним.
+        auto pack_small_files(uint32_t max_clusters = 0) -> PackReport;
+
+        // Метод строит карту принадлежности кластеров за один обход
+        // дерева каталогов и один проход по цепочкам таблицы FAT.
+        // Возвращает количество файлов в таблице файлов.
+        auto build_owner_map() -> uint32_t;
+        // Метод строит карту тома из не более чем resolution участков.
+        // Карта принадлежности строится заново, таблица FAT
+        // просматривается параллельно по частям.
+        auto build_cluster_map(uint32_t resolution = 65536U) -> ClusterMap;
+        // Возвращает сведения о файле, которому принадлежит кластер.
+        // Если кластер свободен, не принадлежит найденным файлам или
+        // принадлежит нескольким файлам, возвращается пустой экземпляр.
+        auto get_owner(uint32_t cluster) const -> FileInfo;
+        // Список кластеров, принадлежащих нескольким файлам.
+        auto get_cross_links() const -> const std::vector<uint32_t>&
+            { return m_cross_links; }
 
         ~Partition() 
         {
             if (m_drive.is_open())
+            {
+                flush_entry_patches();
                 m_drive.close();
+            }
         }
 };
 
@@ -0,0 +1,239 @@
+#include <algorithm> // std::min
+#include <future> // std::async
+#include <fstream> // std::ifstream
+#include <filesystem> // std::filesystem::directory_iterator
+#include <fcntl.h> // open()
+#include <unistd.h> // pread(), close()
+#include <sys/stat.h> // fstat()
+#include <sys/ioctl.h> // ioctl()
+#ifdef __linux__
+#include <linux/fs.h> // BLKSSZGET
+#endif
+
+#include "PartitionTable.h"
+
+namespace
+{
+    namespace Offsets
+    {
+        const size_t mbr_entries = 0x1BE;
+        const size_t mbr_type = 0x04;
+        const size_t mbr_first_lba = 0x08;
+        const size_t gpt_entries_lba = 0x48;
+        const size_t gpt_entries_number = 0x50;
+        const size_t gpt_entry_size = 0x54;
+        const size_t gpt_first_lba = 0x20;
+        const size_t signature = 0x1FE;
+    }
+    namespace Values
+    {
+        const uint16_t signature = 0xAA55;
+        const uint8_t extended_chs = 0x05;
+        const uint8_t extended_lba = 0x0F;
+        const uint8_t extended_linux = 0x85;
+        const uint8_t mbr_entry_size = 16;
+        const uint8_t mbr_primary_number = 4;
+        const uint32_t gpt_max_entries = 1024;
+        const uint32_t ebr_max_chain = 256;
+        const uint16_t boot_record = 512;
+        const uint32_t sysfs_sector = 512;
+    }
+
+    bool is_extended(uint8_t type)
+    {
+        return type == Values::extended_chs || type == Values::extended_lba
+            || type == Values::extended_linux;
+    }
+}
+
+bool PartitionTable::read_at(int fd, Bytes& buff, uint64_t offset)
+{
+    ssize_t done = pread(fd, buff, buff.length(), offset);
+    return done == static_cast<ssize_t>(buff.length());
+}
+
+bool PartitionTable::parse_gpt(int fd, uint32_t sector_size,
+    std::vector<Region>& regions)
+{
+    Bytes header(sector_size);
+    if (!read_at(fd, header, sector_size)
+        || header.get_string(0, 8) != "EFI PART")
+        return false;
+
+    uint64_t entries_lba = header.get_value<uint64_t>(Offsets::gpt_entries_lba);
+    uint32_t entries_number = std::min(Values::gpt_max_entries,
+        header.get_value<uint32_t>(Offsets::gpt_entries_number));
+    uint32_t entry_size = header.get_value<uint32_t>(Offsets::gpt_entry_size);
+    if (entry_size < 128U || entry_size % 8U != 0)
+        return false;
+
+    // Массив записей считывается одним запросом.
+    Bytes entries(static_cast<size_t>(entries_number) * entry_size);
+    if (!read_at(fd, entries, entries_lba * sector_size))
+        return false;
+    for (uint32_t i = 0; i < entries_number; ++i)
+    {
+        size_t entry = static_cast<size_t>(i) * entry_size;
+        // Нулевой GUID типа означает неиспользуемую запись.
+        if (entries.get_value<uint64_t>(entry) == 0
+            && entries.get_value<uint64_t>(entry + 8U) == 0)
+            continue;
+        uint64_t first_lba = entries.get_value<uint64_t>
+            (entry + Offsets::gpt_first_lba);
+        regions.push_back({ first_lba * sector_size, GPT, i + 1U });
+    }
+    return true;
+}
+
+void PartitionTable::parse_mbr(int fd, const Bytes& mbr,
+    uint32_t sector_size, std::vector<Region>& regions)
+{
+    for (uint8_t i = 0; i < Values::mbr_primary_number; ++i)
+    {
+        size_t entry = Offsets::mbr_entries + i * Values::mbr_entry_size;
+        uint8_t type = mbr.get_value<uint8_t>(entry + Offsets::mbr_type);
+        uint32_t first_lba = mbr.get_value<uint32_t>
+            (entry + Offsets::mbr_first_lba);
+        if (type == 0 || first_lba == 0)
+            continue;
+        if (is_extended(type))
+            parse_ebr(fd, first_lba, sector_size, 5U, regions);
+        else
+            regions.push_back({ static_cast<uint64_t>(first_lba)
+                * sector_size, MBR, i + 1U });
+    }
+}
+
+/* Расширенный раздел содержит цепочку записей EBR. Первая запись
+ * EBR описывает логический раздел (смещение - от самой записи),
+ * вторая - ссылку на следующую запись EBR (смещение - от начала
+ * расширенного раздела). Длина цепочки ограничена на случай
+ * зацикленных ссылок. */
+void PartitionTable::parse_ebr(int fd, uint64_t extended_lba,
+    uint32_t sector_size, uint32_t number, std::vector<Region>& regions)
+{
+    Bytes ebr(Values::boot_record);
+    uint64_t ebr_lba = extended_lba;
+    for (uint32_t steps = 0; steps < Values::ebr_max_chain; ++steps)
+    {
+        if (!read_at(fd, ebr, ebr_lba * sector_size)
+            || ebr.get_value<uint16_t>(Offsets::signature) != Values::signature)
+            return;
+        size_t logical = Offsets::mbr_entries;
+        size_t next = Offsets::mbr_entries + Values::mbr_entry_size;
+        uint32_t first_lba = ebr.get_value<uint32_t>
+            (logical + Offsets::mbr_first_lba);
+        if (ebr.get_value<uint8_t>(logical + Offsets::mbr_type) != 0
+            && first_lba != 0)
+            regions.push_back({ (ebr_lba + first_lba) * sector_size,
+                MBR, number++ });
+        uint32_t next_lba = ebr.get_value<uint32_t>
+            (next + Offsets::mbr_first_lba);
+        if (!is_extended(ebr.get_value<uint8_t>(next + Offsets::mbr_type))
+            || next_lba == 0)
+            return;
+        ebr_lba = extended_lba + next_lba;
+    }
+}
+
+std::vector<PartitionTable::Volume> PartitionTable::scan(const std::string& path)
+{
+    std::vector<Volume> volumes;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return volumes;
+
+    // Размер логического сектора определяется для блочных устройств.
+    // Для образов GPT ищется и при 512, и при 4096 байтах на сектор.
+    std::vector<uint32_t> sector_sizes = { 512U, 4096U };
+#ifdef BLKSSZGET
+    struct stat st;
+    int block_size = 0;
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)
+        && ioctl(fd, BLKSSZGET, &block_size) == 0 && block_size > 0)
+        sector_sizes = { static_cast<uint32_t>(block_size) };
+#endif
+
+    Bytes first(Values::boot_record);
+    std::vector<Region> regions;
+    if (read_at(fd, first, 0))
+    {
+        bool is_gpt = false;
+        for (auto size : sector_sizes)
+            if ((is_gpt = parse_gpt(fd, size, regions)))
+                break;
+        // Нулевой сектор может быть загрузочной записью раздела,
+        // занимающего весь файл. Она проверяется раньше MBR, поскольку
+        // тоже завершается сигнатурой 0xAA55.
+        PBR pbr;
+        if (!is_gpt)
+            pbr.set(first, 0);
+        if (!is_gpt && pbr.is_fat())
+            regions.push_back({ 0, NONE, 0 });
+        else if (!is_gpt && first.get_value<uint16_t>(Offsets::signature)
+            == Values::signature)
+            parse_mbr(fd, first, sector_sizes.front(), regions);
+    }
+
+    Bytes boot_record(Values::boot_record);
+    for (auto& region : regions)
+    {
+        if (!read_at(fd, boot_record, region.offset))
+            continue;
+        Volume volume;
+        volume.pbr.set(boot_record, region.offset);
+        if (!volume.pbr.is_fat())
+            continue;
+        volume.path = path;
+        volume.offset = region.offset;
+        volume.scheme = region.scheme;
+        volume.number = region.number;
+        find_partition_node(volume);
+        volumes.push_back(volume);
+    }
+    ::close(fd);
+    return volumes;
+}
+
+std::vector<PartitionTable::Volume> PartitionTable::scan
+    (const std::vector<std::string>& paths)
+{
+    // Каждый накопитель обрабатывается в отдельном потоке: время
+    // поиска определяется самым медленным накопителем, а не их суммой.
+    std::vector<std::future<std::vector<Volume>>> results;
+    for (auto& path : paths)
+        results.push_back(std::async(std::launch::async,
+            [&path]() { return scan(path); }));
+    std::vector<Volume> volumes;
+    for (auto& result : results)
+        for (auto& volume : result.get())
+            volumes.push_back(volume);
+    return volumes;
+}
+
+void PartitionTable::find_partition_node(Volume& volume)
+{
+    if (volume.offset == 0)
+        return;
+    namespace fs = std::filesystem;
+    std::error_code error;
+    fs::path disk = fs::path("/sys/block") / fs::path(volume.path).filename();
+    if (!fs::is_directory(disk, error))
+        return;
+    for (const auto& entry : fs::directory_iterator(disk, error))
+    {
+        // Начало раздела в sysfs указывается в 512-байтовых секторах.
+        std::ifstream start_file(entry.path() / "start");
+        uint64_t start = 0;
+        if (!(start_file >> start)
+            || start * Values::sysfs_sector != volume.offset)
+            continue;
+        fs::path node = fs::path("/dev") / entry.path().filename();
+        if (fs::exists(node, error))
+        {
+            volume.path = node.string();
+            volume.offset = 0;
+        }
+        return;
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef PARTITION_TABLE_H
+#define PARTITION_TABLE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Bytes.h"
+#include "PBR.h"
+
+// Класс поиска разделов FAT на накопителях и в файлах образов.
+// Накопитель открывается один раз, таблица разделов (MBR с цепочкой
+// расширенных записей EBR или GPT) разбирается позиционным чтением,
+// после чего считываются загрузочные записи найденных разделов.
+// Накопители обрабатываются параллельно.
+class PartitionTable
+{
+    public:
+        // Схема разметки, в которой найден раздел.
+        enum Scheme
+        {
+            NONE, // раздел занимает весь файл (без таблицы разделов)
+            MBR,
+            GPT
+        };
+
+        // Найденный раздел FAT. Смещение указывается в байтах
+        // от начала файла path.
+        struct Volume
+        {
+            std::string path;
+            uint64_t offset = 0;
+            Scheme scheme = NONE;
+            uint32_t number = 0; // номер раздела в таблице (с 1)
+            PBR pbr;
+        };
+
+    private:
+        // Участок накопителя, который может содержать раздел.
+        struct Region
+        {
+            uint64_t offset = 0;
+            Scheme scheme = NONE;
+            uint32_t number = 0;
+        };
+
+        // Чтение блока по смещению. Возвращает false при ошибке
+        // или неполном чтении.
+        static auto read_at(int fd, Bytes& buff, uint64_t offset) -> bool;
+
+        // Методы разбора таблиц разделов. Найденные участки
+        // добавляются в вектор regions.
+        static auto parse_gpt(int fd, uint32_t sector_size,
+            std::vector<Region>& regions) -> bool;
+        static auto parse_mbr(int fd, const Bytes& mbr,
+            uint32_t sector_size, std::vector<Region>& regions) -> void;
+        static auto parse_ebr(int fd, uint64_t extended_lba,
+            uint32_t sector_size, uint32_t number,
+            std::vector<Region>& regions) -> void;
+
+        // Для раздела блочного устройства метод подбирает специальный
+        // файл раздела (например, /dev/sdb1), чтобы раздел открывался
+        // и размонтировался так же, как при ручном указании пути.
+        static auto find_partition_node(Volume& volume) -> void;
+
+    public:
+        // Метод разбирает таблицу разделов накопителя или образа
+        // и возвращает найденные разделы FAT. Если файл сам является
+        // разделом FAT, возвращается один раздел со смещением 0.
+        static auto scan(const std::string& path) -> std::vector<Volume>;
+
+        // Параллельный поиск разделов на нескольких накопителях.
+        // Порядок результатов соответствует порядку путей.
+        static auto scan(const std::vector<std::string>& paths)
+            -> std::vector<Volume>;
+};
+
+#endif // PARTITION_TABLE_H
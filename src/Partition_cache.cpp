@@ -0,0 +1,292 @@
+#include "Partition.h"
+#include "PBR.h"
+#include "Checksum.h"
+
+#include <iostream>
+#include <cstdio> // std::snprintf
+#include <cstdlib> // std::getenv
+#include <algorithm> // std::min, std::max, std::sort, std::unique
+
+/* Снимок обхода сравнивается с томом в два этапа. Сначала таблица FAT
+ * сравнивается по секторам: участки цепочки из снимка действительны,
+ * если все их элементы лежат в неизменных секторах. Затем кластеры
+ * директорий с неизменными цепочками считываются одним проходом
+ * в порядке возрастания номеров и сравниваются по суммам: директория,
+ * все разобранные кластеры которой совпали, берётся из снимка. */
+namespace
+{
+    const char* cache_prefix = "/.fat_defrag_scan_";
+    const uint32_t max_read_bytes = 1048576U;
+
+    std::string scan_cache_path(uint32_t serial_number)
+    {
+        const char* home = std::getenv("HOME");
+        char serial[9];
+        std::snprintf(serial, sizeof(serial), "%08X", serial_number);
+        return std::string(home ? home : "/tmp") + cache_prefix + serial;
+    }
+}
+
+void Partition::update_fat_hashes(const Bytes& sectors,
+    uint32_t first_sector)
+{
+    uint32_t sector_size = m_pbr.get_parameters().bytes_per_sector;
+    size_t count = (sectors.length() + sector_size - 1U) / sector_size;
+    if (m_fat_hashes.size() < first_sector + count)
+        m_fat_hashes.resize(first_sector + count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t offset = i * sector_size;
+        m_fat_hashes[first_sector + i] = Checksum::crc32c(sectors + offset,
+            std::min<size_t>(sector_size, sectors.length() - offset));
+    }
+}
+
+std::vector<uint32_t> Partition::fat_sector_hashes() const
+{
+    // Восстанавливаются из участков только изменённые сектора:
+    // остальные совпадают с записанными на накопителе.
+    std::vector<uint32_t> hashes = m_fat_hashes;
+    for (auto sector : m_FAT.dirty_sectors())
+    {
+        Bytes buff = m_FAT.serialize(sector, 1U);
+        if (sector < hashes.size())
+            hashes[sector] = Checksum::crc32c(buff, buff.length());
+    }
+    return hashes;
+}
+
+void Partition::begin_scan()
+{
+    m_scan.snapshot.close();
+    m_scan.fat_hashes.clear();
+    m_scan.changed_before.clear();
+    m_scan.by_cluster.clear();
+    m_scan.dir_hashes.clear();
+    m_scan.origin.clear();
+    m_scan.links.clear();
+    m_scan.extents.clear();
+    m_scan.hashes.clear();
+    m_scan.stats = {};
+    if (!m_scan_cache)
+        return;
+
+    const PBR::Parameters& parameters = m_pbr.get_parameters();
+    m_scan.fat_hashes = fat_sector_hashes();
+    m_scan.stats.fat_sectors = m_scan.fat_hashes.size();
+    if (!m_scan.snapshot.load(scan_cache_path(parameters.serial_number)))
+        return;
+    const ScanCache::Header& header = m_scan.snapshot.header();
+    if (header.serial_number != parameters.serial_number
+        || header.cluster_size != parameters.cluster_size
+        || header.sector_size != parameters.bytes_per_sector
+        || header.fat_bits != fat_entry_bits()
+        || header.fat_sectors != m_scan.fat_hashes.size()
+        || header.last_cluster != parameters.last_cluster)
+    {
+        m_scan.snapshot.close();
+        return;
+    }
+    m_scan.stats.loaded = true;
+
+    m_scan.changed_before.assign(m_scan.fat_hashes.size() + 1U, 0);
+    for (size_t i = 0; i < m_scan.fat_hashes.size(); ++i)
+    {
+        bool changed = m_scan.snapshot.fat_hash(i) != m_scan.fat_hashes[i];
+        m_scan.changed_before[i + 1U] = m_scan.changed_before[i] + changed;
+    }
+    m_scan.stats.fat_sectors_changed = m_scan.changed_before.back();
+
+    // Записи снимка по первому кластеру и кластеры директорий,
+    // которые могут быть взяты из снимка.
+    std::vector<uint32_t> clusters;
+    for (uint32_t i = 0; i < header.records; ++i)
+    {
+        const ScanCache::Record& record = m_scan.snapshot.record(i);
+        if (record.first_cluster == 0 || record.type == ROOT_DIR)
+            continue;
+        m_scan.by_cluster.emplace(record.first_cluster, i);
+        if (record.type == DIR
+            && is_chain_unchanged(i, record.first_cluster))
+            for (uint32_t k = 0; k < record.hashes_count; ++k)
+                clusters.push_back(m_scan.snapshot.hash
+                    (record.hashes_begin + k).cluster);
+    }
+    std::sort(clusters.begin(), clusters.end());
+    clusters.erase(std::unique(clusters.begin(), clusters.end()),
+        clusters.end());
+
+    // Кластеры считываются подряд идущими участками, в порядке
+    // расположения на накопителе.
+    flush_entry_patches();
+    uint32_t cluster_size = parameters.cluster_size;
+    uint32_t max_clusters = std::max(1U, max_read_bytes / cluster_size);
+    Bytes buff(static_cast<size_t>(max_clusters) * cluster_size,
+        io_alignment());
+    for (size_t i = 0; i < clusters.size(); )
+    {
+        uint32_t count = 1U;
+        while (i + count < clusters.size() && count < max_clusters
+            && clusters[i + count] == clusters[i] + count)
+            ++count;
+        if (read_clusters(buff, clusters[i], count))
+            for (uint32_t k = 0; k < count; ++k)
+                m_scan.dir_hashes.emplace(clusters[i] + k, Checksum::hash64
+                    (buff + static_cast<size_t>(k) * cluster_size,
+                        cluster_size));
+        i += count;
+    }
+}
+
+bool Partition::is_chain_unchanged(uint32_t origin,
+    uint32_t first_cluster) const
+{
+    const ScanCache::Record& record = m_scan.snapshot.record(origin);
+    if (record.first_cluster != first_cluster || record.extents_count == 0
+        || m_scan.snapshot.extent(record.extents_begin).first != first_cluster)
+        return false;
+    uint32_t bits = fat_entry_bits();
+    uint32_t sector_size = m_pbr.get_parameters().bytes_per_sector;
+    for (uint32_t k = 0; k < record.extents_count; ++k)
+    {
+        const ScanCache::Extent& extent
+            = m_scan.snapshot.extent(record.extents_begin + k);
+        if (extent.count == 0 || !is_next_cluster(extent.first)
+            || !is_next_cluster(extent.first + extent.count - 1U))
+            return false;
+        // Сектора с элементами участка, включая последний элемент,
+        // ссылающийся на следующий участок или на конец цепочки.
+        uint64_t first = static_cast<uint64_t>(extent.first) * bits / 8U;
+        uint64_t last = (static_cast<uint64_t>(extent.first + extent.count)
+            * bits - 1U) / 8U;
+        uint64_t first_sector = first / sector_size;
+        uint64_t last_sector = last / sector_size;
+        if (last_sector + 1U >= m_scan.changed_before.size()
+            || m_scan.changed_before[last_sector + 1U]
+                != m_scan.changed_before[first_sector])
+            return false;
+    }
+    return true;
+}
+
+bool Partition::reuse_dir(uint32_t index)
+{
+    if (!m_scan_cache || m_scan.origin[index] == NO_RECORD)
+        return false;
+    uint32_t origin = m_scan.origin[index];
+    const ScanCache::Record& record = m_scan.snapshot.record(origin);
+    if (record.type != DIR || record.hashes_count == 0
+        || !is_chain_unchanged(origin, m_files[index].first_cluster))
+        return false;
+    for (uint32_t k = 0; k < record.hashes_count; ++k)
+    {
+        const ScanCache::DirCluster& cluster
+            = m_scan.snapshot.hash(record.hashes_begin + k);
+        auto found = m_scan.dir_hashes.find(cluster.cluster);
+        if (found == m_scan.dir_hashes.end()
+            || found->second != cluster.hash)
+            return false;
+    }
+
+    // Кластеры директории не изменились, поэтому неизменны и смещения
+    // записей вложенных файлов.
+    m_scan.links[index].hashes_begin = m_scan.hashes.size();
+    m_scan.links[index].hashes_count = record.hashes_count;
+    for (uint32_t k = 0; k < record.hashes_count; ++k)
+        m_scan.hashes.push_back(m_scan.snapshot.hash(record.hashes_begin + k));
+    size_t begin = m_files.size();
+    for (uint32_t k = 0; k < record.children_count; ++k)
+    {
+        uint32_t child_origin = record.children_begin + k;
+        const ScanCache::Record& child = m_scan.snapshot.record(child_origin);
+        add_file_record({ child.entry_offset, child.first_cluster, child.size,
+            m_files.intern(m_scan.snapshot.name(child)),
+            static_cast<FileType>(child.type) }, child_origin);
+    }
+    size_t end = m_files.size();
+    m_scan.links[index].children_begin = begin;
+    m_scan.links[index].children_count = end - begin;
+    ++m_scan.stats.dirs_reused;
+    for (size_t i = begin; i < end; ++i)
+        if (m_files[i].type == DIR)
+            collect_dir(i);
+    return true;
+}
+
+void Partition::hash_dir_clusters(const char* data, uint32_t cluster,
+    uint32_t count)
+{
+    uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        uint64_t hash = Checksum::hash64(data
+            + static_cast<size_t>(k) * cluster_size, cluster_size);
+        m_scan.hashes.push_back({ cluster + k, 0, hash });
+    }
+}
+
+void Partition::save_scan()
+{
+    if (!m_scan_cache || m_scan.links.size() != m_files.size())
+        return;
+    const PBR::Parameters& parameters = m_pbr.get_parameters();
+    ScanCache::Contents contents;
+    contents.header.serial_number = parameters.serial_number;
+    contents.header.cluster_size = parameters.cluster_size;
+    contents.header.sector_size = parameters.bytes_per_sector;
+    contents.header.fat_bits = fat_entry_bits();
+    contents.header.last_cluster = parameters.last_cluster;
+    contents.fat_hashes = std::move(m_scan.fat_hashes);
+    contents.extents = std::move(m_scan.extents);
+    contents.hashes = std::move(m_scan.hashes);
+
+    // Имена арены записываются один раз, как и хранятся.
+    std::vector<uint32_t> name_offsets(m_files.names_number() + 1U,
+        NO_RECORD);
+    contents.records = std::move(m_scan.links);
+    for (uint32_t i = 0; i < m_files.size(); ++i)
+    {
+        const ScanRecord& file = m_files[i];
+        ScanCache::Record& record = contents.records[i];
+        std::string_view name = m_files.get_name(file.name);
+        if (name_offsets[file.name] == NO_RECORD)
+        {
+            name_offsets[file.name] = contents.names.size();
+            contents.names.append(name);
+        }
+        record.entry_offset = file.entry_offset;
+        record.first_cluster = file.first_cluster;
+        record.size = file.size;
+        record.name_offset = name_offsets[file.name];
+        record.name_length = name.length();
+        record.type = file.type;
+    }
+    ScanCache::save(scan_cache_path(parameters.serial_number), contents);
+
+    // Сведения обхода больше не нужны: память освобождается.
+    m_scan.snapshot.close();
+    m_scan.by_cluster = {};
+    m_scan.dir_hashes = {};
+    m_scan.origin = {};
+    m_scan.links = {};
+    m_scan.changed_before = {};
+}
+
+void Partition::print_scan_cache_stats() const
+{
+    const ScanCacheStats& stats = m_scan.stats;
+    if (!m_scan_cache)
+        return;
+    if (!stats.loaded)
+    {
+        std::cout << "Снимок обхода тома не найден, "
+            << "выполнен полный обход.\n";
+        return;
+    }
+    std::cout << "Снимок обхода тома: изменено секторов FAT "
+        << stats.fat_sectors_changed << " из " << stats.fat_sectors
+        << ", директорий из снимка " << stats.dirs_reused
+        << ", разобрано " << stats.dirs_parsed
+        << ", цепочек из снимка " << stats.chains_reused
+        << ", просмотрено " << stats.chains_walked << '\n';
+}
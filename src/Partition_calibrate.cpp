@@ -0,0 +1,231 @@
+#include "Partition.h"
+#include "PBR.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream> // std::istringstream
+#include <cstdlib> // std::getenv
+#include <atomic> // std::atomic
+#include <future> // std::async
+#include <chrono> // std::chrono::steady_clock
+#include <algorithm> // std::min, std::max
+
+/* Замеры выполняются на участке свободных кластеров: данные участка
+ * считываются и записываются на то же место, поэтому содержимое
+ * раздела не меняется. Сначала при одном запросе подбирается размер
+ * запроса, затем для него - количество одновременных запросов. */
+namespace
+{
+    const uint32_t probe_bytes = 4U * 1048576U;
+    const uint32_t min_probe_clusters = 16U;
+    const uint32_t chunk_bytes[] = { 65536U, 262144U, 1048576U, 4194304U };
+    const uint32_t queue_depths[] = { 2U, 4U, 8U };
+    const char* cache_name = "/.fat_defrag_io";
+
+    std::string io_profile_path()
+    {
+        const char* home = std::getenv("HOME");
+        return std::string(home ? home : "/tmp") + cache_name;
+    }
+}
+
+bool Partition::transfer_clusters(uint32_t source, uint32_t destination,
+    uint32_t count, uint32_t chunk, uint32_t depth)
+{
+    uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
+    chunk = std::max(1U, std::min(chunk, count));
+    uint32_t chunks = (count + chunk - 1U) / chunk;
+    depth = std::max(1U, std::min(depth, chunks));
+    // Один запрос за раз - через m_io или m_drive, как и прежде.
+    if (depth == 1U || !m_io.is_open())
+    {
+        Bytes buff(static_cast<size_t>(chunk) * cluster_size, io_alignment());
+        for (uint32_t i = 0; i < count; i += chunk)
+        {
+            uint32_t batch = std::min(chunk, count - i);
+            if (!read_clusters(buff, source + i, batch)
+                || !write_clusters(buff, destination + i, batch))
+                return false;
+        }
+        return true;
+    }
+
+    // Несколько запросов одновременно возможны только через
+    // позиционный доступ. Данные потока m_drive сбрасываются заранее.
+    m_drive.flush();
+    size_t alignment = io_alignment();
+    auto transfer = [&](Bytes& buff, uint32_t k)
+        {
+            uint32_t i = k * chunk;
+            size_t size = static_cast<size_t>(std::min(chunk, count - i))
+                * cluster_size;
+            return m_io.read(buff, size, cluster_offset(source + i))
+                && m_io.write(buff, size, cluster_offset(destination + i));
+        };
+    // Первый запрос выполняется до запуска потоков: если устройство
+    // отвергнет режим DIRECT, m_io переоткроется, пока к нему никто
+    // больше не обращается.
+    {
+        Bytes buff(static_cast<size_t>(chunk) * cluster_size, alignment);
+        if (!transfer(buff, 0))
+            return false;
+    }
+    std::atomic<uint32_t> next{ 1 };
+    std::atomic<bool> done{ true };
+    std::vector<std::future<void>> workers;
+    for (uint32_t w = 0; w < depth; ++w)
+        workers.push_back(std::async(std::launch::async, [&]()
+            {
+                Bytes buff(static_cast<size_t>(chunk) * cluster_size,
+                    alignment);
+                for (uint32_t k = next++; k < chunks && done; k = next++)
+                    if (!transfer(buff, k))
+                        done = false;
+            }));
+    for (auto& worker : workers)
+        worker.get();
+    return done;
+}
+
+double Partition::probe_io(uint32_t first, uint32_t count, uint32_t chunk,
+    uint32_t depth)
+{
+    uint64_t size = static_cast<uint64_t>(count)
+        * m_pbr.get_parameters().cluster_size;
+    // Участок вытесняется из кэша, чтобы чтение обращалось к накопителю,
+    // а время записи включает сброс данных на накопитель.
+    m_drive.flush();
+    m_io.sync();
+    m_io.drop_cache(cluster_offset(first), size);
+    auto start = std::chrono::steady_clock::now();
+    if (!transfer_clusters(first, first, count, chunk, depth))
+        return 0;
+    m_drive.flush();
+    m_io.sync();
+    double seconds = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+    return seconds > 0 ? 2.0 * size / 1048576.0 / seconds : 0;
+}
+
+const Partition::IoProfile& Partition::calibrate_io()
+{
+    m_io_profile = {};
+    m_io_profile.calibrated = true;
+    if (load_io_profile())
+        return m_io_profile;
+
+    uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    uint32_t count = std::max(probe_bytes / cluster_size, 1U);
+    uint32_t first = 0;
+    while (count >= min_probe_clusters
+        && (first = find_free_run(2U, last_cluster, count)) == 0)
+        count /= 2U;
+    // Нет свободного участка для замеров - остаются значения
+    // по умолчанию, и они не сохраняются.
+    if (first == 0)
+        return m_io_profile;
+
+    double best = 0;
+    for (auto bytes : chunk_bytes)
+    {
+        uint32_t chunk = std::max(bytes / cluster_size, 1U);
+        if (chunk > count)
+            break;
+        double speed = probe_io(first, count, chunk, 1U);
+        if (speed > best)
+        {
+            best = speed;
+            m_io_profile.chunk_clusters = chunk;
+        }
+    }
+    for (auto depth : queue_depths)
+    {
+        if (depth * m_io_profile.chunk_clusters > count)
+            break;
+        double speed = probe_io(first, count, m_io_profile.chunk_clusters,
+            depth);
+        if (speed > best)
+        {
+            best = speed;
+            m_io_profile.queue_depth = depth;
+        }
+    }
+    m_io_profile.megabytes_per_second = best;
+    if (best > 0)
+        save_io_profile();
+    return m_io_profile;
+}
+
+/* Файл результатов содержит по строке на том и режим:
+ * серийный номер, режим (0 - BUFFERED, 1 - DIRECT), размер кластера,
+ * размер запроса в кластерах, количество запросов, скорость Mb/s. */
+bool Partition::load_io_profile()
+{
+    std::ifstream cache(io_profile_path());
+    std::string line;
+    uint32_t mode = io_alignment() ? 1U : 0U;
+    while (std::getline(cache, line))
+    {
+        std::istringstream fields(line);
+        uint32_t serial = 0, line_mode = 0, cluster_size = 0;
+        IoProfile profile;
+        if (!(fields >> serial >> line_mode >> cluster_size
+            >> profile.chunk_clusters >> profile.queue_depth
+            >> profile.megabytes_per_second))
+            continue;
+        if (serial != m_pbr.get_parameters().serial_number
+            || line_mode != mode
+            || cluster_size != m_pbr.get_parameters().cluster_size
+            || profile.chunk_clusters == 0 || profile.queue_depth == 0)
+            continue;
+        profile.calibrated = true;
+        profile.cached = true;
+        m_io_profile = profile;
+        return true;
+    }
+    return false;
+}
+
+void Partition::save_io_profile() const
+{
+    std::string path = io_profile_path();
+    uint32_t serial = m_pbr.get_parameters().serial_number;
+    uint32_t mode = io_alignment() ? 1U : 0U;
+    // Строка этого тома и режима заменяется, остальные сохраняются.
+    std::vector<std::string> lines;
+    {
+        std::ifstream cache(path);
+        std::string line;
+        while (std::getline(cache, line))
+        {
+            std::istringstream fields(line);
+            uint32_t line_serial = 0, line_mode = 0;
+            if (fields >> line_serial >> line_mode
+                && line_serial == serial && line_mode == mode)
+                continue;
+            lines.push_back(line);
+        }
+    }
+    std::ofstream cache(path, std::ios::trunc);
+    for (auto& line : lines)
+        cache << line << '\n';
+    cache << serial << ' ' << mode << ' '
+        << m_pbr.get_parameters().cluster_size << ' '
+        << m_io_profile.chunk_clusters << ' ' << m_io_profile.queue_depth
+        << ' ' << m_io_profile.megabytes_per_second << '\n';
+}
+
+void Partition::print_io_profile() const
+{
+    if (!m_io_profile.calibrated)
+        return;
+    std::cout << "Параметры переноса"
+        << (m_io_profile.cached ? " (сохранённые)" : "") << ": запрос "
+        << static_cast<uint64_t>(m_io_profile.chunk_clusters)
+            * m_pbr.get_parameters().cluster_size / 1024U << " Kb, "
+        << "одновременно " << m_io_profile.queue_depth;
+    if (m_io_profile.megabytes_per_second > 0)
+        std::cout << ", " << m_io_profile.megabytes_per_second << " Mb/s";
+    std::cout << '\n';
+}
@@ -0,0 +1,164 @@
+#include "Partition.h"
+#include "PBR.h"
+
+#include <iostream>
+#include <atomic> // std::atomic
+#include <thread> // std::thread
+#include <algorithm> // std::min, std::max
+
+Partition::CheckReport Partition::check_fat()
+{
+    CheckReport report;
+    m_blocked.clear();
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+
+    // Первый этап - параллельный просмотр таблицы по частям.
+    // Для каждого кластера отмечается наличие ссылок на него:
+    // бит 0 - есть хотя бы одна ссылка, бит 1 - ссылок несколько.
+    // Части просматриваются участками таблицы: свободные области
+    // пропускаются целиком.
+    uint32_t mask = fat_entry_mask();
+    std::vector<std::atomic<uint8_t>> links(last_cluster + 1U);
+    const uint32_t min_shard = 65536U;
+    uint32_t clusters = last_cluster - 1U;
+    uint32_t threads_number = std::max(1U, std::min
+        ({ std::thread::hardware_concurrency(), 16U,
+           clusters / min_shard + 1U }));
+    uint32_t shard = clusters / threads_number + 1U;
+    std::vector<std::vector<uint32_t>> bad(threads_number);
+    std::vector<std::vector<uint32_t>> invalid(threads_number);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < threads_number; ++t)
+    {
+        threads.emplace_back([&, t]()
+            {
+                uint32_t first = 2U + t * shard;
+                uint32_t last = std::min(last_cluster, first + shard - 1U);
+                for (auto span = m_FAT.runs_from(first); !span.at_end()
+                    && span->first <= last; ++span)
+                {
+                    if (!span->sequential && (span->tail & mask) == 0)
+                        continue;
+                    uint32_t end = std::min(last,
+                        span->first + span->length - 1U);
+                    for (uint32_t i = span->first; i <= end; ++i)
+                    {
+                        uint32_t value = span->value(i) & mask;
+                        if (value == 0 || is_chain_end(value))
+                            continue;
+                        if (is_bad_cluster(value))
+                            bad[t].push_back(i);
+                        else if (!is_next_cluster(value))
+                            invalid[t].push_back(i);
+                        else if (links[value].fetch_or(1U) & 1U)
+                            links[value].fetch_or(2U);
+                    }
+                }
+            });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    for (uint32_t t = 0; t < threads_number; ++t)
+    {
+        report.bad_clusters += bad[t].size();
+        for (auto cluster : bad[t])
+            report.issues.push_back({ BAD_CLUSTER, cluster, "" });
+    }
+
+    // Второй этап - обход дерева каталогов и отметка цепочек файлов
+    // в карте принадлежности, которая служит картой посещений.
+    collect_tree();
+    for (uint32_t i = 0; i < m_files.size(); ++i)
+    {
+        const ScanRecord& file = m_files[i];
+        // Имя копируется из арены только для отчёта о нарушении.
+        auto name = [&]() { return std::string(m_files.get_name(file.name)); };
+        if (file.type == ROOT_DIR
+            && m_pbr.get_parameters().fat_type != PBR::FAT32)
+            continue;
+        ChainStatus status = mark_file(i);
+        bool broken = true;
+        if (status.cycle)
+            report.issues.push_back({ CHAIN_CYCLE, file.first_cluster, name() });
+        else if (status.cross_owner != 0)
+        {
+            report.issues.push_back({ CROSS_LINK, file.first_cluster, name() });
+            // Второй файл пересечения также блокируется.
+            if (status.cross_owner != CROSS_LINKED)
+                m_blocked.insert(m_files[status.cross_owner - 1U].first_cluster);
+        }
+        else if (status.invalid_link)
+            report.issues.push_back({ INVALID_LINK, file.first_cluster, name() });
+        else if (status.bad_cluster)
+            report.issues.push_back({ BAD_CLUSTER, file.first_cluster, name() });
+        else if (file.type == FILE && status.length != (file.size
+            + m_pbr.get_parameters().cluster_size - 1U)
+                / m_pbr.get_parameters().cluster_size)
+            report.issues.push_back({ SIZE_MISMATCH, file.first_cluster, name() });
+        else
+            broken = false;
+        if (broken)
+            m_blocked.insert(file.first_cluster);
+    }
+    save_scan();
+
+    // Занятые кластеры, не попавшие ни в одну цепочку, потеряны.
+    // В отчёт попадают начала потерянных цепочек - кластеры,
+    // на которые нет ссылок.
+    for (auto span = m_FAT.runs_from(2U); !span.at_end()
+        && span->first <= last_cluster; ++span)
+    {
+        if (!span->sequential && (span->tail & mask) == 0)
+            continue;
+        uint32_t end = std::min(last_cluster,
+            span->first + span->length - 1U);
+        for (uint32_t i = span->first; i <= end; ++i)
+        {
+            uint32_t value = span->value(i) & mask;
+            if (value == 0 || is_bad_cluster(value) || m_owners[i] != 0)
+                continue;
+            ++report.lost_clusters;
+            if ((links[i] & 1U) == 0)
+                report.issues.push_back({ LOST_CHAIN, i, "" });
+        }
+    }
+    for (uint32_t t = 0; t < threads_number; ++t)
+        for (auto cluster : invalid[t])
+            if (m_owners[cluster] == 0)
+                report.issues.push_back({ INVALID_LINK, cluster, "" });
+
+    report.blocked_files = m_blocked.size();
+    m_check_report = report;
+    m_checked = true;
+    return report;
+}
+
+void Partition::print_check_report(const CheckReport& report)
+{
+    if (report.issues.empty())
+    {
+        std::cout << "Нарушений в таблице FAT не обнаружено.\n";
+        return;
+    }
+    std::cout << "Обнаружены нарушения в таблице FAT:\n";
+    for (auto& issue : report.issues)
+    {
+        switch (issue.type)
+        {
+            case CHAIN_CYCLE:   std::cout << "зацикленная цепочка";      break;
+            case CROSS_LINK:    std::cout << "пересечение цепочек";      break;
+            case LOST_CHAIN:    std::cout << "потерянная цепочка";       break;
+            case SIZE_MISMATCH: std::cout << "несоответствие размеру";   break;
+            case BAD_CLUSTER:   std::cout << "повреждённый кластер";     break;
+            case INVALID_LINK:  std::cout << "некорректная ссылка";      break;
+        }
+        std::cout << ", кластер " << issue.cluster;
+        if (issue.name.length())
+            std::cout << ", файл " << issue.name;
+        std::cout << '\n';
+    }
+    std::cout << "Потерянных кластеров: " << report.lost_clusters << '\n'
+        << "Повреждённых кластеров: " << report.bad_clusters << '\n'
+        << "Файлов, исключённых из дефрагментации: "
+        << report.blocked_files << '\n';
+}
@@ -1,27 +1,36 @@
 
 #include "Partition.h"
 #include "PBR.h"
+#include "FAT_Layout.h"
 
 #include <iostream>
 #include <cassert>
+#include <algorithm> // std::min, std::sort
+#include <future> // std::async
+#include <memory> // std::make_shared
+#include <deque> // std::deque
+#include <chrono> // std::chrono::steady_clock
+
+#include "Checksum.h"
 
 uint32_t Partition::is_file_fragmented(const FileInfo& file)
 {
     uint32_t fragments = 0;
     uint32_t current_cluster = file.first_cluster;
-    uint32_t previous_cluster;
-    do
+    uint32_t next_cluster;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    if (!is_next_cluster(current_cluster))
+        return 0;
+    // Ограничение числа шагов защищает от зацикленных цепочек.
+    for (uint32_t steps = 0; steps < last_cluster; ++steps)
     {
-        previous_cluster = current_cluster;
-        current_cluster = m_FAT.get_value<uint32_t>
-            ( current_cluster * 2U, Bytes::WORD );
-        if ((current_cluster != 0xFFFFU)
-            && (current_cluster - previous_cluster) != 1)
-        {
+        next_cluster = get_fat_entry(current_cluster);
+        if (!is_next_cluster(next_cluster))
+            break;
+        if ((next_cluster - current_cluster) != 1)
             ++fragments;
-        }
-
-    } while (current_cluster != 0xFFFFU);
+        current_cluster = next_cluster;
+    }
 
     return ((fragments > 0) ? ++fragments : 0);
 }
@@ -30,13 +39,27 @@ uint32_t Partition::defragment(FileInfo& file)
 {
     if (file.type == NONE)
         return 0;
-    uint32_t defragmented_files;
+    if (!m_checked)
+        check_fat();
+    uint32_t defragmented_files = 0;
+    m_schedule.clear();
+    m_partial_moves.clear();
+    begin_progress(0, 0);
     if (file.type == FILE)
+    {
+        uint64_t bytes = static_cast<uint64_t>(count_file_clusters(file))
+            * m_pbr.get_parameters().cluster_size;
+        add_progress_total(1U, bytes);
         defragmented_files = defragment_file(file);
+        advance_progress(file, bytes);
+    }
 
     if (file.type == DIR || file.type == ROOT_DIR)
         defragmented_files = defragment_dir(file);
 
+    flush_entry_patches();
+    commit_fsinfo();
+    end_progress();
     return defragmented_files;
 }
 
@@ -48,65 +71,30 @@ uint32_t Partition::defragment_dir(FileInfo& file)
     assert((fat_type == PBR::FAT12 || fat_type == PBR::FAT16
         || fat_type == PBR::FAT32) && "Invalid partition type.");
 
+    // Файлы обрабатываются в порядке убывания выгоды, пока
+    // не исчерпан бюджет переноса.
+    build_schedule(file);
     uint32_t counter = 0;
-    Bytes buff;
-    auto cluster_size = m_pbr.get_parameters().cluster_size;
-    auto data_offset = m_pbr.get_parameters().data_offset;
-    auto root_dir_size = m_pbr.get_parameters().root_dir_size;
-
-    if (file.type == ROOT_DIR && fat_type != PBR::FAT32)
-    {
-        buff.resize(root_dir_size);
-        m_drive.seekg(data_offset, m_drive.beg);
-        m_drive.read(buff, root_dir_size);
-        counter = defragment_dir_cluster(buff, 
-            m_pbr.get_parameters().root_dir_cluster);
-    }
-    else
-    {
-        uint8_t shift = 1U;
-        uint64_t offset;
-        if (fat_type == PBR::FAT16 || fat_type == PBR::FAT12)
-        {
-            data_offset += m_pbr.get_parameters().root_dir_size;
-            shift = 2U;
-        }
-        buff.resize(cluster_size);
-        uint32_t current_cluster;
-        uint32_t next_cluster = file.first_cluster;
-        do
-        {
-            current_cluster = next_cluster;
-            next_cluster = m_FAT.get_value<uint32_t>
-                (next_cluster * 2, Bytes::WORD);
-
-            offset = data_offset + (current_cluster - shift) * cluster_size;
-            m_drive.seekg(offset, m_drive.beg);
-            m_drive.read(buff, cluster_size);
-            counter += defragment_dir_cluster(buff, current_cluster);
-            
-        } while (next_cluster != 0xFFFFU);
-    }
-    return counter;
-}
-
-
-uint32_t Partition::defragment_dir_cluster(Bytes& dir_cluster, uint32_t cluster_number)
-{
-    uint32_t counter = 0;
-    FileInfo file;
-    file.partition_sn = m_pbr.get_parameters().serial_number;
-    unsigned char ch;
-    for (int32_t i = 0; i < dir_cluster.length(); i += 0x20U)
+    uint64_t moved_bytes = 0;
+    uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
+    uint64_t scheduled_bytes = 0;
+    for (auto& entry : m_schedule)
+        scheduled_bytes += static_cast<uint64_t>(entry.clusters) * cluster_size;
+    add_progress_total(m_schedule.size(), scheduled_bytes);
+    for (auto& entry : m_schedule)
     {
-        ch = dir_cluster.get_value<unsigned char>(i, Bytes::BYTE);
-        if (ch == 0)
+        if (m_cancel)
             break;
-        if (ch == 0xE5U || ch == '.')
+        uint64_t bytes = static_cast<uint64_t>(entry.clusters) * cluster_size;
+        bool moved = (m_move_budget == 0 
+            || moved_bytes + bytes <= m_move_budget)
+            && defragment_file(entry.file) != 0;
+        advance_progress(entry.file, bytes);
+        if (!moved)
             continue;
-        file = get_file_from_entry(dir_cluster, cluster_number, i);
-        if (file.type != NONE)
-            counter += defragment_file(file);
+        entry.moved = true;
+        moved_bytes += bytes;
+        ++counter;
     }
     return counter;
 }
@@ -124,152 +112,605 @@ uint32_t Partition::defragment_file(FileInfo& file)
         return 0;
     uint32_t clusters_per_file = count_file_clusters(file); 
     uint32_t first_free_cluster = find_empty_space(clusters_per_file);
+    // Недостаточно непрерывного свободного места для дефрагментации.
     if (first_free_cluster == 0)
+        return defragment_partially(file) ? 1 : 0;
+    return move_file(file, first_free_cluster) ? 1 : 0;
+}
+
+/* Если непрерывного участка нужной длины нет, файл собирается
+ * из наибольших свободных участков: они берутся по убыванию длины,
+ * пока не наберётся нужное количество кластеров, и располагаются
+ * в порядке следования на разделе. Перенос выполняется, только если
+ * число фрагментов уменьшается. */
+bool Partition::defragment_partially(FileInfo& file)
+{
+    uint32_t clusters = count_file_clusters(file);
+    uint32_t fragments_before = is_file_fragmented(file);
+    std::vector<Extent> runs = collect_free_runs();
+    std::stable_sort(runs.begin(), runs.end(), 
+        [](const Extent& a, const Extent& b) { return a.count > b.count; });
+
+    std::vector<Extent> target;
+    uint32_t needed = clusters;
+    for (auto& run : runs)
     {
-        //std::cout << "Недостаточно свободного места для дефрагментации.\n";
-        return 0;
+        if (needed == 0 || target.size() + 1U >= fragments_before)
+            break;
+        uint32_t count = std::min(run.count, needed);
+        target.push_back({ run.first, count });
+        needed -= count;
     }
+    if (needed != 0)
+        return false;
+    std::sort(target.begin(), target.end(), 
+        [](const Extent& a, const Extent& b) { return a.first < b.first; });
+    if (!move_file(file, target))
+        return false;
+    m_partial_moves.push_back({ file, fragments_before, 
+        static_cast<uint32_t>(target.size()) });
+    return true;
+}
+
+bool Partition::move_file(FileInfo& file, uint32_t destination)
+{
+    return move_file(file, { { destination, count_file_clusters(file) } });
+}
+
+bool Partition::move_file(FileInfo& file, const std::vector<Extent>& destination)
+{
+    // Файлы с нарушенными цепочками не перемещаются. После запроса
+    // отмены новые перемещения не начинаются.
+    if (m_blocked.count(file.first_cluster) || destination.empty()
+        || m_cancel)
+        return false;
+    // При расхождении копий таблицы FAT строгое правило запрещает
+    // перемещения.
+    if (m_fat_policy == FAT_STRICT 
+        && !m_mirror_report.mismatched_sectors.empty())
+        return false;
+    uint32_t clusters_per_file = count_file_clusters(file); 
+    uint32_t destination_clusters = 0;
+    for (auto& extent : destination)
+        destination_clusters += extent.count;
+    if (destination_clusters != clusters_per_file)
+        return false;
+    if (m_auto_calibrate && !m_io_profile.calibrated)
+        calibrate_io();
+    // Участки, ожидающие освобождения на накопителе, могут оказаться
+    // в новом месте файла: их нужно освободить до записи данных.
+    bool overlaps = false;
+    for (auto& freed : m_freed)
+        for (auto& extent : destination)
+            overlaps = overlaps || (freed.first < extent.first + extent.count
+                && extent.first < freed.first + freed.count);
+    if (overlaps)
+        discard_freed();
+    // Отложенные изменения записей должны попасть в кластеры
+    // директории до их копирования.
+    if (file.type == DIR)
+        flush_entry_patches();
 
     // Копирование кластеров данных файла в новое пространство.
+    // При несовпадении контрольных сумм таблица FAT и запись файла
+    // не изменяются, а скопированные данные остаются в свободных
+    // кластерах.
     uint32_t src_cluster = file.first_cluster;
-    uint32_t dest_cluster = first_free_cluster;
-    for (uint32_t i = 0; i < clusters_per_file; ++i)
+    for (auto& extent : destination)
     {
-        copy_cluster(src_cluster, dest_cluster + i);
-        src_cluster = m_FAT.get_value<uint32_t>
-            (src_cluster * 2, Bytes::WORD);
-
-        ++dest_cluster;
-        if ((i + 1U) == clusters_per_file)
+        CopyResult result = copy_chain(src_cluster, extent.first,
+            extent.count);
+        if (result != COPY_DONE)
         {
-            m_FAT.insert<uint32_t>(0xFFFFU, (dest_cluster - 1U) * 2, Bytes::WORD);
-            break;
+            if (result == COPY_MISMATCH)
+                ++m_verify_failures;
+            return false;
         }
-        m_FAT.insert<uint32_t>(dest_cluster, (dest_cluster - 1U) * 2, Bytes::WORD);
+        for (uint32_t i = 0; i < extent.count; ++i)
+            src_cluster = get_fat_entry(src_cluster);
     }
+
+    // Индекс файла в карте принадлежности кластеров (если она построена).
+    uint32_t owner = find_owner(file.first_cluster);
+
+    // Связывание новой цепочки в таблице FAT.
+    uint32_t previous_dest_cluster = 0;
+    for (auto& extent : destination)
+        for (uint32_t i = 0; i < extent.count; ++i)
+        {
+            if (previous_dest_cluster != 0)
+                set_fat_entry(previous_dest_cluster, extent.first + i);
+            previous_dest_cluster = extent.first + i;
+        }
+    set_fat_entry(previous_dest_cluster, end_of_chain());
     
     // Стирание старых блоков файла в таблице FAT.
     uint32_t current_src_cluster = file.first_cluster;
     uint32_t previous_src_cluster;
-    do {
+    for (uint32_t i = 0; i < clusters_per_file
+        && is_next_cluster(current_src_cluster); ++i)
+    {
         previous_src_cluster = current_src_cluster;
-        current_src_cluster = m_FAT.get_value<uint32_t>
-            (current_src_cluster * 2, Bytes::WORD);
-        m_FAT.insert<uint32_t>(0U, previous_src_cluster * 2, Bytes::WORD);
-    } while (current_src_cluster != 0xFFFF);
-
-    // Запись таблиц FAT из буфера на накопитель.
-    uint64_t fat_offset = m_pbr.get_parameters().fat_offset;
-    uint64_t fat_size = m_pbr.get_parameters().fat_size;
-    uint64_t cur_fat_offset;
-    for (uint8_t i = 0; i < m_pbr.get_parameters().fat_number; ++i)
+        current_src_cluster = get_fat_entry(current_src_cluster);
+        set_fat_entry(previous_src_cluster, 0U);
+        if (owner && m_owners[previous_src_cluster] == owner)
+            m_owners[previous_src_cluster] = 0;
+        if (m_discard)
+        {
+            if (!m_freed.empty() && m_freed.back().first
+                + m_freed.back().count == previous_src_cluster)
+                ++m_freed.back().count;
+            else
+                m_freed.push_back({ previous_src_cluster, 1U });
+        }
+    }
+
+    // Обновление карты принадлежности кластеров.
+    if (owner)
     {
-        cur_fat_offset = fat_offset + fat_size * i;
-        m_drive.seekp(cur_fat_offset, m_drive.beg);
-        m_drive.write(m_FAT, fat_size);
+        for (auto& extent : destination)
+            for (uint32_t i = 0; i < extent.count; ++i)
+                m_owners[extent.first + i] = owner;
+        m_files[owner - 1U].first_cluster = destination.front().first;
     }
+
+    // Запись изменённых секторов таблицы FAT на накопитель.
+    write_fat();
     
     // Запись номера нового первого кластера файла в запись файла.
-    Bytes buff(2);
-    buff.insert<uint32_t>(first_free_cluster, 0, Bytes::WORD);
-    m_drive.seekp(file.entry_offset + 0x1AU, m_drive.beg);
-    m_drive.write(buff, 2);
+    write_entry_cluster(file.entry_offset, destination.front().first);
+    file.first_cluster = destination.front().first;
 
-    return 1;
+    // Перемещённая директория должна ссылаться на себя записью "."
+    // и быть родителем в записях ".." вложенных директорий.
+    if (file.type == DIR)
+    {
+        update_dir_links(file);
+        m_dir_cache.clear();
+    }
+    m_progress.bytes_moved += static_cast<uint64_t>(clusters_per_file)
+        * m_pbr.get_parameters().cluster_size;
+    report_progress(false);
+    return true;
 }
 
-void Partition::copy_cluster(uint32_t source, uint32_t destination)
+Partition::CopyResult Partition::copy_chain(uint32_t source,
+    uint32_t destination, uint32_t clusters_number)
 {
-    PBR::FAT_Type fat_type = m_pbr.get_parameters().fat_type;
-    if (fat_type == PBR::NONE)
+    uint32_t src_cluster = source;
+    if (!m_verify)
     {
-        return;
+        // Непрерывные участки исходной цепочки копируются целиком.
+        bool copied = true;
+        for (uint32_t i = 0; i < clusters_number; )
+        {
+            uint32_t first = src_cluster;
+            uint32_t count = 0;
+            do
+            {
+                ++count;
+                src_cluster = get_fat_entry(src_cluster);
+            } while (i + count < clusters_number 
+                && src_cluster == first + count);
+            copied = copy_extent(first, destination + i, count) && copied;
+            i += count;
+        }
+        return copied ? COPY_DONE : COPY_FAILED;
     }
-    uint8_t shift;
-    uint64_t src_offset;
-    uint64_t dest_offset;
 
+    // Непрерывные участки исходной цепочки копируются запросами
+    // не длиннее калиброванного. Каждый записанный запрос проверяется
+    // в рабочем потоке, пока копируются следующие: подсчитывается
+    // контрольная сумма исходных данных, записанный участок
+    // сбрасывается на накопитель, вытесняется из страничного кэша
+    // и считывается обратно в тот же буфер. В режиме DIRECT чтение
+    // и так обращается к накопителю.
+    const uint32_t chunk = std::max(1U, m_io_profile.chunk_clusters);
+    const size_t max_in_flight = 4U;
     uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
+    size_t alignment = io_alignment();
+    auto verify = [this, alignment](std::shared_ptr<Bytes> data,
+        uint32_t first)
+    {
+        uint32_t expected = Checksum::crc32c(*data, data->length());
+        uint64_t offset = cluster_offset(first);
+        if (alignment == 0)
+        {
+            m_io.sync(offset, data->length());
+            m_io.drop_cache(offset, data->length());
+        }
+        if (!m_io.read(*data, data->length(), offset))
+            return COPY_FAILED;
+        return Checksum::crc32c(*data, data->length()) == expected
+            ? COPY_DONE : COPY_MISMATCH;
+    };
+
+    std::deque<std::future<CopyResult>> checks;
+    CopyResult result = COPY_DONE;
+    uint64_t requests = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < clusters_number && result == COPY_DONE; )
+    {
+        uint32_t first = src_cluster;
+        uint32_t count = 0;
+        do
+        {
+            ++count;
+            src_cluster = get_fat_entry(src_cluster);
+        } while (i + count < clusters_number && count < chunk
+            && src_cluster == first + count);
+        auto data = std::make_shared<Bytes>(static_cast<size_t>(count)
+            * cluster_size, alignment);
+        if (!read_clusters(*data, first, count)
+            || !write_clusters(*data, destination + i, count))
+        {
+            result = COPY_FAILED;
+            break;
+        }
+        // Проверка читает участок в обход потока m_drive.
+        m_drive.flush();
+        ++requests;
+        if (checks.size() >= max_in_flight)
+        {
+            result = checks.front().get();
+            checks.pop_front();
+        }
+        checks.push_back(std::async(std::launch::async, verify,
+            std::move(data), destination + i));
+        i += count;
+    }
+    for (auto& check : checks)
+    {
+        CopyResult checked = check.get();
+        if (result == COPY_DONE)
+            result = checked;
+    }
+    m_copy_stats[USER_COPY].bytes += static_cast<uint64_t>(clusters_number)
+        * cluster_size;
+    m_copy_stats[USER_COPY].requests += requests;
+    m_copy_stats[USER_COPY].nanoseconds += std::chrono::duration_cast
+        <std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+            - start).count();
+    return result;
+}
+
+void Partition::write_entry_cluster(uint64_t entry_offset, uint32_t cluster)
+{
+    m_entry_patches[entry_offset] = cluster;
+}
+
+void Partition::flush_entry_patches()
+{
+    if (m_entry_patches.empty())
+        return;
+    uint32_t sector_size = m_pbr.get_parameters().bytes_per_sector;
+    bool is_fat32 = m_pbr.get_parameters().fat_type == PBR::FAT32;
+    Bytes sector(sector_size);
+    // Записи упорядочены по смещению, поэтому записи одного сектора
+    // идут подряд: сектор считывается, изменяется и записывается
+    // один раз.
+    auto patch = m_entry_patches.begin();
+    while (patch != m_entry_patches.end())
+    {
+        uint64_t sector_offset = patch->first - patch->first % sector_size;
+        m_drive.seekg(sector_offset, m_drive.beg);
+        m_drive.read(sector, sector_size);
+        for (; patch != m_entry_patches.end() 
+            && patch->first < sector_offset + sector_size; ++patch)
+        {
+            // Старшее слово номера кластера используется только в FAT32.
+            FAT_Layout::MutableDirEntryView(sector + (patch->first
+                - sector_offset)).set_first_cluster(patch->second, is_fat32);
+        }
+        m_drive.seekp(sector_offset, m_drive.beg);
+        m_drive.write(sector, sector_size);
+    }
+    m_entry_patches.clear();
+}
+
+void Partition::update_dir_links(const FileInfo& dir)
+{
+    Bytes name(2);
+    uint64_t dot_offset = cluster_offset(dir.first_cluster);
+    m_drive.seekg(dot_offset, m_drive.beg);
+    m_drive.read(name, 1);
+    if (name[0] == '.')
+        write_entry_cluster(dot_offset, dir.first_cluster);
+
+    std::vector<uint32_t> subdirs;
+    for (auto& file : list_dir(dir))
+        if (file.type == DIR)
+            subdirs.push_back(file.first_cluster);
+    for (auto subdir : subdirs)
+    {
+        // Запись ".." - вторая запись первого кластера директории.
+        uint64_t dotdot_offset = cluster_offset(subdir) + 0x20U;
+        m_drive.seekg(dotdot_offset, m_drive.beg);
+        m_drive.read(name, 2);
+        if (name[0] == '.' && name[1] == '.')
+            write_entry_cluster(dotdot_offset, dir.first_cluster);
+    }
+}
+
+uint64_t Partition::cluster_offset(uint32_t cluster) const
+{
     uint64_t data_offset = m_pbr.get_parameters().data_offset;
+    uint64_t cluster_size = m_pbr.get_parameters().cluster_size;
+    if (m_pbr.get_parameters().fat_type == PBR::FAT32)
+        return data_offset + cluster_size * (cluster - 2U);
+    return data_offset + m_pbr.get_parameters().root_dir_size
+        + cluster_size * (cluster - 2U);
+}
+
+bool Partition::copy_extent(uint32_t source, uint32_t destination,
+    uint32_t count)
+{
+    uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
+    size_t size = static_cast<size_t>(count) * cluster_size;
+    auto start = std::chrono::steady_clock::now();
+    auto account = [&](CopyMethod method)
+        {
+            m_copy_stats[method].bytes += size;
+            m_copy_stats[method].requests += 1U;
+            m_copy_stats[method].nanoseconds += std::chrono::duration_cast
+                <std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+                    - start).count();
+        };
+
+    // Копирование ядром идёт через страничный кэш, поэтому в режиме
+    // DIRECT данные переносятся через память.
+    if (m_kernel_copy && m_io.is_open() && m_io.get_mode() == DriveIO::BUFFERED)
+    {
+        // Данные, накопленные в буфере потока, должны попасть в файл
+        // до копирования ядром.
+        m_drive.flush();
+        if (m_io.copy(cluster_offset(source), 
+            cluster_offset(destination), size))
+        {
+            account(KERNEL_COPY);
+            return true;
+        }
+        m_kernel_copy = false;
+        start = std::chrono::steady_clock::now();
+    }
+
+    // Копирование через память с параметрами калибровки.
+    if (!transfer_clusters(source, destination, count,
+        m_io_profile.chunk_clusters, m_io_profile.queue_depth))
+        return false;
+    account(USER_COPY);
+    return true;
+}
+
+void Partition::print_partial_moves() const
+{
+    for (auto& move : m_partial_moves)
+        std::cout << "Частично дефрагментирован " << move.file.name
+            << ": фрагментов " << move.fragments_before << " -> "
+            << move.fragments_after << '\n';
+}
+
+void Partition::print_discard_stats() const
+{
+    if (m_discard_stats.requests == 0 && m_discard_stats.failures == 0)
+        return;
+    std::cout << "Освобождено на накопителе: " << m_discard_stats.requests
+        << " участков, " << m_discard_stats.bytes / 1048576.0 << " Mb";
+    if (m_discard_stats.failures)
+        std::cout << " (операция не поддерживается)";
+    std::cout << '\n';
+}
 
-    Bytes buff;
+void Partition::print_copy_stats() const
+{
+    const char* names[COPY_METHODS] = 
+        { "чтение и запись", "copy_file_range" };
+    for (int i = 0; i < COPY_METHODS; ++i)
+    {
+        const CopyStats& stats = m_copy_stats[i];
+        if (stats.requests == 0)
+            continue;
+        double megabytes = stats.bytes / 1048576.0;
+        double seconds = stats.nanoseconds / 1e9;
+        std::cout << "Перенос данных (" << names[i] << "): "
+            << stats.requests << " запросов, " << megabytes << " Mb";
+        if (seconds > 0)
+            std::cout << ", " << megabytes / seconds << " Mb/s";
+        std::cout << '\n';
+    }
+}
 
-    if (fat_type == PBR::FAT12 || fat_type == PBR::FAT16)
+bool Partition::read_clusters(char* buff, uint32_t cluster, uint32_t count)
+{
+    size_t size = static_cast<size_t>(count)
+        * m_pbr.get_parameters().cluster_size;
+    if (m_io.is_open())
     {
-        shift = 2U;
-        src_offset = data_offset + m_pbr.get_parameters().root_dir_size 
-            + cluster_size * (source - shift);
-        dest_offset = data_offset + m_pbr.get_parameters().root_dir_size 
-            + cluster_size * (destination - shift);
-        buff.resize(cluster_size);
-        m_drive.seekg(src_offset, m_drive.beg);
-        m_drive.read(buff, cluster_size);
-        m_drive.seekp(dest_offset, m_drive.beg);
-        m_drive.write(buff, cluster_size);
+        // Изменения записей директорий, накопленные в буфере потока,
+        // должны попасть в файл до чтения в обход него.
+        m_drive.flush();
+        return m_io.read(buff, size, cluster_offset(cluster));
     }
-    if (fat_type == PBR::FAT32)
+    m_drive.seekg(cluster_offset(cluster), m_drive.beg);
+    m_drive.read(buff, size);
+    if (!m_drive)
     {
-        shift = 1U;
-        src_offset = data_offset
-            + cluster_size * (source - shift);
-        dest_offset = data_offset
-            + cluster_size * (destination - shift);
-        
-        buff.resize(cluster_size);
-        m_drive.seekg(src_offset, m_drive.beg);
-        m_drive.read(buff, cluster_size);
-        m_drive.seekp(dest_offset, m_drive.beg);
-        m_drive.write(buff, cluster_size);
+        m_drive.clear();
+        return false;
     }
+    return true;
+}
+
+bool Partition::write_clusters(const char* buff, uint32_t cluster,
+    uint32_t count)
+{
+    size_t size = static_cast<size_t>(count)
+        * m_pbr.get_parameters().cluster_size;
+    if (m_io.is_open())
+        return m_io.write(buff, size, cluster_offset(cluster));
+    m_drive.seekp(cluster_offset(cluster), m_drive.beg);
+    m_drive.write(buff, size);
+    return static_cast<bool>(m_drive);
+}
+
+size_t Partition::io_alignment() const
+{
+    return (m_io.is_open() && m_io.get_mode() == DriveIO::DIRECT)
+        ? m_io.get_alignment() : 0U;
+}
+
+DriveIO::Mode Partition::set_io_mode(DriveIO::Mode mode)
+{
+    // Калибровка выполняется для каждого режима отдельно.
+    m_io_profile = {};
+    if (!is_open())
+        return DriveIO::BUFFERED;
+    m_drive.flush();
+    if (!m_io.open(m_path, mode, m_pbr.get_parameters().bytes_per_sector))
+        return DriveIO::BUFFERED;
+    // Режим переключается здесь, а не при первом отвергнутом запросе:
+    // к m_io затем обращаются одновременно несколько потоков.
+    size_t alignment = m_io.get_alignment();
+    if (m_io.get_mode() == DriveIO::DIRECT
+        && (cluster_offset(2U) % alignment != 0
+            || m_pbr.get_parameters().cluster_size % alignment != 0))
+        m_io.reopen(DriveIO::BUFFERED);
+    return m_io.get_mode();
 }
 
 // Принимает на вход количество кластеров, необходимых файлу,
 // и возвращает номер первого кластера, в который можно производить запись.
+// Поиск начинается с подсказки m_next_free и при неудаче повторяется
+// с начала области данных.
 uint32_t Partition::find_empty_space(uint32_t clusters_number)
 {
-    uint32_t fat_block;
+    if (clusters_number == 0)
+        return 0;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    uint32_t start = m_next_free;
+    if (start < 2U || start > last_cluster)
+        start = 2U;
+    uint32_t first_cluster = find_free_run
+        (start, last_cluster, clusters_number);
+    if (first_cluster == 0 && start > 2U)
+        first_cluster = find_free_run(2U, last_cluster, clusters_number);
+    if (first_cluster != 0)
+    {
+        m_next_free = first_cluster + clusters_number;
+        if (m_next_free > last_cluster)
+            m_next_free = 2U;
+    }
+    return first_cluster;
+}
+
+uint32_t Partition::find_free_run(uint32_t first, uint32_t last,
+    uint32_t clusters_number)
+{
+    while (clusters_number != 0 && first <= last)
+    {
+        Extent run = next_free_run(first, last);
+        if (run.count == 0)
+            return 0;
+        if (run.count >= clusters_number)
+            return run.first;
+        first = run.first + run.count;
+    }
+    return 0;
+}
+
+uint32_t Partition::count_free_clusters()
+{
     uint32_t counter = 0;
-    uint32_t first_cluster = 0;
-    uint32_t block_size = 2U;
-    uint32_t last_data_cluster = 0xFFEFU;
-    // Первые два блока (0, 1) зарезервированы. Третий (2) не используется.
-    for (uint32_t i = 3; i < m_FAT.length(); ++i)
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    for (uint32_t i = 2U; i <= last_cluster; )
+    {
+        Extent run = next_free_run(i, last_cluster);
+        if (run.count == 0)
+            break;
+        counter += run.count;
+        i = run.first + run.count;
+    }
+    return counter;
+}
+
+uint32_t Partition::get_free_clusters()
+{
+    if (m_free_clusters == 0xFFFFFFFFU)
+        m_free_clusters = count_free_clusters();
+    return m_free_clusters;
+}
+
+void Partition::commit_fsinfo()
+{
+    // Количество свободных кластеров поддерживается при изменении
+    // таблицы. Подсказкой служит первый свободный кластер начиная
+    // с m_next_free; поиск с начала нужен, только если после
+    // m_next_free свободных кластеров нет.
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    uint32_t next_free = 0xFFFFFFFFU;
+    if (get_free_clusters() != 0)
     {
-        if (counter == clusters_number) break;
+        Extent run = next_free_run(m_next_free, last_cluster);
+        if (run.count == 0)
+            run = next_free_run(2U, last_cluster);
+        if (run.count != 0)
+            next_free = run.first;
+    }
+    m_pbr.write_fsinfo(m_drive, get_free_clusters(), next_free);
+    discard_freed();
+}
 
-        if ((i / block_size) > last_data_cluster)
+void Partition::discard_freed()
+{
+    if (m_freed.empty())
+        return;
+    // Освобождаемые кластеры не должны быть доступны через таблицу
+    // или записи файлов на накопителе: иначе при сбое файл ссылался бы
+    // на кластеры с неопределённым содержимым.
+    flush_entry_patches();
+    m_drive.flush();
+    m_io.sync();
+
+    std::sort(m_freed.begin(), m_freed.end(),
+        [](const Extent& a, const Extent& b) { return a.first < b.first; });
+    std::vector<Extent> extents;
+    for (auto& extent : m_freed)
+        if (!extents.empty()
+            && extents.back().first + extents.back().count == extent.first)
+            extents.back().count += extent.count;
+        else
+            extents.push_back(extent);
+    m_freed.clear();
+
+    uint64_t cluster_size = m_pbr.get_parameters().cluster_size;
+    for (auto& extent : extents)
+    {
+        // Накопитель или файловая система образа не поддерживает
+        // операцию - остальные участки не освобождаются.
+        if (!m_io.discard(cluster_offset(extent.first),
+            extent.count * cluster_size))
         {
-            first_cluster = 0;
+            ++m_discard_stats.failures;
             break;
-        } 
-        fat_block = m_FAT.get_value<uint32_t>(i * block_size, Bytes::WORD);
-        if (fat_block == 0)
-        {
-            if (counter == 0) 
-                first_cluster = i;    
-            ++counter;
-            continue;
-        }
-        if (counter > 0)
-        {
-            counter = 0;
-            first_cluster = 0;
         }
+        ++m_discard_stats.requests;
+        m_discard_stats.bytes += extent.count * cluster_size;
     }
-    return first_cluster;
 }
 
 uint32_t Partition::count_file_clusters(const FileInfo& file)
 {   
-    if (file.first_cluster == 0)
+    if (!is_next_cluster(file.first_cluster))
         return 0U;
     uint32_t counter = 0;
     uint32_t current_cluster = file.first_cluster;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    // Цепочка не может быть длиннее области данных: большее значение
+    // означает цикл, и подсчёт прекращается.
     do
     {
         ++counter;
-        current_cluster = m_FAT.get_value<uint32_t>
-            (current_cluster * 2, Bytes::WORD);
-    } while (current_cluster != 0xFFFF);
+        current_cluster = get_fat_entry(current_cluster);
+    } while (is_next_cluster(current_cluster) && counter <= last_cluster);
     return counter;
 }
@@ -0,0 +1,225 @@
+#include "Partition.h"
+#include "PBR.h"
+
+#include <fstream>
+#include <string>
+#include <cstdio> // std::snprintf
+#include <cmath> // std::sqrt, std::ceil
+#include <thread> // std::thread
+#include <algorithm> // std::min, std::max
+
+namespace
+{
+    // Цвета категорий карты (RGB) в порядке MapCategory. Цвет точки -
+    // смесь цветов категорий пропорционально количеству кластеров.
+    const uint8_t map_colors[Partition::MAP_CATEGORIES][3] =
+    {
+        { 0xE8, 0xE8, 0xE8 }, // свободные
+        { 0x30, 0x70, 0xE0 }, // непрерывные файлы
+        { 0xE0, 0x30, 0x30 }, // фрагментированные файлы
+        { 0x30, 0xB0, 0x50 }, // директории
+        { 0x50, 0x50, 0x50 }  // прочие
+    };
+    const char* map_names[Partition::MAP_CATEGORIES] =
+        { "free", "contiguous", "fragmented", "directory", "other" };
+    const uint32_t min_shard = 65536U;
+    const uint32_t max_threads = 16U;
+
+    // Строка в виде значения JSON: кавычки, обратная косая черта
+    // и управляющие символы экранируются. Байты UTF-8 переносятся
+    // без изменений.
+    std::string json_string(const std::string& text)
+    {
+        std::string result = "\"";
+        for (char ch : text)
+        {
+            switch (ch)
+            {
+                case '"':  result += "\\\""; break;
+                case '\\': result += "\\\\"; break;
+                case '\n': result += "\\n"; break;
+                case '\r': result += "\\r"; break;
+                case '\t': result += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(ch) < 0x20U)
+                    {
+                        char code[8];
+                        std::snprintf(code, sizeof(code), "\\u%04X",
+                            static_cast<unsigned char>(ch));
+                        result += code;
+                    }
+                    else
+                        result += ch;
+            }
+        }
+        return result + '"';
+    }
+}
+
+Partition::ClusterMap Partition::build_cluster_map(uint32_t resolution)
+{
+    ClusterMap map;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    if (last_cluster < 2U || resolution == 0)
+        return map;
+    map.clusters = last_cluster - 1U;
+    map.cluster_size = m_pbr.get_parameters().cluster_size;
+    map.clusters_per_bucket = (map.clusters + resolution - 1U) / resolution;
+    uint32_t buckets = (map.clusters + map.clusters_per_bucket - 1U)
+        / map.clusters_per_bucket;
+    map.width = static_cast<uint32_t>(std::ceil(std::sqrt(buckets)));
+    map.height = (buckets + map.width - 1U) / map.width;
+    map.buckets.assign(buckets, {});
+
+    build_owner_map();
+    uint32_t threads_number = std::max(1U, std::min
+        ({ std::thread::hardware_concurrency(), max_threads,
+           map.clusters / min_shard + 1U }));
+
+    // Файл фрагментирован, если хотя бы одна ссылка его цепочки
+    // ведёт не на следующий по порядку кластер. Каждая часть таблицы
+    // собирает такие файлы отдельно. Внутри последовательного
+    // участка таблицы переходов нет, проверяются только концы участков.
+    uint32_t mask = fat_entry_mask();
+    std::vector<std::vector<uint32_t>> jumps(threads_number);
+    uint32_t shard = map.clusters / threads_number + 1U;
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < threads_number; ++t)
+    {
+        threads.emplace_back([&, t]()
+            {
+                uint32_t first = 2U + t * shard;
+                uint32_t last = std::min(last_cluster, first + shard - 1U);
+                for (auto span = m_FAT.runs_from(first); !span.at_end()
+                    && span->first <= last; ++span)
+                {
+                    uint32_t end = std::min(last,
+                        span->first + span->length - 1U);
+                    uint32_t i = span->sequential ? end : span->first;
+                    for (; i <= end; ++i)
+                    {
+                        uint32_t owner = m_owners[i];
+                        if (owner == 0 || owner == CROSS_LINKED)
+                            continue;
+                        uint32_t value = span->value(i) & mask;
+                        if (is_next_cluster(value) && value != i + 1U)
+                            jumps[t].push_back(owner);
+                    }
+                }
+            });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    std::vector<uint8_t> fragmented(m_files.size() + 1U, 0);
+    for (auto& owners : jumps)
+        for (auto owner : owners)
+            fragmented[owner] = 1U;
+
+    // Подсчёт категорий по участкам. Части таблицы выровнены
+    // по границам участков, поэтому потоки не пишут в общие участки.
+    threads.clear();
+    uint32_t bucket_shard = buckets / threads_number + 1U;
+    for (uint32_t t = 0; t < threads_number; ++t)
+    {
+        threads.emplace_back([&, t]()
+            {
+                uint32_t end = std::min(buckets, (t + 1U) * bucket_shard);
+                for (uint32_t b = t * bucket_shard; b < end; ++b)
+                {
+                    auto& bucket = map.buckets[b];
+                    uint32_t first = 2U + b * map.clusters_per_bucket;
+                    uint32_t last = std::min(last_cluster,
+                        first + map.clusters_per_bucket - 1U);
+                    for (auto span = m_FAT.runs_from(first); !span.at_end()
+                        && span->first <= last; ++span)
+                    {
+                        uint32_t end = std::min(last,
+                            span->first + span->length - 1U);
+                        for (uint32_t i = span->first; i <= end; ++i)
+                        {
+                            uint32_t owner = m_owners[i];
+                            if ((span->value(i) & mask) == 0)
+                                ++bucket[MAP_FREE];
+                            else if (owner == 0 || owner == CROSS_LINKED)
+                                ++bucket[MAP_OTHER];
+                            else if (m_files[owner - 1U].type != FILE)
+                                ++bucket[MAP_DIRECTORY];
+                            else if (fragmented[owner])
+                                ++bucket[MAP_FRAGMENTED];
+                            else
+                                ++bucket[MAP_CONTIGUOUS];
+                        }
+                    }
+                }
+            });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    for (auto& bucket : map.buckets)
+        for (int c = 0; c < MAP_CATEGORIES; ++c)
+            map.totals[c] += bucket[c];
+    return map;
+}
+
+bool Partition::export_cluster_map(const ClusterMap& map,
+    const std::string& path)
+{
+    std::ofstream image(path + ".ppm", std::ios::binary);
+    if (!image.is_open())
+        return false;
+    image << "P6\n" << map.width << ' ' << map.height << "\n255\n";
+    // Точки за последним участком остаются чёрными.
+    std::vector<char> row(static_cast<size_t>(map.width) * 3U);
+    for (uint32_t y = 0; y < map.height; ++y)
+    {
+        std::fill(row.begin(), row.end(), 0);
+        for (uint32_t x = 0; x < map.width; ++x)
+        {
+            size_t index = static_cast<size_t>(y) * map.width + x;
+            if (index >= map.buckets.size())
+                break;
+            auto& bucket = map.buckets[index];
+            uint64_t sum = 0;
+            uint64_t color[3] = {};
+            for (int c = 0; c < MAP_CATEGORIES; ++c)
+            {
+                sum += bucket[c];
+                for (int k = 0; k < 3; ++k)
+                    color[k] += static_cast<uint64_t>(bucket[c])
+                        * map_colors[c][k];
+            }
+            for (int k = 0; sum != 0 && k < 3; ++k)
+                row[x * 3U + k] = static_cast<char>(color[k] / sum);
+        }
+        image.write(row.data(), row.size());
+    }
+    if (!image)
+        return false;
+
+    std::ofstream json(path + ".json");
+    if (!json.is_open())
+        return false;
+    size_t slash = path.find_last_of('/');
+    json << "{\n"
+        << "  \"image\": " << json_string(path.substr(slash
+            == std::string::npos ? 0 : slash + 1U) + ".ppm") << ",\n"
+        << "  \"clusters\": " << map.clusters << ",\n"
+        << "  \"cluster_size\": " << map.cluster_size << ",\n"
+        << "  \"clusters_per_pixel\": " << map.clusters_per_bucket << ",\n"
+        << "  \"pixels\": " << map.buckets.size() << ",\n"
+        << "  \"width\": " << map.width << ",\n"
+        << "  \"height\": " << map.height << ",\n"
+        << "  \"categories\": [\n";
+    for (int c = 0; c < MAP_CATEGORIES; ++c)
+    {
+        char color[8];
+        std::snprintf(color, sizeof(color), "#%02X%02X%02X",
+            map_colors[c][0], map_colors[c][1], map_colors[c][2]);
+        json << "    { \"name\": " << json_string(map_names[c])
+            << ", \"color\": " << json_string(color)
+            << ", \"clusters\": " << map.totals[c] << " }"
+            << (c + 1 < MAP_CATEGORIES ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+    return static_cast<bool>(json);
+}
@@ -0,0 +1,241 @@
+#include "Partition.h"
+#include "PBR.h"
+
+#include <iostream>
+#include <cstring> // std::memcmp
+#include <future> // std::async
+#include <algorithm> // std::min, std::sort, std::unique
+
+namespace
+{
+    // Копии сравниваются крупными блоками (std::memcmp использует
+    // векторные инструкции), и только различающиеся блоки - по секторам.
+    const size_t compare_block = 65536U;
+    const uint32_t unreadable = 0xFFFFFFFFU;
+}
+
+void Partition::load_fat()
+{
+    auto& parameters = m_pbr.get_parameters();
+    uint64_t fat_size = parameters.fat_size;
+    uint32_t copies = std::max<uint32_t>(1U, parameters.fat_number);
+    m_mirror_report = {};
+    m_mirror_report.copies = copies;
+    m_fat_copies.clear();
+
+    // Копии считываются одновременно, каждая одним запросом: время
+    // загрузки определяется чтением одной копии.
+    std::vector<Bytes> fats(copies);
+    std::vector<bool> readable(copies, false);
+    for (auto& fat : fats)
+        fat.resize(fat_size);
+    if (m_reader.is_open())
+    {
+        std::vector<std::future<bool>> reads;
+        for (uint32_t i = 0; i < copies; ++i)
+            reads.push_back(std::async(std::launch::async, [&, i]()
+                {
+                    return m_reader.read(fats[i], fat_size,
+                        parameters.fat_offset + fat_size * i);
+                }));
+        for (uint32_t i = 0; i < copies; ++i)
+            readable[i] = reads[i].get();
+    }
+    else
+    {
+        m_drive.seekg(parameters.fat_offset, m_drive.beg);
+        m_drive.read(fats[0], fat_size);
+        readable[0] = true;
+        fats.resize(1U);
+    }
+
+    compare_fat_copies(fats, readable);
+    for (uint32_t i = 0; i < fats.size(); ++i)
+        m_mirror_report.invalid_entries.push_back(readable[i]
+            ? count_invalid_entries(fats[i]) : unreadable);
+    if (m_mirror_report.mismatched_sectors.empty())
+    {
+        // Копии совпадают - остальные не нужны.
+        uint32_t first = 0;
+        while (first + 1U < fats.size() && !readable[first])
+            ++first;
+        m_mirror_report.chosen = first;
+        m_FAT.assign(fats[first], fat_entry_bits(),
+            parameters.bytes_per_sector);
+        m_fat_hashes.clear();
+        update_fat_hashes(fats[first], 0);
+        return;
+    }
+    m_fat_copies = fats;
+    select_fat_copy();
+}
+
+void Partition::compare_fat_copies(const std::vector<Bytes>& copies,
+    const std::vector<bool>& readable)
+{
+    uint32_t sector_size = m_pbr.get_parameters().bytes_per_sector;
+    std::vector<uint32_t>& mismatched = m_mirror_report.mismatched_sectors;
+    // Каждая копия сравнивается с первой считанной.
+    uint32_t reference = 0;
+    while (reference < copies.size() && !readable[reference])
+        ++reference;
+    for (uint32_t i = reference + 1U; i < copies.size(); ++i)
+    {
+        if (!readable[i])
+            continue;
+        size_t size = copies[i].length();
+        for (size_t block = 0; block < size; block += compare_block)
+        {
+            size_t length = std::min(compare_block, size - block);
+            if (std::memcmp(static_cast<const char*>(copies[reference])
+                + block, static_cast<const char*>(copies[i]) + block,
+                length) == 0)
+                continue;
+            for (size_t sector = block; sector < block + length;
+                sector += sector_size)
+            {
+                size_t sector_length = std::min<size_t>(sector_size,
+                    block + length - sector);
+                if (std::memcmp(static_cast<const char*>(copies[reference])
+                    + sector, static_cast<const char*>(copies[i]) + sector,
+                    sector_length) != 0)
+                    mismatched.push_back(sector / sector_size);
+            }
+        }
+    }
+    std::sort(mismatched.begin(), mismatched.end());
+    mismatched.erase(std::unique(mismatched.begin(), mismatched.end()),
+        mismatched.end());
+}
+
+uint32_t Partition::count_invalid_entries(const Bytes& fat) const
+{
+    // Проверяются только элементы различающихся секторов: в остальных
+    // копии совпадают. Ссылка недопустима, если она указывает за
+    // пределы области данных и не является служебным значением.
+    uint32_t sector_size = m_pbr.get_parameters().bytes_per_sector;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    uint32_t entry_bits = fat_entry_bits();
+    uint32_t invalid = 0;
+    for (auto sector : m_mirror_report.mismatched_sectors)
+    {
+        uint64_t first = static_cast<uint64_t>(sector) * sector_size * 8U
+            / entry_bits;
+        uint64_t last = (static_cast<uint64_t>(sector) + 1U) * sector_size
+            * 8U / entry_bits;
+        for (uint64_t cluster = std::max<uint64_t>(first, 2U);
+            cluster <= std::min<uint64_t>(last, last_cluster); ++cluster)
+        {
+            uint32_t value = read_fat_entry(fat, cluster);
+            if (value != 0 && !is_chain_end(value) && !is_bad_cluster(value)
+                && !is_next_cluster(value))
+                ++invalid;
+        }
+    }
+    return invalid;
+}
+
+void Partition::select_fat_copy()
+{
+    if (m_fat_copies.empty())
+        return;
+    auto& invalid = m_mirror_report.invalid_entries;
+    uint32_t chosen = 0;
+    while (chosen + 1U < m_fat_copies.size() && invalid[chosen] == unreadable)
+        ++chosen;
+    // Правило FAT_VALID: копия с наименьшим числом недопустимых
+    // ссылок, при равенстве - с меньшим номером.
+    if (m_fat_policy == FAT_VALID)
+        for (uint32_t i = chosen + 1U; i < m_fat_copies.size(); ++i)
+            if (invalid[i] < invalid[chosen])
+                chosen = i;
+    m_mirror_report.chosen = chosen;
+    m_FAT.assign(m_fat_copies[chosen], fat_entry_bits(),
+        m_pbr.get_parameters().bytes_per_sector);
+    // Копии различаются и количеством свободных кластеров.
+    m_free_clusters = count_free_clusters();
+    m_fat_hashes.clear();
+    update_fat_hashes(m_fat_copies[chosen], 0);
+    // Различающиеся сектора записываются во все копии вместе
+    // с первым изменением таблицы, после чего копии совпадают.
+    for (auto sector : m_mirror_report.mismatched_sectors)
+        m_FAT.mark_sector(sector);
+}
+
+void Partition::write_fat()
+{
+    auto& dirty = m_FAT.dirty_sectors();
+    if (dirty.empty())
+        return;
+    uint64_t fat_offset = m_pbr.get_parameters().fat_offset;
+    uint64_t fat_size = m_pbr.get_parameters().fat_size;
+    uint32_t sector_size = m_pbr.get_parameters().bytes_per_sector;
+    uint32_t copies = std::max<uint32_t>(1U,
+        m_pbr.get_parameters().fat_number);
+    for (auto it = dirty.begin(); it != dirty.end();)
+    {
+        uint32_t first = *it;
+        uint32_t count = 0;
+        for (; it != dirty.end() && *it == first + count; ++it)
+            ++count;
+        Bytes sectors = m_FAT.serialize(first, count);
+        update_fat_hashes(sectors, first);
+        for (uint32_t i = 0; i < copies; ++i)
+        {
+            m_drive.seekp(fat_offset + fat_size * i
+                + static_cast<uint64_t>(first) * sector_size, m_drive.beg);
+            m_drive.write(sectors, sectors.length());
+        }
+    }
+    m_FAT.clear_dirty();
+    // После записи все копии совпадают с основной, и сохранённые
+    // копии больше не нужны.
+    m_fat_copies.clear();
+}
+
+void Partition::set_fat_policy(FatPolicy policy)
+{
+    m_fat_policy = policy;
+    select_fat_copy();
+}
+
+void Partition::print_fat_memory() const
+{
+    std::cout << "Таблица FAT в памяти: ";
+    if (m_FAT.is_flat())
+        std::cout << "массив элементов, ";
+    else
+        std::cout << m_FAT.runs_number() << " участков, ";
+    std::cout << (m_FAT.memory_usage() + 1023U) / 1024U
+        << " Kb (на накопителе " << (m_FAT.size() + 1023U) / 1024U
+        << " Kb)\n";
+}
+
+void Partition::print_fat_mirror_report() const
+{
+    const FatMirrorReport& report = m_mirror_report;
+    if (report.mismatched_sectors.empty())
+    {
+        std::cout << "Копии таблицы FAT совпадают (" << report.copies
+            << ").\n";
+        return;
+    }
+    std::cout << "Копии таблицы FAT различаются в "
+        << report.mismatched_sectors.size() << " секторах:";
+    const size_t shown = 16U;
+    for (size_t i = 0; i < report.mismatched_sectors.size() && i < shown; ++i)
+        std::cout << ' ' << report.mismatched_sectors[i];
+    if (report.mismatched_sectors.size() > shown)
+        std::cout << " ...";
+    std::cout << '\n';
+    for (uint32_t i = 0; i < report.invalid_entries.size(); ++i)
+    {
+        std::cout << "Копия " << i + 1U << ": ";
+        if (report.invalid_entries[i] == unreadable)
+            std::cout << "не считана\n";
+        else
+            std::cout << "недопустимых ссылок " << report.invalid_entries[i]
+                << '\n';
+    }
+    std::cout << "Основная копия: " << report.chosen + 1U << '\n';
+}
@@ -0,0 +1,262 @@
+#include "Partition.h"
+#include "PBR.h"
+#include "FAT_Layout.h"
+
+#include <cassert>
+
+uint32_t Partition::build_owner_map()
+{
+    collect_tree();
+
+    // Проход по цепочкам таблицы FAT. Корневая директория FAT12/FAT16
+    // не занимает кластеров области данных, поэтому не отмечается.
+    for (uint32_t i = 0; i < m_files.size(); ++i)
+    {
+        if (m_files[i].type == ROOT_DIR
+            && m_pbr.get_parameters().fat_type != PBR::FAT32)
+            continue;
+        mark_file(i);
+    }
+    save_scan();
+    return m_files.size();
+}
+
+void Partition::collect_tree()
+{
+    m_files.clear();
+    m_cross_links.clear();
+    m_owners.assign(m_pbr.get_parameters().last_cluster + 1U, 0U);
+
+    // Обход дерева каталогов: в таблицу попадают все файлы
+    // и директории, начиная с корневой. Корневая директория
+    // разбирается всегда, вложенные могут быть взяты из снимка.
+    begin_scan();
+    FileInfo root = get_root_dir();
+    add_file_record({ root.entry_offset, root.first_cluster, root.size,
+        m_files.intern(root.name), root.type }, NO_RECORD);
+    collect_files(root, 0);
+}
+
+void Partition::add_file_record(const ScanRecord& record, uint32_t origin)
+{
+    m_files.push_back(record);
+    if (!m_scan_cache)
+        return;
+    m_scan.origin.push_back(origin);
+    m_scan.links.emplace_back();
+}
+
+void Partition::collect_dir(uint32_t index)
+{
+    if (!reuse_dir(index))
+        collect_files(make_file_info(index), index);
+}
+
+void Partition::collect_files(const FileInfo& dir, uint32_t index)
+{
+    namespace FL = FAT_Layout;
+    // Записи директории переносятся в арену напрямую, без
+    // промежуточных экземпляров FileInfo и строк имён.
+    size_t begin = m_files.size();
+    // Для снимка запоминаются суммы прочитанных кластеров
+    // директории, кроме корневой, которая разбирается всегда.
+    bool hashing = m_scan_cache && dir.type == DIR;
+    uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
+    if (hashing)
+    {
+        m_scan.links[index].hashes_begin = m_scan.hashes.size();
+        ++m_scan.stats.dirs_parsed;
+    }
+    for_each_dir_extent(dir, [&](Bytes& buff, uint32_t cluster)
+        {
+            char name[FL::DirEntry::short_name_max];
+            for (size_t i = 0; i < buff.length(); i += FL::DirEntry::size)
+            {
+                FL::DirEntryView entry(buff + i);
+                if (entry.is_end())
+                {
+                    if (hashing)
+                        hash_dir_clusters(buff, cluster,
+                            i / cluster_size + 1U);
+                    return false;
+                }
+                ScanRecord record = get_record_from_entry(buff, cluster, i);
+                if (record.type == NONE)
+                    continue;
+                record.name = m_files.intern
+                    (std::string_view(name, entry.short_name(name)));
+                // Запись сопоставляется с прежним снимком по первому
+                // кластеру: файл мог быть переименован или перенесён
+                // в другую директорию без изменения цепочки.
+                uint32_t origin = NO_RECORD;
+                auto found = m_scan.by_cluster.find(record.first_cluster);
+                if (record.first_cluster != 0
+                    && found != m_scan.by_cluster.end())
+                    origin = found->second;
+                add_file_record(record, origin);
+            }
+            if (hashing)
+                hash_dir_clusters(buff, cluster,
+                    buff.length() / cluster_size);
+            return true;
+        });
+    // Вложенные директории обходятся после чтения текущей, чтобы
+    // не держать в памяти буферы всех уровней вложенности сразу.
+    size_t end = m_files.size();
+    if (m_scan_cache)
+    {
+        ScanCache::Record& links = m_scan.links[index];
+        links.children_begin = begin;
+        links.children_count = end - begin;
+        if (hashing)
+            links.hashes_count = m_scan.hashes.size() - links.hashes_begin;
+    }
+    for (size_t i = begin; i < end; ++i)
+        if (m_files[i].type == DIR)
+            collect_dir(i);
+}
+
+Partition::FileInfo Partition::make_file_info(uint32_t index) const
+{
+    const ScanRecord& record = m_files[index];
+    FileInfo file;
+    file.partition_sn = m_pbr.get_parameters().serial_number;
+    file.type = record.type;
+    file.first_cluster = record.first_cluster;
+    file.size = record.size;
+    file.entry_offset = record.entry_offset;
+    file.name = m_files.get_name(record.name);
+    return file;
+}
+
+Partition::ChainStatus Partition::mark_file(uint32_t index)
+{
+    const ScanRecord& file = m_files[index];
+    if (!m_scan_cache)
+        return mark_chain(index + 1U, file.first_cluster);
+
+    ChainStatus status;
+    size_t extents_begin = m_scan.extents.size();
+    uint32_t origin = m_scan.origin[index];
+    if (origin != NO_RECORD
+        && is_chain_unchanged(origin, file.first_cluster))
+    {
+        // Элементы цепочки не менялись: кластеры отмечаются
+        // по участкам из снимка, без чтения таблицы.
+        const ScanCache::Record& record = m_scan.snapshot.record(origin);
+        for (uint32_t k = 0; k < record.extents_count && !status.cycle; ++k)
+        {
+            const ScanCache::Extent& extent
+                = m_scan.snapshot.extent(record.extents_begin + k);
+            for (uint32_t i = 0; i < extent.count; ++i)
+            {
+                if (!claim_cluster(index + 1U, extent.first + i, status))
+                    break;
+                ++status.length;
+            }
+            m_scan.extents.push_back(extent);
+        }
+        ++m_scan.stats.chains_reused;
+    }
+    else
+    {
+        status = mark_chain(index + 1U, file.first_cluster, &m_scan.extents);
+        if (file.first_cluster != 0)
+            ++m_scan.stats.chains_walked;
+    }
+    // Участки нарушенной цепочки в снимок не попадают.
+    if (status.cycle || status.cross_owner != 0 || status.bad_cluster
+        || status.invalid_link)
+        m_scan.extents.resize(extents_begin);
+    ScanCache::Record& links = m_scan.links[index];
+    links.extents_begin = extents_begin;
+    links.extents_count = m_scan.extents.size() - extents_begin;
+    return status;
+}
+
+bool Partition::claim_cluster(uint32_t index, uint32_t cluster,
+    ChainStatus& status)
+{
+    uint32_t& owner = m_owners[cluster];
+    // Повторное попадание в собственный кластер - цикл в цепочке.
+    if (owner == index)
+    {
+        status.cycle = true;
+        return false;
+    }
+    if (owner == 0)
+        owner = index;
+    else
+    {
+        if (status.cross_owner == 0)
+            status.cross_owner = owner;
+        if (owner != CROSS_LINKED)
+            m_cross_links.push_back(cluster);
+        owner = CROSS_LINKED;
+    }
+    return true;
+}
+
+Partition::ChainStatus Partition::mark_chain(uint32_t index,
+    uint32_t first_cluster, std::vector<ScanCache::Extent>* extents)
+{
+    ChainStatus status;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    uint32_t current_cluster = first_cluster;
+    if (first_cluster != 0 && !is_next_cluster(first_cluster))
+        status.invalid_link = true;
+    while (is_next_cluster(current_cluster))
+    {
+        // Цепочка длиннее области данных может быть только циклом,
+        // проходящим через кластеры других файлов.
+        if (status.length > last_cluster)
+        {
+            status.cycle = true;
+            break;
+        }
+        if (!claim_cluster(index, current_cluster, status))
+            break;
+        ++status.length;
+        if (extents != nullptr)
+        {
+            if (status.length > 1U && extents->back().first
+                + extents->back().count == current_cluster)
+                ++extents->back().count;
+            else
+                extents->push_back({ current_cluster, 1U });
+        }
+        uint32_t next_cluster = get_fat_entry(current_cluster);
+        if (is_chain_end(next_cluster))
+            break;
+        if (is_bad_cluster(next_cluster))
+        {
+            status.bad_cluster = true;
+            break;
+        }
+        if (!is_next_cluster(next_cluster))
+        {
+            status.invalid_link = true;
+            break;
+        }
+        current_cluster = next_cluster;
+    }
+    return status;
+}
+
+uint32_t Partition::find_owner(uint32_t first_cluster) const
+{
+    if (first_cluster >= m_owners.size())
+        return 0;
+    uint32_t owner = m_owners[first_cluster];
+    if (owner == 0 || owner == CROSS_LINKED)
+        return 0;
+    assert(owner <= m_files.size() && "Invalid owner index.");
+    return owner;
+}
+
+Partition::FileInfo Partition::get_owner(uint32_t cluster) const
+{
+    if (uint32_t owner = find_owner(cluster))
+        return make_file_info(owner - 1U);
+    return FileInfo{};
+}
@@ -0,0 +1,569 @@
+#include "Partition.h"
+#include "PBR.h"
+#include "FAT_Layout.h"
+
+#include <iostream>
+#include <algorithm> // std::max, std::sort
+#include <map> // std::map, std::multimap
+#include <unordered_map> // std::unordered_map
+#include <iterator> // std::prev
+
+uint32_t Partition::defragment_tree(FileInfo& dir)
+{
+    if (dir.type != DIR && dir.type != ROOT_DIR)
+        return 0;
+    if (!m_checked)
+        check_fat();
+    bool owner_map = !m_owners.empty();
+    uint32_t counter = 0;
+    uint32_t cursor = 2U;
+    uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
+    // Размещение файла с учётом в ходе операции. Общий объём работы
+    // растёт по мере обхода директорий.
+    auto place = [&](FileInfo& file)
+    {
+        uint64_t bytes = static_cast<uint64_t>(count_file_clusters(file))
+            * cluster_size;
+        counter += place_file(file, cursor);
+        advance_progress(file, bytes);
+    };
+    begin_progress(0, 0);
+
+    // Размещение цепочек директорий в порядке обхода в ширину.
+    // Корневая директория не перемещается: для FAT12/FAT16 она
+    // находится вне области данных, а для FAT32 её кластер указан
+    // в загрузочной записи.
+    if (dir.type == DIR)
+    {
+        add_progress_total(1U, static_cast<uint64_t>
+            (count_file_clusters(dir)) * cluster_size);
+        place(dir);
+    }
+    std::vector<FileInfo> dirs { dir };
+    for (size_t i = 0; i < dirs.size() && !m_cancel; ++i)
+    {
+        std::vector<FileInfo> entries = list_dir(dirs[i]);
+        for (auto& entry : entries)
+            if (entry.type == DIR || entry.type == FILE)
+                add_progress_total(1U, static_cast<uint64_t>
+                    (count_file_clusters(entry)) * cluster_size);
+        for (auto& entry : entries)
+        {
+            if (entry.type != DIR)
+                continue;
+            place(entry);
+            dirs.push_back(entry);
+        }
+    }
+
+    // Размещение файлов каждой директории в порядке записей,
+    // вслед за областью директорий.
+    for (auto& current_dir : dirs)
+    {
+        if (m_cancel)
+            break;
+        for (auto& entry : list_dir(current_dir))
+        {
+            if (entry.type == FILE)
+                place(entry);
+        }
+    }
+
+    // Перемещение директорий меняет смещения записей, сохранённые
+    // в таблице файлов, поэтому карта строится заново.
+    if (owner_map)
+        build_owner_map();
+    flush_entry_patches();
+    commit_fsinfo();
+    end_progress();
+    return counter;
+}
+
+/* Уплотнение нацелено на рост наибольшего свободного участка, поэтому
+ * переносятся не все мелкие файлы, а только те, место которых сливается
+ * с соседними промежутками:
+ * - хвост раздела (кластеры после последнего занятого кластера, не
+ *   принадлежащего мелкому непрерывному файлу) освобождается целиком,
+ *   если он больше наибольшего участка и все его файлы помещаются
+ *   в промежутки перед ним;
+ * - файл, разделяющий два промежутка, переносится, если объединённый
+ *   промежуток больше наибольшего. Затем этот участок наращивается
+ *   переносом соседних с ним файлов, за которыми лежит ещё один
+ *   промежуток.
+ * Файл переносится в наименьший подходящий промежуток перед ним. */
+Partition::PackReport Partition::pack_small_files(uint32_t max_clusters)
+{
+    PackReport report;
+    if (!m_checked)
+        check_fat();
+    else
+        build_owner_map();
+    uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    if (max_clusters == 0)
+        max_clusters = std::max(1U, 1048576U / cluster_size);
+
+    // Свободные участки по положению и по длине.
+    std::map<uint32_t, uint32_t> runs;
+    std::multimap<uint32_t, uint32_t> by_length;
+    auto add_run = [&](uint32_t first, uint32_t count)
+        {
+            runs[first] = count;
+            by_length.insert({ count, first });
+        };
+    auto remove_run = [&](uint32_t first)
+        {
+            auto run = runs.find(first);
+            auto range = by_length.equal_range(run->second);
+            for (auto it = range.first; it != range.second; ++it)
+                if (it->second == first)
+                {
+                    by_length.erase(it);
+                    break;
+                }
+            runs.erase(run);
+        };
+    auto largest = [&]()
+        { return by_length.empty() ? 0U : by_length.rbegin()->first; };
+    for (auto& hole : collect_free_runs())
+        add_run(hole.first, hole.count);
+    report.holes_before = runs.size();
+    report.largest_hole_before = largest();
+
+    // Перемещаемые файлы - неповреждённые непрерывные файлы не длиннее
+    // max_clusters кластеров: индекс в таблице файлов - длина.
+    std::unordered_map<uint32_t, uint32_t> movable;
+    for (uint32_t i = 0; i < m_files.size(); ++i)
+    {
+        const ScanRecord& record = m_files[i];
+        if (record.type != FILE || m_blocked.count(record.first_cluster))
+            continue;
+        FileInfo file = make_file_info(i);
+        if (is_file_fragmented(file))
+            continue;
+        uint32_t clusters = count_file_clusters(file);
+        if (clusters != 0 && clusters <= max_clusters)
+            movable.emplace(i, clusters);
+    }
+    // Перемещаемый файл, которому принадлежит кластер, или NO_RECORD.
+    auto movable_owner = [&](uint32_t cluster) -> uint32_t
+        {
+            if (cluster < 2U || cluster > last_cluster
+                || cluster >= m_owners.size())
+                return NO_RECORD;
+            uint32_t owner = m_owners[cluster];
+            if (owner == 0 || owner == CROSS_LINKED
+                || !movable.count(owner - 1U))
+                return NO_RECORD;
+            return owner - 1U;
+        };
+    // Наименьший промежуток из clusters и более кластеров, лежащий
+    // перед кластером before, кроме промежутков skip.
+    auto find_hole = [&](uint32_t clusters, uint32_t before,
+        uint32_t skip_a, uint32_t skip_b) -> uint32_t
+        {
+            for (auto hole = by_length.lower_bound(clusters);
+                hole != by_length.end(); ++hole)
+                if (hole->second < before && hole->second != skip_a
+                    && hole->second != skip_b)
+                    return hole->second;
+            return 0;
+        };
+    // Перенос файла в начало промежутка. Освободившиеся кластеры
+    // сливаются с соседними промежутками. Возвращает первый кластер
+    // образовавшегося участка или 0, если перенос не удался.
+    auto move = [&](uint32_t index, uint32_t hole_first) -> uint32_t
+        {
+            FileInfo file = make_file_info(index);
+            uint32_t clusters = movable[index];
+            uint32_t from = file.first_cluster;
+            uint64_t bytes = static_cast<uint64_t>(clusters) * cluster_size;
+            uint32_t largest_before = largest();
+            add_progress_total(1U, bytes);
+            if (!move_file(file, hole_first))
+                return 0;
+            uint32_t hole_length = runs[hole_first];
+            remove_run(hole_first);
+            if (hole_length > clusters)
+                add_run(hole_first + clusters, hole_length - clusters);
+            uint32_t first = from;
+            uint32_t count = clusters;
+            auto next = runs.find(from + clusters);
+            if (next != runs.end())
+            {
+                count += next->second;
+                remove_run(next->first);
+            }
+            auto previous = runs.lower_bound(from);
+            if (previous != runs.begin()
+                && std::prev(previous)->first
+                    + std::prev(previous)->second == from)
+            {
+                --previous;
+                first = previous->first;
+                count += previous->second;
+                remove_run(first);
+            }
+            add_run(first, count);
+            report.moves.push_back({ file.name, from, hole_first, clusters,
+                count, largest_before, largest() });
+            ++report.files;
+            report.bytes_moved += bytes;
+            advance_progress(file, bytes);
+            return first;
+        };
+    begin_progress(0, 0);
+
+    // Хвост раздела и его файлы в порядке убывания положения.
+    uint32_t tail_first = last_cluster + 1U;
+    std::vector<uint32_t> tail_files;
+    for (; tail_first > 2U; --tail_first)
+    {
+        uint32_t cluster = tail_first - 1U;
+        if (get_fat_entry(cluster) == 0)
+            continue;
+        uint32_t owner = movable_owner(cluster);
+        if (owner == NO_RECORD)
+            break;
+        if (tail_files.empty() || tail_files.back() != owner)
+            tail_files.push_back(owner);
+    }
+    if (!tail_files.empty() && last_cluster + 1U - tail_first > largest())
+    {
+        // Хвост освобождается, только если все его файлы помещаются
+        // в промежутки перед ним: выбор промежутков повторяется заранее.
+        std::multimap<uint32_t, uint32_t> trial;
+        for (auto& [length, first] : by_length)
+            if (first < tail_first)
+                trial.insert({ length, first });
+        bool fits = true;
+        for (auto index : tail_files)
+        {
+            uint32_t clusters = movable[index];
+            auto hole = trial.lower_bound(clusters);
+            if (hole == trial.end())
+            {
+                fits = false;
+                break;
+            }
+            auto [length, first] = *hole;
+            trial.erase(hole);
+            if (length > clusters)
+                trial.insert({ length - clusters, first + clusters });
+        }
+        for (size_t i = 0; fits && i < tail_files.size() && !m_cancel; ++i)
+        {
+            uint32_t hole = find_hole(movable[tail_files[i]], tail_first,
+                0, 0);
+            if (hole == 0 || move(tail_files[i], hole) == 0)
+                break;
+        }
+    }
+
+    // Файл между двумя промежутками, объединённый участок которых
+    // больше наибольшего, и наращивание этого участка.
+    while (!m_cancel)
+    {
+        uint32_t target = 0;
+        std::vector<std::pair<uint32_t, uint32_t>> seeds;
+        for (auto& [first, count] : runs)
+        {
+            uint32_t owner = movable_owner(first + count);
+            if (owner == NO_RECORD)
+                continue;
+            auto next = runs.find(first + count + movable[owner]);
+            if (next != runs.end()
+                && count + movable[owner] + next->second > largest())
+                seeds.push_back({ count + movable[owner] + next->second,
+                    first });
+        }
+        std::sort(seeds.rbegin(), seeds.rend());
+        for (auto& [merged, first] : seeds)
+        {
+            uint32_t file_first = first + runs[first];
+            uint32_t owner = movable_owner(file_first);
+            uint32_t hole = find_hole(movable[owner], file_first, first,
+                file_first + movable[owner]);
+            if (hole != 0 && (target = move(owner, hole)) != 0)
+                break;
+        }
+        if (target == 0)
+            break;
+
+        while (!m_cancel)
+        {
+            uint32_t run_first = target;
+            uint32_t run_end = run_first + runs[run_first];
+            uint32_t moved = 0;
+            // Файл после участка и промежуток за ним.
+            uint32_t owner = movable_owner(run_end);
+            if (owner != NO_RECORD
+                && runs.count(run_end + movable[owner]))
+            {
+                uint32_t hole = find_hole(movable[owner], run_end, run_first,
+                    run_end + movable[owner]);
+                if (hole != 0)
+                    moved = move(owner, hole);
+            }
+            // Файл перед участком и промежуток перед ним.
+            owner = moved ? NO_RECORD : movable_owner(run_first - 1U);
+            if (owner != NO_RECORD)
+            {
+                uint32_t file_first = m_files[owner].first_cluster;
+                auto previous = runs.lower_bound(file_first);
+                if (previous != runs.begin()
+                    && std::prev(previous)->first
+                        + std::prev(previous)->second == file_first)
+                {
+                    uint32_t hole = find_hole(movable[owner], file_first,
+                        std::prev(previous)->first, run_first);
+                    if (hole != 0)
+                        moved = move(owner, hole);
+                }
+            }
+            if (moved == 0)
+                break;
+            target = moved;
+        }
+    }
+
+    std::vector<Extent> holes = collect_free_runs();
+    report.holes_after = holes.size();
+    for (auto& hole : holes)
+        report.largest_hole_after = std::max
+            (report.largest_hole_after, hole.count);
+    flush_entry_patches();
+    commit_fsinfo();
+    end_progress();
+    return report;
+}
+
+std::vector<Partition::Extent> Partition::collect_free_runs()
+{
+    std::vector<Extent> runs;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    for (uint32_t i = 2U; i <= last_cluster; )
+    {
+        Extent run = next_free_run(i, last_cluster);
+        if (run.count == 0)
+            break;
+        runs.push_back(run);
+        i = run.first + run.count;
+    }
+    return runs;
+}
+
+void Partition::print_pack_report(const PackReport& report) const
+{
+    double cluster_mb = m_pbr.get_parameters().cluster_size / 1048576.0;
+    double moved_mb = report.bytes_moved / 1048576.0;
+    double gained_mb = (static_cast<double>(report.largest_hole_after)
+        - report.largest_hole_before) * cluster_mb;
+    for (auto& move : report.moves)
+        std::cout << "Перенесён " << move.name << ": кластер " << move.from
+            << " -> " << move.to << ", освобождён участок "
+            << move.freed_run * cluster_mb << " Mb, наибольший участок "
+            << move.largest_before * cluster_mb << " -> "
+            << move.largest_after * cluster_mb << " Mb\n";
+    std::cout << "Перенесено мелких файлов: " << report.files 
+        << " (" << moved_mb << " Mb)\n"
+        << "Свободных промежутков: " << report.holes_before 
+        << " -> " << report.holes_after << '\n'
+        << "Наибольший свободный участок: "
+        << report.largest_hole_before * cluster_mb << " Mb -> "
+        << report.largest_hole_after * cluster_mb << " Mb\n"
+        << "Прирост непрерывного свободного места: " << gained_mb << " Mb";
+    if (report.bytes_moved > 0)
+        std::cout << " (" << gained_mb / moved_mb 
+            << " Mb на 1 Mb перенесённых данных)";
+    std::cout << '\n';
+}
+
+uint32_t Partition::place_file(FileInfo& file, uint32_t& cursor)
+{
+    uint32_t clusters = count_file_clusters(file);
+    if (clusters == 0)
+        return 0;
+    bool fragmented = is_file_fragmented(file);
+    if (!fragmented && file.first_cluster == cursor)
+    {
+        cursor += clusters;
+        return 0;
+    }
+    uint32_t destination = find_free_run
+        (cursor, m_pbr.get_parameters().last_cluster, clusters);
+    if (destination == 0)
+        return 0;
+    // Непрерывный файл переносится только ближе к началу раздела.
+    if (!fragmented && destination > file.first_cluster)
+        return 0;
+    if (!move_file(file, destination))
+        return 0;
+    cursor = destination + clusters;
+    return 1;
+}
+
+std::vector<Partition::FileInfo> Partition::list_dir(const FileInfo& dir)
+{
+    std::vector<FileInfo> files;
+    for_each_dir_extent(dir, [&](Bytes& buff, uint32_t cluster)
+        {
+            for (size_t i = 0; i < buff.length(); i += FAT_Layout::DirEntry::size)
+            {
+                if (FAT_Layout::DirEntryView(buff + i).is_end())
+                    return false;
+                FileInfo file = get_file_from_entry(buff, cluster, i);
+                if (file.type != NONE)
+                    files.push_back(file);
+            }
+            return true;
+        });
+    return files;
+}
+
+Partition::ProfileReport Partition::place_by_profile
+    (const std::vector<std::string>& paths)
+{
+    ProfileReport report;
+    std::vector<FileInfo> files;
+    for (auto path : paths)
+    {
+        FileInfo file = get_file(path);
+        if (file.type != FILE || file.first_cluster == 0)
+            continue;
+        // Повторные обращения в записанной трассе учитываются один раз.
+        bool repeated = false;
+        for (auto& el : files)
+            if (el.first_cluster == file.first_cluster)
+                repeated = true;
+        if (!repeated)
+            files.push_back(file);
+    }
+    report.files = files.size();
+    report.seeks_before = count_seeks(files);
+    if (files.empty())
+        return report;
+    if (!m_checked)
+        check_fat();
+
+    // Уже размещённые файлы профиля отмечаются, чтобы их кластеры
+    // не вытеснялись при освобождении места для следующих. Ещё не
+    // размещённые файлы профиля могут быть вытеснены, как и прочие.
+    build_owner_map();
+    std::vector<bool> hot(m_files.size() + 1U, false);
+    // Индексы файлов в таблице файлов не меняются при перемещениях,
+    // в отличие от номеров первых кластеров.
+    std::vector<uint32_t> owners;
+    uint32_t reserved_end = 2U;
+    for (auto& file : files)
+    {
+        owners.push_back(find_owner(file.first_cluster));
+        reserved_end += count_file_clusters(file);
+    }
+
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    uint32_t cursor = 2U;
+    uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
+    begin_progress(files.size(), static_cast<uint64_t>(reserved_end - 2U)
+        * cluster_size);
+    for (size_t k = 0; k < files.size() && !m_cancel; ++k)
+    {
+        FileInfo& file = files[k];
+        uint32_t owner = owners[k];
+        if (owner)
+            file.first_cluster = m_files[owner - 1U].first_cluster;
+        uint32_t clusters = count_file_clusters(file);
+        advance_progress(file, static_cast<uint64_t>(clusters)
+            * cluster_size);
+        if (!is_file_fragmented(file) && file.first_cluster == cursor)
+        {
+            cursor += clusters;
+            hot[owner] = true;
+            ++report.placed;
+            continue;
+        }
+        for (uint32_t first = cursor; first + clusters - 1U <= last_cluster; )
+        {
+            uint32_t blocker = 0;
+            for (uint32_t i = first; i < first + clusters; ++i)
+            {
+                uint32_t current = m_owners[i];
+                if (current == CROSS_LINKED || (current != 0 
+                    && (hot[current] || m_files[current - 1U].type != FILE)))
+                    blocker = i;
+            }
+            if (blocker == 0 && clear_window(first, clusters, 
+                std::max(reserved_end, first + clusters), hot,
+                report.evicted))
+            {
+                // Файл мог быть вытеснен из окна вместе с остальными.
+                if (owner)
+                    file.first_cluster = m_files[owner - 1U].first_cluster;
+                if (move_file(file, first))
+                {
+                    cursor = first + clusters;
+                    hot[owner] = true;
+                    ++report.placed;
+                }
+                break;
+            }
+            // Окно содержит неперемещаемые кластеры - сдвигаемся за них.
+            first = (blocker != 0) ? blocker + 1U : first + 1U;
+        }
+    }
+    // Вытесненные файлы профиля получили новые первые кластеры.
+    for (size_t k = 0; k < files.size(); ++k)
+        if (owners[k])
+            files[k].first_cluster = m_files[owners[k] - 1U].first_cluster;
+    report.seeks_after = count_seeks(files);
+    flush_entry_patches();
+    commit_fsinfo();
+    end_progress();
+    return report;
+}
+
+bool Partition::clear_window(uint32_t first, uint32_t count,
+    uint32_t reserved_end, const std::vector<bool>& hot, uint32_t& evicted)
+{
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    for (uint32_t i = first; i < first + count; ++i)
+    {
+        uint32_t owner = m_owners[i];
+        if (owner == 0)
+            continue;
+        // Директории не вытесняются: их перемещение изменило бы
+        // смещения записей, сохранённые в таблице файлов.
+        if (owner == CROSS_LINKED || hot[owner]
+            || m_files[owner - 1U].type != FILE)
+            return false;
+        FileInfo blocking = make_file_info(owner - 1U);
+        uint32_t clusters = count_file_clusters(blocking);
+        uint32_t destination = find_free_run
+            (reserved_end, last_cluster, clusters);
+        if (destination == 0 || !move_file(blocking, destination))
+            return false;
+        ++evicted;
+    }
+    return true;
+}
+
+uint32_t Partition::count_seeks(const std::vector<FileInfo>& files)
+{
+    uint32_t seeks = 0;
+    uint32_t previous_cluster = 0;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    for (auto& file : files)
+    {
+        uint32_t current_cluster = file.first_cluster;
+        uint32_t steps = 0;
+        while (current_cluster >= 2U && current_cluster <= last_cluster
+            && ++steps <= last_cluster)
+        {
+            if (current_cluster != previous_cluster + 1U)
+                ++seeks;
+            previous_cluster = current_cluster;
+            current_cluster = get_fat_entry(current_cluster);
+        }
+    }
+    return seeks;
+}
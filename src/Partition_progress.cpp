@@ -0,0 +1,88 @@
+#include "Partition.h"
+
+#include <cmath> // std::exp
+
+void Partition::begin_progress(uint32_t files_total, uint64_t bytes_total)
+{
+    m_progress = {};
+    m_progress.files_total = files_total;
+    m_progress.bytes_total = bytes_total;
+    m_progress_start = std::chrono::steady_clock::now();
+    m_progress_reported = m_progress_start;
+    m_move_rate = -1;
+    m_done_rate = -1;
+    m_rate_moved = 0;
+    m_rate_done = 0;
+    report_progress(true);
+}
+
+void Partition::add_progress_total(uint32_t files, uint64_t bytes)
+{
+    m_progress.files_total += files;
+    m_progress.bytes_total += bytes;
+    report_progress(false);
+}
+
+void Partition::advance_progress(const FileInfo& file, uint64_t bytes)
+{
+    ++m_progress.files_done;
+    m_progress.bytes_done += bytes;
+    m_progress.file = file.name;
+    report_progress(false);
+}
+
+void Partition::report_progress(bool force)
+{
+    auto now = std::chrono::steady_clock::now();
+    double since_report = std::chrono::duration<double>
+        (now - m_progress_reported).count();
+    if (!m_progress_callback || (!force && since_report < progress_interval))
+        return;
+    m_progress_reported = now;
+    m_progress.cancelled = m_cancel;
+
+    // Скорость за время с предыдущего замера сглаживается: вес замера
+    // растёт с его длительностью, и замеры старше нескольких
+    // progress_window почти не влияют на результат. Средняя скорость
+    // за всю операцию медленно реагировала бы на её изменение.
+    if (since_report > 0)
+    {
+        double move_rate = (m_progress.bytes_moved - m_rate_moved)
+            / since_report;
+        double done_rate = (m_progress.bytes_done - m_rate_done)
+            / since_report;
+        double weight = 1.0 - std::exp(-since_report / progress_window);
+        m_move_rate = m_move_rate < 0 ? move_rate
+            : m_move_rate + weight * (move_rate - m_move_rate);
+        m_done_rate = m_done_rate < 0 ? done_rate
+            : m_done_rate + weight * (done_rate - m_done_rate);
+        m_rate_moved = m_progress.bytes_moved;
+        m_rate_done = m_progress.bytes_done;
+        m_progress.megabytes_per_second = m_move_rate / 1048576.0;
+    }
+    // Итог операции - средняя скорость за всё время.
+    double elapsed = std::chrono::duration<double>
+        (now - m_progress_start).count();
+    if (m_progress.finished && elapsed > 0)
+        m_progress.megabytes_per_second = m_progress.bytes_moved
+            / 1048576.0 / elapsed;
+    // Оставшееся время - по текущей скорости обработки байт: файлы,
+    // не требующие переноса, обрабатываются почти мгновенно,
+    // и это учитывается в скорости.
+    if (m_progress.finished)
+        m_progress.eta_seconds = 0;
+    else if (m_done_rate > 0
+        && m_progress.bytes_total >= m_progress.bytes_done)
+        m_progress.eta_seconds = (m_progress.bytes_total
+            - m_progress.bytes_done) / m_done_rate;
+    else
+        m_progress.eta_seconds = -1;
+    m_progress_callback(m_progress);
+}
+
+void Partition::end_progress()
+{
+    m_progress.finished = true;
+    m_progress.file.clear();
+    report_progress(true);
+}
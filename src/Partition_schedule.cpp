@@ -0,0 +1,85 @@
+#include "Partition.h"
+#include "PBR.h"
+
+#include <iostream>
+#include <cmath> // std::sqrt, std::abs
+#include <algorithm> // std::stable_sort
+
+/* Модель времени перехода между фрагментами: постоянная часть
+ * (успокоение головки и ожидание сектора) и часть, растущая
+ * как корень из пройденного расстояния, до полного хода головки.
+ * Значения соответствуют типичному жёсткому диску; для оценки
+ * важны не абсолютные значения, а порядок файлов. */
+namespace
+{
+    const double seek_base_us = 2000.0;
+    const double seek_full_stroke_us = 8000.0;
+    const double bytes_in_mb = 1048576.0;
+}
+
+void Partition::estimate_benefit(ScheduleEntry& entry)
+{
+    entry.fragments = 0;
+    entry.clusters = 0;
+    entry.score = 0;
+    uint32_t current_cluster = entry.file.first_cluster;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    if (!is_next_cluster(current_cluster))
+        return;
+
+    // Каждый разрыв цепочки - лишний переход головки при чтении,
+    // тем более долгий, чем дальше следующий фрагмент.
+    double gain_us = 0;
+    entry.fragments = 1;
+    for (uint32_t steps = 0; steps <= last_cluster; ++steps)
+    {
+        ++entry.clusters;
+        uint32_t next_cluster = get_fat_entry(current_cluster);
+        if (!is_next_cluster(next_cluster))
+            break;
+        if (next_cluster != current_cluster + 1U)
+        {
+            ++entry.fragments;
+            double distance = std::abs(static_cast<double>(next_cluster)
+                - current_cluster);
+            gain_us += seek_base_us + seek_full_stroke_us
+                * std::sqrt(distance / last_cluster);
+        }
+        current_cluster = next_cluster;
+    }
+    double moved_mb = static_cast<double>(entry.clusters)
+        * m_pbr.get_parameters().cluster_size / bytes_in_mb;
+    entry.score = gain_us / moved_mb;
+}
+
+void Partition::build_schedule(const FileInfo& dir)
+{
+    m_schedule.clear();
+    for (auto& file : list_dir(dir))
+    {
+        ScheduleEntry entry;
+        entry.file = file;
+        estimate_benefit(entry);
+        if (entry.fragments > 1U)
+            m_schedule.push_back(entry);
+    }
+    // При равной оценке сохраняется порядок записей директории.
+    std::stable_sort(m_schedule.begin(), m_schedule.end(),
+        [](const ScheduleEntry& a, const ScheduleEntry& b)
+            { return a.score > b.score; });
+}
+
+void Partition::print_schedule() const
+{
+    if (m_schedule.empty())
+        return;
+    std::cout << "Очередь дефрагментации (оценка - мкс экономии "
+        << "чтения на 1 Mb переноса):\n";
+    for (auto& entry : m_schedule)
+    {
+        std::cout << entry.file.name << ": фрагментов " << entry.fragments
+            << ", кластеров " << entry.clusters << ", оценка "
+            << static_cast<uint64_t>(entry.score)
+            << (entry.moved ? "" : ", не перемещён") << '\n';
+    }
+}
@@ -1,8 +1,11 @@
 #include <iostream>
 #include <cstdlib> // system()
+#include <algorithm> // std::min, std::max
+#include <future> // std::async
 
 #include "Bytes.h"
 #include "Partition.h"
+#include "FAT_Layout.h"
 
 bool Partition::is_open() const
 {
@@ -28,6 +31,8 @@ void Partition::print_file_info(const FileInfo& file)
     }
     if (file.type == FILE)
         std::cout << "Размер файла: " << file.size << " байт\n";
+    if (file.type == ROOT_DIR)
+        std::cout << "Свободных кластеров: " << get_free_clusters() << '\n';
     std::cout << "Номер первого кластера: " << file.first_cluster << '\n';
     std::cout << "Количество кластеров: "
               << count_file_clusters(file) << '\n';
@@ -40,18 +45,26 @@ void Partition::print_file_info(const FileInfo& file)
         std::cout << " не фрагментирован\n";
 }
 
-void Partition::init(const std::string& path)
+void Partition::init(const std::string& path, uint64_t offset)
 {
     std::string instruction = "umount ";
     instruction += path;
     system(instruction.c_str());
+    m_path = path;
     m_drive.open(path, std::ios::binary | std::ios::in | std::ios::out);
+    m_reader.open(path, DriveIO::BUFFERED, 0);
     if (m_drive.is_open())
     {
-        m_pbr.set(m_drive);
-        m_FAT.resize(m_pbr.get_parameters().fat_size);
-        m_drive.seekg(m_pbr.get_parameters().fat_offset, m_drive.beg);
-        m_drive.read(m_FAT, m_pbr.get_parameters().fat_size);
+        m_pbr.set(m_drive, offset);
+        m_io.open(path, DriveIO::BUFFERED,
+            m_pbr.get_parameters().bytes_per_sector);
+        load_fat();
+        // Значение из FSInfo могло устареть: количество свободных
+        // кластеров подсчитывается по таблице один раз при открытии
+        // и далее поддерживается при изменении элементов.
+        m_free_clusters = count_free_clusters();
+        if (m_pbr.get_parameters().next_free != 0xFFFFFFFFU)
+            m_next_free = m_pbr.get_parameters().next_free;
     }
 }
 
@@ -68,7 +81,7 @@ Partition::FileInfo Partition::get_root_dir()
         file.entry_offset = m_pbr.get_parameters().data_offset;
     if (m_pbr.get_parameters().fat_type == PBR::FAT32)
         file.entry_offset = m_pbr.get_parameters().data_offset
-            + m_pbr.get_parameters().cluster_size * (file.first_cluster - 1);
+            + m_pbr.get_parameters().cluster_size * (file.first_cluster - 2U);
     return file;
 }
 
@@ -79,50 +92,42 @@ Partition::FileInfo Partition::get_file(std::string& path)
         return get_root_dir();
     }
     std::string filename;
+    std::string prefix;
 
     FileInfo file {};
-    
-    uint32_t current_cluster = m_pbr.get_parameters().root_dir_cluster;
-    uint32_t root_dir_size = m_pbr.get_parameters().root_dir_size;
-    uint32_t dir_size = root_dir_size;
-    uint32_t cluster_size = m_pbr.get_parameters().cluster_size;
-    uint64_t data_offset = m_pbr.get_parameters().data_offset;
-    uint64_t cluster_offset;
-    uint32_t shift = 1U; // сдвиг из-за нулевого блока таблицы FAT
-
-    Bytes dir_cluster(dir_size);
+    FileInfo dir = get_root_dir();
 
     cut_string(path, '/');
     
     while (path != "")
     {
         filename = extract_name(path);
-        do
-        {
-            cluster_offset = data_offset
-                + (current_cluster - shift) * cluster_size;
-            
-            m_drive.seekg(cluster_offset, m_drive.beg);
-            m_drive.read(dir_cluster, dir_size);
-
-            file = search_file(filename, dir_cluster);
-
-            if (dir_size != cluster_size)
-            {
-                data_offset += root_dir_size;
-                dir_size = cluster_size;
-                shift = 2U; // прибавляем кластер корневой директории
-                dir_cluster.resize(dir_size);
-            }
-            if (file.type != NONE)
-            {
-                file.entry_offset += cluster_offset;
-                break;
-            }
-            current_cluster = m_FAT.get_value<uint32_t>
-                (current_cluster * 2, Bytes::WORD);
-
-        } while (current_cluster != 0xFFFF);
+        prefix += '/';
+        prefix += filename;
+        file = {};
+        // Найденные ранее директории берутся из кэша без чтения.
+        auto cached = m_dir_cache.find(prefix);
+        if (cached != m_dir_cache.end())
+            file = cached->second;
+        // Директория считывается непрерывными участками; чтение
+        // прекращается на найденной записи или на конце директории.
+        if (file.type == NONE)
+            for_each_dir_extent(dir, [&](Bytes& buff, uint32_t cluster)
+                {
+                    for (size_t i = 0; i < buff.length();
+                        i += FAT_Layout::DirEntry::size)
+                    {
+                        if (FAT_Layout::DirEntryView(buff + i).is_end())
+                            return false;
+                        FileInfo entry = get_file_from_entry(buff, cluster, i);
+                        if (entry.type != NONE && entry.name == filename)
+                        {
+                            file = entry;
+                            return false;
+                        }
+                    }
+                    return true;
+                });
         
         cut_string(path, '/');
 
@@ -133,36 +138,8 @@ Partition::FileInfo Partition::get_file(std::string& path)
         }
         if (file.type == DIR)
         {
-            current_cluster = file.first_cluster;
-        }
-    }
-    return ((file.type != NONE) ? file : FileInfo{});
-}
-
-Partition::FileInfo Partition::search_file(std::string& filename, Bytes& dir)
-{
-    FileInfo file {};
-    for (size_t i = 0; i < dir.length(); i += 0x20)
-    {
-        char ch = dir.get_value<char>(i);
-        if (static_cast<unsigned char>(ch) == 0xE5U 
-            || ch == '.')
-            continue;
-        if (ch == 0)
-            break;
-        file.name = get_entry_name(dir, i);
-        if (file.name == filename)
-        {
-            file.partition_sn = m_pbr.get_parameters().serial_number;
-            file.type = get_file_type(dir, i);
-            if (uint16_t f_c_h = dir.get_value<uint16_t>(i + 0x14))
-            {
-                file.first_cluster += static_cast<uint32_t>(f_c_h) << 16U;
-            }
-            file.first_cluster += dir.get_value<uint16_t>(i + 0x1A);
-            file.size = dir.get_value<uint32_t>(i + 0x1C);
-            file.entry_offset = i;
-            break;
+            m_dir_cache[prefix] = file;
+            dir = file;
         }
     }
     return ((file.type != NONE) ? file : FileInfo{});
@@ -170,39 +147,17 @@ Partition::FileInfo Partition::search_file(std::string& filename, Bytes& dir)
 
 std::string Partition::get_entry_name(Bytes& dir, size_t offset)
 {
-    std::string name;
-    char ch;
-    for (uint8_t j = 0; j < 8; ++j)
-    {
-        ch = dir.get_value<char>(offset + j);
-        //std::cout << ch;
-        if (ch == 0x20) 
-            break;
-        name += ch;
-    }
-    ch = dir.get_value<char>(offset + 0xB);
-    if ((ch & 0x10) == 0)
-    {
-        name += '.';
-        for (uint8_t j = 0x8; j <= 0xA; ++j)
-        {
-            
-            ch = dir.get_value<char>(offset + j);
-            if (ch == 0x20) 
-                break;
-            name += ch;
-        }
-    }
-    return name;
+    return FAT_Layout::DirEntryView(dir + offset).short_name();
 }
 
 Partition::FileType Partition::get_file_type(Bytes& dir, size_t offset)
 {
+    namespace FL = FAT_Layout;
     FileType type = NONE;
-    char ch = dir.get_value<char>(offset + 0xB);
-    if (ch == 0x10)
+    uint8_t attributes = FL::DirEntryView(dir + offset).attributes();
+    if (attributes == FL::DirEntry::directory)
         type = DIR;
-    if (ch == 0x20)
+    if (attributes == FL::DirEntry::archive)
         type = FILE;
     return type;
 }
@@ -244,8 +199,25 @@ Partition::FileInfo Partition::get_file_from_entry(Bytes& dir,
         uint32_t dir_cluster_number, size_t offset)
 {
     FileInfo file = {};
-    unsigned char ch = dir.get_value<unsigned char>(offset);
-    if (ch == 0xE5U || ch == '.' || ch == 0)
+    ScanRecord record = get_record_from_entry(dir, dir_cluster_number, offset);
+    if (record.type != NONE)
+    {
+        file.type = record.type;
+        file.name = get_entry_name(dir, offset);
+        file.partition_sn = m_pbr.get_parameters().serial_number;
+        file.first_cluster = record.first_cluster;
+        file.size = record.size;
+        file.entry_offset = record.entry_offset;
+    }
+    return file;
+}
+
+Partition::ScanRecord Partition::get_record_from_entry(Bytes& dir,
+        uint32_t dir_cluster_number, size_t offset)
+{
+    ScanRecord file = {};
+    FAT_Layout::DirEntryView entry(dir + offset);
+    if (entry.is_free() || entry.is_dot() || entry.is_end())
         return file;
     file.type = get_file_type(dir, offset);
     if (file.type != NONE)
@@ -255,20 +227,218 @@ Partition::FileInfo Partition::get_file_from_entry(Bytes& dir,
         auto cluster_size = m_pbr.get_parameters().cluster_size;
         auto fat_type = m_pbr.get_parameters().fat_type;
 
-        file.name = get_entry_name(dir, offset);
-        file.partition_sn = m_pbr.get_parameters().serial_number;
-        if (uint16_t f_c_h = dir.get_value<uint16_t>(offset + 0x14))
-        {
-            file.first_cluster += static_cast<uint32_t>(f_c_h) << 16U;
-        }
-        file.first_cluster += dir.get_value<uint16_t>(offset + 0x1A);
-        file.size = dir.get_value<uint32_t>(offset + 0x1C);
-        if (fat_type == PBR::FAT12 || fat_type == PBR::FAT16)
+        file.first_cluster = entry.first_cluster(fat_type == PBR::FAT32);
+        file.size = entry.file_size();
+        // Корневая директория FAT12/FAT16 располагается в начале
+        // области данных, до кластеров.
+        if ((fat_type == PBR::FAT12 || fat_type == PBR::FAT16)
+            && dir_cluster_number == m_pbr.get_parameters().root_dir_cluster)
+            file.entry_offset = data_offset + offset;
+        else if (fat_type == PBR::FAT12 || fat_type == PBR::FAT16)
             file.entry_offset = data_offset + root_dir_size
                 + (cluster_size * (dir_cluster_number - 2U)) + offset;
         if (fat_type == PBR::FAT32)
             file.entry_offset = data_offset
-                + (cluster_size * (dir_cluster_number - 1U)) + offset;
+                + (cluster_size * (dir_cluster_number - 2U)) + offset;
     }
     return file;
-}
\ No newline at end of file
+}
+void Partition::for_each_dir_extent(const FileInfo& dir,
+        std::function<bool(Bytes&, uint32_t)> handler)
+{
+    if (dir.type != DIR && dir.type != ROOT_DIR)
+        return;
+    // Директория читается с накопителя вместе с отложенными
+    // изменениями записей.
+    flush_entry_patches();
+    auto fat_type = m_pbr.get_parameters().fat_type;
+    auto cluster_size = m_pbr.get_parameters().cluster_size;
+
+    if (dir.type == ROOT_DIR && fat_type != PBR::FAT32)
+    {
+        Bytes buff(m_pbr.get_parameters().root_dir_size);
+        m_drive.seekg(m_pbr.get_parameters().data_offset, m_drive.beg);
+        m_drive.read(buff, buff.length());
+        handler(buff, m_pbr.get_parameters().root_dir_cluster);
+        return;
+    }
+
+    // Участки цепочки разбиваются на запросы не более 1 МиБ,
+    // чтобы большие директории не требовали большого буфера.
+    const uint32_t max_read_clusters = std::max(1U, 
+        static_cast<uint32_t>(1048576U / cluster_size));
+    std::vector<Extent> reads;
+    for (auto& extent : get_chain_extents(dir.first_cluster))
+        for (uint32_t i = 0; i < extent.count; i += max_read_clusters)
+            reads.push_back({ extent.first + i, 
+                std::min(max_read_clusters, extent.count - i) });
+    if (reads.empty())
+        return;
+
+    // Пока обрабатывается текущий участок, следующий считывается
+    // в фоновом потоке через позиционный доступ m_reader.
+    m_drive.flush();
+    Bytes buffers[2];
+    auto read_extent = [&](Bytes& buff, const Extent& extent)
+        {
+            buff.resize(static_cast<size_t>(extent.count) * cluster_size);
+            if (m_reader.is_open())
+                return m_reader.read(buff, buff.length(), 
+                    cluster_offset(extent.first));
+            m_drive.seekg(cluster_offset(extent.first), m_drive.beg);
+            m_drive.read(buff, buff.length());
+            return static_cast<bool>(m_drive);
+        };
+    bool ok = read_extent(buffers[0], reads[0]);
+    for (size_t k = 0; k < reads.size() && ok; ++k)
+    {
+        std::future<bool> next;
+        if (k + 1U < reads.size() && m_reader.is_open())
+            next = std::async(std::launch::async, read_extent,
+                std::ref(buffers[(k + 1U) % 2U]), std::cref(reads[k + 1U]));
+        bool proceed = handler(buffers[k % 2U], reads[k].first);
+        if (next.valid())
+            ok = next.get();
+        else if (proceed && k + 1U < reads.size())
+            ok = read_extent(buffers[(k + 1U) % 2U], reads[k + 1U]);
+        if (!proceed)
+            break;
+    }
+    if (!ok)
+        m_drive.clear();
+}
+
+std::vector<Partition::Extent> Partition::get_chain_extents
+    (uint32_t first_cluster)
+{
+    std::vector<Extent> extents;
+    uint32_t last_cluster = m_pbr.get_parameters().last_cluster;
+    uint32_t current_cluster = first_cluster;
+    // Ограничение числа шагов защищает от зацикленных цепочек.
+    for (uint32_t steps = 0; is_next_cluster(current_cluster)
+        && steps <= last_cluster; ++steps)
+    {
+        if (!extents.empty() && extents.back().first 
+            + extents.back().count == current_cluster)
+            ++extents.back().count;
+        else
+            extents.push_back({ current_cluster, 1U });
+        current_cluster = get_fat_entry(current_cluster);
+    }
+    return extents;
+}
+
+uint32_t Partition::get_fat_entry(uint32_t cluster) const
+{
+    return m_FAT.get(cluster) & fat_entry_mask();
+}
+
+uint32_t Partition::fat_entry_mask() const
+{
+    return m_pbr.get_parameters().fat_type == PBR::FAT32
+        ? 0x0FFFFFFFU : 0xFFFFFFFFU;
+}
+
+Partition::Extent Partition::next_free_run(uint32_t first,
+    uint32_t last) const
+{
+    Extent run{ 0, 0 };
+    uint32_t mask = fat_entry_mask();
+    for (auto span = m_FAT.runs_from(first); !span.at_end()
+        && span->first <= last; ++span)
+    {
+        // Свободны все элементы постоянного участка нулей и только
+        // последний элемент последовательного участка.
+        uint32_t free_first = span->first;
+        uint32_t free_count = (span->tail & mask) == 0 ? span->length : 0;
+        if (span->sequential && free_count != 0)
+        {
+            free_first += span->length - 1U;
+            free_count = 1U;
+        }
+        if (run.count != 0 && (free_count == 0
+            || free_first != run.first + run.count))
+            break;
+        if (free_count == 0)
+            continue;
+        if (run.count == 0)
+            run.first = free_first;
+        run.count += free_count;
+    }
+    if (run.count != 0 && run.first + run.count - 1U > last)
+        run.count = last - run.first + 1U;
+    return run;
+}
+
+uint32_t Partition::read_fat_entry(const Bytes& fat, uint32_t cluster) const
+{
+    switch (m_pbr.get_parameters().fat_type)
+    {
+        case PBR::FAT12:
+        {
+            // Элемент FAT12 занимает полтора байта.
+            uint32_t value = fat.get_value<uint32_t>
+                (cluster + cluster / 2U, Bytes::WORD);
+            return (cluster & 1U) ? (value >> 4U) : (value & 0xFFFU);
+        }
+        case PBR::FAT32:
+            // Старшие 4 бита элемента FAT32 зарезервированы.
+            return fat.get_value<uint32_t>
+                (cluster * 4U, Bytes::DOUBLE_WORD) & 0x0FFFFFFFU;
+        default:
+            return fat.get_value<uint32_t>(cluster * 2U, Bytes::WORD);
+    }
+}
+
+void Partition::set_fat_entry(uint32_t cluster, uint32_t value)
+{
+    uint32_t previous = m_FAT.get(cluster);
+    // Зарезервированные биты элемента FAT32 сохраняются.
+    if (m_pbr.get_parameters().fat_type == PBR::FAT32)
+        value = (previous & 0xF0000000U) | (value & 0x0FFFFFFFU);
+    m_FAT.set(cluster, value);
+
+    // Учёт свободных кластеров при выделении и освобождении.
+    uint32_t mask = fat_entry_mask();
+    bool was_free = (previous & mask) == 0;
+    bool is_free = (value & mask) == 0;
+    if (m_free_clusters != 0xFFFFFFFFU && was_free != is_free
+        && cluster >= 2U && cluster <= m_pbr.get_parameters().last_cluster)
+        m_free_clusters += is_free ? 1U : -1U;
+}
+
+uint32_t Partition::fat_entry_bits() const
+{
+    switch (m_pbr.get_parameters().fat_type)
+    {
+        case PBR::FAT12: return 12U;
+        case PBR::FAT32: return 32U;
+        default:         return 16U;
+    }
+}
+
+uint32_t Partition::end_of_chain() const
+{
+    switch (m_pbr.get_parameters().fat_type)
+    {
+        case PBR::FAT12: return 0xFFFU;
+        case PBR::FAT32: return 0x0FFFFFFFU;
+        default:         return 0xFFFFU;
+    }
+}
+
+bool Partition::is_chain_end(uint32_t value) const
+{
+    // Значения от 0x...FF8 до 0x...FFF обозначают конец цепочки.
+    return value >= (end_of_chain() & ~0x7U);
+}
+
+bool Partition::is_bad_cluster(uint32_t value) const
+{
+    return value == end_of_chain() - 8U;
+}
+
+bool Partition::is_next_cluster(uint32_t value) const
+{
+    return value >= 2U && value <= m_pbr.get_parameters().last_cluster;
+}
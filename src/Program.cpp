@@ -7,18 +7,40 @@
 #include <limits> // std::numeric_limits<>::max()
 #include <filesystem> // directory_iterator()
 #include <cstring> // strcat, strcpy
+#include <fstream> // std::ifstream
+#include <chrono> // std::chrono::steady_clock
+#include <atomic> // std::atomic
+#include <csignal> // std::signal
+#include <cstdio> // std::snprintf
 
 #include "PBR.h"
 #include "Partition.h"
 
+namespace
+{
+    // Раздел, операция которого отменяется по Ctrl+C. Обработчик
+    // сигнала только выставляет запрос отмены.
+    std::atomic<Partition*> tracked_partition{ nullptr };
+
+    void cancel_tracked(int)
+    {
+        Partition* partition = tracked_partition.load();
+        if (partition != nullptr)
+            partition->cancel();
+    }
+}
+
 void Program::start()
 {
     int ch = -1;
     do
     {
         system("clear");
-        std::cout << "Запустить поиск FAT разделов(1) "
-            << "или открыть файл устройства(2)? (Выход - 0)\nОтвет: ";
+        std::cout << "Запустить поиск FAT разделов(1), "
+            << "открыть файл устройства(2) "
+            << "разместить файлы по профилю доступа(3) "
+            << "или построить карту кластеров(4)? "
+            << "(Выход - 0)\nОтвет: ";
         std::cin >> ch;
         if (std::cin.fail())
         {
@@ -26,17 +48,18 @@ void Program::start()
             std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
             ch = -1;
         }
-    } while (ch != 2 && ch != 1 && ch != 0);
+    } while (ch != 4 && ch != 3 && ch != 2 && ch != 1 && ch != 0);
 
     std::cout << '\n';
 
     std::string path;
+    PartitionTable::Volume volume;
     switch(ch)
     {
         case 1:
             {
                 std::string dev = "/dev/";
-                path = fat_search(dev);
+                volume = fat_search(dev);
                 break;
             }
         case 2:
@@ -44,19 +67,45 @@ void Program::start()
                 std::cout << "Укажите путь до файла устройства.\n"
                     << "Путь: ";
                 std::cin >> path;
+                volume = select_volume(path);
                 break;
             }
+        case 3:
+            {
+                std::cout << "Укажите путь до файла устройства.\n"
+                    << "Путь: ";
+                std::cin >> path;
+                volume = select_volume(path);
+                if (volume.path.length())
+                    place_by_profile(volume.path, volume.offset);
+                return;
+            }
+        case 4:
+            {
+                std::cout << "Укажите путь до файла устройства.\n"
+                    << "Путь: ";
+                std::cin >> path;
+                volume = select_volume(path);
+                if (volume.path.length())
+                    export_cluster_map(volume.path, volume.offset);
+                return;
+            }
         case 0:
             return;
     }
 
-    if (path.length())
+    if (volume.path.length())
     {
         if (ch == 1)
-            std::cout << "Специальный файл устройства: " << path << '\n';
+        {
+            std::cout << "Специальный файл устройства: " << volume.path;
+            if (volume.offset != 0)
+                std::cout << ", смещение раздела: " << volume.offset;
+            std::cout << '\n';
+        }
         do
         {
-            open_partition(path);
+            open_partition(volume.path, volume.offset);
             std:: cout << "Повторить поиск?\n(1 - да, любая клавиша - нет): ";
             std::cin >> ch;
             // Проверка ввода
@@ -75,14 +124,40 @@ void Program::start()
     }
 }
 
-std::string Program::fat_search(const std::string& directory)
+PartitionTable::Volume Program::fat_search(const std::string& directory)
 {
-    // sd[a-z][optional: a-z][1-15]
-    std::vector<std::string> sd_list = get_files_from_dir
-        ( directory, is_partition );
+    std::vector<std::string> disk_list = find_disks(directory);
 
-    std::vector<std::string> fat_list = find_fat_partitions(sd_list);
+    return choose_volume(find_fat_partitions(disk_list));
+}
 
+PartitionTable::Volume Program::select_volume(const std::string& path)
+{
+    std::vector<PartitionTable::Volume> fat_list = PartitionTable::scan(path);
+    if (fat_list.size() == 1)
+        return fat_list.front();
+    if (fat_list.size() > 1)
+    {
+        std::cout << '\n';
+        int counter = 0;
+        for (auto& volume : fat_list)
+        {
+            std::cout << "Номер раздела: " << ++counter << '\n';
+            volume.pbr.print();
+            std::cout << "Смещение раздела: " << volume.offset << '\n';
+        }
+        return choose_volume(fat_list);
+    }
+    // Раздел не распознан - путь передаётся как есть, чтобы
+    // пользователь получил сообщение о некорректном файле.
+    PartitionTable::Volume volume;
+    volume.path = path;
+    return volume;
+}
+
+PartitionTable::Volume Program::choose_volume
+    (const std::vector<PartitionTable::Volume>& fat_list)
+{
     if (fat_list.size())
     {
         int num = -1;
@@ -107,19 +182,42 @@ std::string Program::fat_search(const std::string& directory)
         if (num > 0)
             return fat_list[num - 1];
     }
-    return std::string();
+    return PartitionTable::Volume{};
 }
 
-void Program::open_partition(const std::string& sd_filename)
+void Program::open_partition(const std::string& sd_filename, uint64_t offset)
 {
     
-    Partition partition(sd_filename);
+    Partition partition(sd_filename, offset);
     if (!partition.is_open())
     {
         std::cout << "Некорректный путь или файл устройства.\n";
         return;
     }
+    partition.print_fat_memory();
     int num = -1;
+    // При расхождении копий таблицы FAT пользователь выбирает,
+    // какой копии доверять.
+    if (!partition.get_fat_mirror_report().mismatched_sectors.empty())
+    {
+        partition.print_fat_mirror_report();
+        do
+        {
+            std::cout << "Использовать выбранную копию(1), первую копию(2) "
+                << "или запретить перемещение файлов(0)? ";
+            std::cin >> num;
+            if (std::cin.fail())
+            {
+                std::cin.clear();
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                num = -1;
+            }
+        } while (num != 0 && num != 1 && num != 2);
+        if (num == 0)
+            partition.set_fat_policy(Partition::FAT_STRICT);
+        if (num == 2)
+            partition.set_fat_policy(Partition::FAT_FIRST);
+    }
     std::string path;
     // Запрашиваем имя файла
     std::cout << "\nУкажите путь до файла или каталога в формате:\n"
@@ -150,9 +248,15 @@ void Program::fragmentation_check(Partition& p, Partition::FileInfo& file)
             std::cout << "Запустить дефрагментацию?\n";
         else
             std::cout << "Запустить дефрагментацию вложенных файлов?\n";
+        bool is_dir = file.get_type() != Partition::FILE;
         do
         {
-            std::cout << "(1 - да, 0 - нет): ";
+            if (is_dir)
+                std::cout << "(1 - да, 2 - да, с упорядочиванием "
+                    << "дерева каталогов, 3 - да, с уплотнением мелких "
+                    << "файлов в свободные промежутки, 0 - нет): ";
+            else
+                std::cout << "(1 - да, 0 - нет): ";
             std::cin >> num;
 
             // Проверка ввода
@@ -163,17 +267,180 @@ void Program::fragmentation_check(Partition& p, Partition::FileInfo& file)
                 num = -1;
                 continue;
             }
-        } while (num != 0 && num != 1);
+        } while (num != 0 && num != 1 && !(is_dir && (num == 2 || num == 3)));
         
+        if (num != 0)
+        {
+            p.set_verify(ask_yes_no("Проверять перенесённые данные "
+                "по контрольным суммам?"));
+            if (ask_yes_no("Переносить данные в обход страничного кэша "
+                "(O_DIRECT)?") && p.set_io_mode(DriveIO::DIRECT)
+                    != DriveIO::DIRECT)
+                std::cout << "Режим O_DIRECT не поддерживается, "
+                    << "используется буферизованный ввод-вывод.\n";
+            p.set_discard(ask_yes_no("Освобождать на накопителе кластеры, "
+                "оставленные перенесёнными файлами (TRIM)?"));
+            track_progress(&p);
+
+            // Предварительная проверка таблицы FAT. Файлы с нарушениями
+            // исключаются из дефрагментации.
+            p.print_check_report(p.check_fat());
+            p.print_scan_cache_stats();
+        }
+
         if (num == 1)
         {
             int amount = p.defragment(file);
+            p.print_schedule();
+            p.print_partial_moves();
             std::cout << "Было фрагментировано: " << amount << " файлов.\n";
         }
+        if (num == 3)
+        {
+            // Уплотнение освобождает непрерывное место для крупных
+            // фрагментированных файлов, которые затем дефрагментируются.
+            p.print_pack_report(p.pack_small_files());
+            int amount = p.defragment(file);
+            p.print_schedule();
+            p.print_partial_moves();
+            std::cout << "Было фрагментировано: " << amount << " файлов.\n";
+        }
+        if (num == 2)
+        {
+            int amount = p.defragment_tree(file);
+            std::cout << "Было перемещено: " << amount 
+                << " файлов и каталогов.\n";
+        }
+        if (num != 0)
+        {
+            track_progress(nullptr);
+            p.print_io_profile();
+            p.print_copy_stats();
+            p.print_discard_stats();
+        }
+        if (p.get_verify_failures() > 0)
+            std::cout << "Перенос отменён из-за несовпадения данных: "
+                << p.get_verify_failures() << " файлов.\n";
     }
     
 }
 
+void Program::place_by_profile(const std::string& sd_filename,
+    uint64_t offset)
+{
+    Partition partition(sd_filename, offset);
+    if (!partition.is_open())
+    {
+        std::cout << "Некорректный путь или файл устройства.\n";
+        return;
+    }
+    std::string profile_path;
+    std::cout << "\nУкажите путь до файла профиля (список путей "
+        << "в порядке чтения или трасса обращений)\nПуть: ";
+    std::cin >> profile_path;
+
+    std::vector<std::string> paths = read_profile(profile_path);
+    if (paths.empty())
+    {
+        std::cout << "Профиль пуст или не найден.\n";
+        return;
+    }
+    track_progress(&partition);
+    Partition::ProfileReport report = partition.place_by_profile(paths);
+    track_progress(nullptr);
+    std::cout << "Файлов в профиле: " << report.files << '\n'
+        << "Размещено по порядку: " << report.placed << '\n'
+        << "Вытеснено файлов: " << report.evicted << '\n'
+        << "Переходов при чтении до: " << report.seeks_before << '\n'
+        << "Переходов при чтении после: " << report.seeks_after << '\n';
+    if (report.seeks_before > 0)
+        std::cout << "Сокращение переходов: "
+            << 100 - report.seeks_after * 100 / report.seeks_before
+            << "%\n";
+}
+
+void Program::export_cluster_map(const std::string& sd_filename,
+    uint64_t offset)
+{
+    Partition partition(sd_filename, offset);
+    if (!partition.is_open())
+    {
+        std::cout << "Некорректный путь или файл устройства.\n";
+        return;
+    }
+    std::string map_path;
+    std::cout << "\nУкажите путь для сохранения карты (без расширения)\n"
+        << "Путь: ";
+    std::cin >> map_path;
+
+    auto start = std::chrono::steady_clock::now();
+    Partition::ClusterMap map = partition.build_cluster_map();
+    double seconds = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+    if (!Partition::export_cluster_map(map, map_path))
+    {
+        std::cout << "Не удалось сохранить карту.\n";
+        return;
+    }
+    std::cout << "Карта: " << map.width << 'x' << map.height
+        << ", кластеров на точку: " << map.clusters_per_bucket << '\n'
+        << "Свободных: " << map.totals[Partition::MAP_FREE] << '\n'
+        << "Непрерывных файлов: " << map.totals[Partition::MAP_CONTIGUOUS] << '\n'
+        << "Фрагментированных файлов: " 
+        << map.totals[Partition::MAP_FRAGMENTED] << '\n'
+        << "Директорий: " << map.totals[Partition::MAP_DIRECTORY] << '\n'
+        << "Прочих: " << map.totals[Partition::MAP_OTHER] << '\n'
+        << "Построена за " << seconds << " с\n"
+        << "Файлы: " << map_path << ".ppm, " << map_path << ".json\n";
+}
+
+/* Файл профиля содержит по одному обращению в строке. В строке
+ * трассы путь - последнее поле, начинающееся со слэша, поэтому
+ * допускаются предшествующие поля (время, идентификатор процесса).
+ * Пустые строки и строки, начинающиеся с '#', пропускаются. */
+std::vector<std::string> Program::read_profile(const std::string& profile_path)
+{
+    std::vector<std::string> paths;
+    std::ifstream profile(profile_path);
+    std::string line;
+    while (std::getline(profile, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        size_t position = line.find(" /");
+        if (position == std::string::npos)
+            position = line.find("\t/");
+        std::string path = (position == std::string::npos)
+            ? line : line.substr(position + 1);
+        while (!path.empty() && (path.back() == '\r' 
+            || path.back() == ' ' || path.back() == '\t'))
+            path.pop_back();
+        if (!path.empty() && path[0] == '/')
+            paths.push_back(path);
+    }
+    return paths;
+}
+
+bool Program::ask_yes_no(const std::string& question)
+{
+    int answer = -1;
+    do
+    {
+        std::cout << question << "\n(1 - да, 0 - нет): ";
+        std::cin >> answer;
+
+        // Проверка ввода
+        if (std::cin.fail())
+        {
+            std::cin.clear();
+            std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            answer = -1;
+            continue;
+        }
+    } while (answer != 0 && answer != 1);
+    return answer == 1;
+}
+
 #ifdef LINUX
 bool Program::is_partition(const std::string& str)
 {
@@ -272,22 +539,91 @@ std::vector<std::string> Program::get_files_from_dir
     return list;    
 }
 
-std::vector<std::string> Program::find_fat_partitions
-    ( const std::vector<std::string>& list )
+std::vector<std::string> Program::find_disks(const std::string& directory)
 {
-    std::vector<std::string> fp_list;
-    PBR pbr;
-    int counter = 0;
-    for (auto& el : list)
+    std::vector<std::string> list;
+    std::error_code error;
+    // Каталог /sys/block содержит только накопители целиком, поэтому
+    // каждый раздел находится один раз - по таблице разделов.
+    // Незадействованные устройства (например, свободные loop)
+    // имеют нулевой размер и пропускаются.
+    if (std::filesystem::is_directory("/sys/block", error))
     {
-        pbr.set(el);
-        if (pbr.is_fat())
+        for (const auto& entry 
+            : std::filesystem::directory_iterator("/sys/block", error))
         {
-            std::cout << "Номер раздела: " << ++counter << '\n';
-            pbr.print();
-            fp_list.push_back(el);
+            std::string name = entry.path().filename().string();
+            std::ifstream size_file(entry.path() / "size");
+            uint64_t size = 0;
+            if (!(size_file >> size) || size == 0)
+                continue;
+            std::filesystem::path node 
+                = std::filesystem::path(directory) / name;
+            if (std::filesystem::exists(node, error))
+                list.push_back(node.string());
         }
-        
+        return list;
+    }
+    return get_files_from_dir(directory, is_partition);
+}
+
+std::vector<PartitionTable::Volume> Program::find_fat_partitions
+    ( const std::vector<std::string>& list )
+{
+    std::vector<PartitionTable::Volume> fp_list
+        = PartitionTable::scan(list);
+    int counter = 0;
+    for (auto& volume : fp_list)
+    {
+        std::cout << "Номер раздела: " << ++counter << '\n';
+        volume.pbr.print();
+        std::cout << "Файл устройства: " << volume.path << '\n';
+        if (volume.offset != 0)
+            std::cout << "Смещение раздела: " << volume.offset << '\n';
     }
     return fp_list;
-}
\ No newline at end of file
+}
+
+void Program::print_progress(const Partition::Progress& progress)
+{
+    std::cout << "\rФайлов " << progress.files_done << '/'
+        << progress.files_total << ", "
+        << progress.bytes_done / 1048576U << '/'
+        << progress.bytes_total / 1048576U << " Mb, перенесено "
+        << progress.bytes_moved / 1048576U << " Mb";
+    if (progress.megabytes_per_second > 0)
+        std::cout << " (" << static_cast<uint64_t>
+            (progress.megabytes_per_second) << " Mb/s)";
+    if (progress.eta_seconds >= 0 && !progress.finished)
+    {
+        uint64_t seconds = static_cast<uint64_t>(progress.eta_seconds);
+        char eta[32];
+        std::snprintf(eta, sizeof(eta), "%02llu:%02llu:%02llu",
+            static_cast<unsigned long long>(seconds / 3600U),
+            static_cast<unsigned long long>(seconds / 60U % 60U),
+            static_cast<unsigned long long>(seconds % 60U));
+        std::cout << ", осталось " << eta;
+    }
+    if (progress.cancelled)
+        std::cout << ", отмена";
+    // Пробелы стирают остаток более длинной предыдущей строки.
+    std::cout << "      ";
+    if (progress.finished)
+        std::cout << '\n';
+    std::cout << std::flush;
+}
+
+void Program::track_progress(Partition* partition)
+{
+    tracked_partition = partition;
+    if (partition == nullptr)
+    {
+        std::signal(SIGINT, SIG_DFL);
+        return;
+    }
+    // Запрос отмены прежней операции сбрасывается до установки
+    // обработчика, поэтому Ctrl+C, нажатое после, не теряется.
+    partition->clear_cancel();
+    partition->set_progress_callback(print_progress);
+    std::signal(SIGINT, cancel_tracked);
+}
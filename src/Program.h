@@ -4,6 +4,7 @@
 #include <functional>
 
 #include "Partition.h"
+#include "PartitionTable.h"
 
 // Класс программы. Реализует диалог с пользователем и инициирует
 // выполнение процедур для выполнения поставленных задач.
@@ -14,19 +15,32 @@ class Program
          * условию, которое передаётся в виде функции,
          * обрабатывающей строковые значения.
          * Передаваемая функция проверяет элементы (файлы)
-         * директории на предмет соответствия реализованных условий. 
-         * Ранее, программа могла определять доступные разделы 
-         * из сектора Master Boot Record, но данная реализация
-         * оказалась неактуальной. */
+         * директории на предмет соответствия реализованных условий. */
         std::vector<std::string> get_files_from_dir
             ( const std::string& directory_path, 
               std::function<bool(const std::string&)> condition );
         
-        // Метод получает список файлов, проверяет, 
-        // какие относятся к FAT разделам
-        // и возвращает список подходящих файлов.
-        std::vector<std::string> find_fat_partitions
+        // Метод возвращает список накопителей для поиска разделов.
+        // В Linux накопители берутся из /sys/block (любые имена, включая
+        // nvme, mmcblk, loop), иначе - по шаблону имени в директории.
+        std::vector<std::string> find_disks
+            ( const std::string& directory );
+
+        // Метод параллельно разбирает таблицы разделов указанных
+        // накопителей или образов, выводит найденные разделы FAT
+        // и возвращает их список.
+        std::vector<PartitionTable::Volume> find_fat_partitions
             ( const std::vector<std::string>& list );
+
+        // Метод предлагает пользователю выбрать раздел из списка.
+        // При отказе возвращается раздел с пустым путём.
+        auto choose_volume(const std::vector<PartitionTable::Volume>& list)
+            -> PartitionTable::Volume;
+
+        // Метод определяет раздел по пути, указанному вручную. Если файл
+        // содержит таблицу разделов с несколькими разделами FAT,
+        // пользователь выбирает один из них.
+        auto select_volume(const std::string& path) -> PartitionTable::Volume;
         
         /* Нестатические методы класса нельзя передать 
          * в качестве аргументов, поскольку они привязаны 
@@ -39,6 +53,22 @@ class Program
         // специального файла раздела файловой системы (sd[a-z][a-z][1-15])
         static bool is_partition(const std::string& str);
 
+        // Метод задаёт пользователю вопрос и ожидает ответа
+        // "да" (1) или "нет" (0).
+        static bool ask_yes_no(const std::string& question);
+
+        // Вывод строки хода операции поверх предыдущей.
+        static void print_progress(const Partition::Progress& progress);
+        // Метод подключает вывод хода операций раздела и отмену
+        // по Ctrl+C (SIGINT); nullptr восстанавливает обработку
+        // сигнала по умолчанию.
+        static void track_progress(Partition* partition);
+
+        // Метод считывает файл профиля доступа и возвращает
+        // пути файлов в порядке первого обращения.
+        std::vector<std::string> read_profile
+            ( const std::string& profile_path );
+
     public:
         // Метод запуска программы. Начинает диалог с пользователем.
         void start();
@@ -47,18 +77,33 @@ class Program
         // раздела. При автоматическом поиске, спрашивает у пользователя,
         // какой из предложенных разделов необходим. Либо предлагает 
         // ручной ввод пути к специальному файлу раздела.
-        auto fat_search(const std::string& directory) -> std::string;
+        auto fat_search(const std::string& directory)
+            -> PartitionTable::Volume;
 
         // Метод, открывающий раздел и спрашивающий у пользователя
         // путь до файла или директории, к которым необходимо
         // применить алгоритм дефрагментации.
         // Путь задаётся в формате "/ПУТЬ.../ИМЯ". Для дефрагментации
         // файлов из корневой директории, достаточно написать слэш "/".
-        auto open_partition(const std::string& sd_filename) -> void;
+        // Смещение offset - положение раздела в файле накопителя.
+        auto open_partition(const std::string& sd_filename,
+            uint64_t offset = 0) -> void;
 
         // Метод, предоставляющий пользователю возможность запустить
         // дефрагментацию, если это возможно, и выводящая сообщение
         // о проделанной процедуре в случае её выполнения.
         auto fragmentation_check(Partition& p, 
             Partition::FileInfo& f) -> void;
+
+        // Метод открывает раздел, запрашивает файл профиля доступа
+        // и размещает перечисленные в нём файлы непрерывно в начале
+        // раздела в порядке чтения, выводя ожидаемое сокращение
+        // количества переходов головки.
+        auto place_by_profile(const std::string& sd_filename,
+            uint64_t offset = 0) -> void;
+
+        // Метод открывает раздел, строит карту кластеров и сохраняет
+        // её в изображение PPM с описанием в JSON по указанному пути.
+        auto export_cluster_map(const std::string& sd_filename,
+            uint64_t offset = 0) -> void;
 };
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef SCAN_ARENA_H
+#define SCAN_ARENA_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring> // std::memcpy
+#include <string_view>
+#include <memory_resource> // std::pmr::monotonic_buffer_resource
+#include <vector>
+#include <unordered_map>
+
+/* Арена обхода дерева каталогов. Записи о файлах и их имена
+ * размещаются в одном монотонном буфере: память выделяется крупными
+ * блоками и не освобождается по отдельности, а вся сразу - методом
+ * clear() перед следующим обходом. Имена хранятся один раз
+ * (одинаковые имена разных директорий совпадают), запись ссылается
+ * на имя номером, а не владеющей строкой. */
+template <typename Record>
+class ScanArena
+{
+    public:
+        // Номер имени в арене. Ноль - пустое имя.
+        using Name = uint32_t;
+
+    private:
+        // Размер первого блока буфера. Следующие блоки растут
+        // в геометрической прогрессии.
+        static const size_t initial_block = 64U * 1024U;
+
+        std::pmr::monotonic_buffer_resource m_resource{ initial_block };
+        std::pmr::vector<Record> m_records{ &m_resource };
+        std::pmr::vector<std::string_view> m_names{ &m_resource };
+        std::pmr::unordered_map<std::string_view, Name> m_index{ &m_resource };
+
+    public:
+        ScanArena() { m_names.emplace_back(); }
+        ScanArena(const ScanArena&) = delete;
+        ScanArena& operator=(const ScanArena&) = delete;
+
+        // Освобождение всех записей и имён одним действием.
+        auto clear() -> void
+        {
+            // Контейнеры освобождают память обратно в буфер (без
+            // действия), после чего буфер возвращает все блоки.
+            m_index = decltype(m_index)(&m_resource);
+            m_names = decltype(m_names)(&m_resource);
+            m_records = decltype(m_records)(&m_resource);
+            m_resource.release();
+            m_names.emplace_back();
+        }
+
+        // Размещение имени в арене. Повторное имя не копируется.
+        auto intern(std::string_view name) -> Name
+        {
+            if (name.empty())
+                return 0;
+            auto found = m_index.find(name);
+            if (found != m_index.end())
+                return found->second;
+            char* chars = static_cast<char*>
+                (m_resource.allocate(name.length(), 1U));
+            std::memcpy(chars, name.data(), name.length());
+            std::string_view stored(chars, name.length());
+            Name handle = static_cast<Name>(m_names.size());
+            m_names.push_back(stored);
+            m_index.emplace(stored, handle);
+            return handle;
+        }
+        auto get_name(Name handle) const -> std::string_view
+            { return m_names[handle]; }
+
+        auto push_back(const Record& record) -> void
+            { m_records.push_back(record); }
+        auto operator[](size_t index) -> Record& { return m_records[index]; }
+        auto operator[](size_t index) const -> const Record&
+            { return m_records[index]; }
+        auto size() const -> size_t { return m_records.size(); }
+        auto empty() const -> bool { return m_records.empty(); }
+        auto front() -> Record& { return m_records.front(); }
+        auto names_number() const -> size_t { return m_names.size() - 1U; }
+};
+
+#endif // SCAN_ARENA_H
@@ -0,0 +1,174 @@
+#include "ScanCache.h"
+
+#include <fstream>
+#include <cstdio> // std::rename, std::remove
+#include <cstdlib> // mkstemp
+#include <cstring> // std::memcmp, std::memcpy
+#include <vector> // std::vector
+#include <fcntl.h> // open
+#include <unistd.h> // close
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat
+
+namespace
+{
+    const char magic[8] = { 'F', 'A', 'T', 'S', 'C', 'A', 'N', '\0' };
+
+    size_t align(size_t offset)
+    {
+        return (offset + 7U) & ~static_cast<size_t>(7U);
+    }
+}
+
+static_assert(sizeof(ScanCache::Header) == 56U, "Unexpected header size.");
+static_assert(sizeof(ScanCache::Record) == 56U, "Unexpected record size.");
+
+ScanCache::Layout ScanCache::get_layout(const Header& header)
+{
+    Layout layout;
+    layout.fat_hashes = sizeof(Header);
+    layout.records = align(layout.fat_hashes
+        + static_cast<size_t>(header.fat_sectors) * sizeof(uint32_t));
+    layout.extents = layout.records
+        + static_cast<size_t>(header.records) * sizeof(Record);
+    layout.hashes = layout.extents
+        + static_cast<size_t>(header.extents) * sizeof(Extent);
+    layout.names = layout.hashes
+        + static_cast<size_t>(header.hashes) * sizeof(DirCluster);
+    layout.length = layout.names + header.names_size;
+    return layout;
+}
+
+bool ScanCache::load(const std::string& path)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (::fstat(fd, &info) != 0
+        || static_cast<size_t>(info.st_size) < sizeof(Header))
+    {
+        ::close(fd);
+        return false;
+    }
+    m_length = static_cast<size_t>(info.st_size);
+    m_map = ::mmap(nullptr, m_length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (m_map == MAP_FAILED)
+    {
+        m_map = nullptr;
+        return false;
+    }
+
+    const char* data = static_cast<const char*>(m_map);
+    const Header* header = reinterpret_cast<const Header*>(data);
+    if (std::memcmp(header->magic, magic, sizeof(magic)) != 0
+        || header->version != format_version
+        || get_layout(*header).length != m_length)
+    {
+        close();
+        return false;
+    }
+    Layout layout = get_layout(*header);
+    m_header = header;
+    m_fat_hashes = reinterpret_cast<const uint32_t*>
+        (data + layout.fat_hashes);
+    m_records = reinterpret_cast<const Record*>(data + layout.records);
+    m_extents = reinterpret_cast<const Extent*>(data + layout.extents);
+    m_hashes = reinterpret_cast<const DirCluster*>(data + layout.hashes);
+    m_names = data + layout.names;
+
+    // Ссылки записей проверяются один раз при загрузке, чтобы
+    // повреждённый снимок не приводил к чтению за пределами файла.
+    for (uint32_t i = 0; i < header->records; ++i)
+    {
+        const Record& record = m_records[i];
+        if (static_cast<uint64_t>(record.name_offset) + record.name_length
+                > header->names_size
+            || static_cast<uint64_t>(record.children_begin)
+                + record.children_count > header->records
+            || static_cast<uint64_t>(record.extents_begin)
+                + record.extents_count > header->extents
+            || static_cast<uint64_t>(record.hashes_begin)
+                + record.hashes_count > header->hashes)
+        {
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void ScanCache::close()
+{
+    if (m_map != nullptr)
+        ::munmap(m_map, m_length);
+    m_map = nullptr;
+    m_length = 0;
+    m_header = nullptr;
+    m_fat_hashes = nullptr;
+    m_records = nullptr;
+    m_extents = nullptr;
+    m_hashes = nullptr;
+    m_names = nullptr;
+}
+
+bool ScanCache::save(const std::string& path, Contents& contents)
+{
+    Header& header = contents.header;
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = format_version;
+    header.fat_sectors = contents.fat_hashes.size();
+    header.records = contents.records.size();
+    header.extents = contents.extents.size();
+    header.hashes = contents.hashes.size();
+    header.names_size = contents.names.size();
+    Layout layout = get_layout(header);
+
+    // Снимок записывается во временный файл и заменяет прежний
+    // переименованием: прерванная запись не портит прежний снимок.
+    // Имя временного файла уникально, поэтому одновременно
+    // сохраняемые снимки одного тома не пишут в один файл.
+    std::string pattern = path + ".XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    int fd = ::mkstemp(name.data());
+    if (fd < 0)
+        return false;
+    ::close(fd);
+    std::string temporary(name.data());
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        const char padding[8] = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(contents.fat_hashes.data()),
+            contents.fat_hashes.size() * sizeof(uint32_t));
+        file.write(padding, layout.records - layout.fat_hashes
+            - contents.fat_hashes.size() * sizeof(uint32_t));
+        file.write(reinterpret_cast<const char*>(contents.records.data()),
+            contents.records.size() * sizeof(Record));
+        file.write(reinterpret_cast<const char*>(contents.extents.data()),
+            contents.extents.size() * sizeof(Extent));
+        file.write(reinterpret_cast<const char*>(contents.hashes.data()),
+            contents.hashes.size() * sizeof(DirCluster));
+        file.write(contents.names.data(), contents.names.size());
+        if (!file)
+        {
+            file.close();
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,147 @@
+#ifndef SCAN_CACHE_H
+#define SCAN_CACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* Снимок результатов обхода тома, сохраняемый между запусками.
+ * Содержит контрольные суммы секторов таблицы FAT и прочитанных
+ * кластеров директорий, таблицу файлов и участки цепочек файлов.
+ * По суммам определяется, какие части тома изменились с прошлого
+ * обхода: неизменные директории не разбираются заново, а цепочки
+ * файлов, элементы которых лежат в неизменных секторах таблицы,
+ * не просматриваются.
+ *
+ * Файл снимка - заголовок и массивы записей фиксированного размера
+ * в порядке байтов машины. Он отображается в память целиком и
+ * используется без разбора. */
+class ScanCache
+{
+    public:
+        struct Header
+        {
+            char magic[8] = {};
+            uint32_t version = 0;
+            // Параметры тома: снимок другого тома или тома с другой
+            // разметкой не используется.
+            uint32_t serial_number = 0;
+            uint32_t cluster_size = 0;
+            uint32_t sector_size = 0;
+            uint32_t fat_bits = 0;
+            uint32_t fat_sectors = 0;
+            uint32_t last_cluster = 0;
+            // Размеры массивов.
+            uint32_t records = 0;
+            uint32_t extents = 0;
+            uint32_t hashes = 0;
+            uint32_t names_size = 0;
+            uint32_t reserved = 0;
+        };
+
+        // Запись таблицы файлов. Вложенные записи директории идут
+        // подряд, с номера children_begin. Участки цепочки и суммы
+        // кластеров директории задаются так же. Участков нет, если
+        // цепочка нарушена, - такой файл просматривается заново.
+        struct Record
+        {
+            uint64_t entry_offset = 0;
+            uint32_t first_cluster = 0;
+            uint32_t size = 0;
+            uint32_t name_offset = 0;
+            uint32_t name_length = 0;
+            uint32_t type = 0;
+            uint32_t children_begin = 0;
+            uint32_t children_count = 0;
+            uint32_t extents_begin = 0;
+            uint32_t extents_count = 0;
+            uint32_t hashes_begin = 0;
+            uint32_t hashes_count = 0;
+            uint32_t reserved = 0;
+        };
+
+        struct Extent
+        {
+            uint32_t first = 0;
+            uint32_t count = 0;
+        };
+
+        // 64-разрядный хеш кластера директории. Хранятся хеши
+        // кластеров цепочки до кластера с признаком конца директории
+        // включительно: последующие кластеры при разборе не читаются.
+        struct DirCluster
+        {
+            uint32_t cluster = 0;
+            uint32_t reserved = 0;
+            uint64_t hash = 0;
+        };
+
+        // Содержимое снимка для записи.
+        struct Contents
+        {
+            Header header;
+            std::vector<uint32_t> fat_hashes;
+            std::vector<Record> records;
+            std::vector<Extent> extents;
+            std::vector<DirCluster> hashes;
+            std::string names;
+        };
+
+        static const uint32_t format_version = 2U;
+
+    private:
+        void* m_map = nullptr;
+        size_t m_length = 0;
+        const Header* m_header = nullptr;
+        const uint32_t* m_fat_hashes = nullptr;
+        const Record* m_records = nullptr;
+        const Extent* m_extents = nullptr;
+        const DirCluster* m_hashes = nullptr;
+        const char* m_names = nullptr;
+
+        // Размер файла снимка и смещения массивов. Массивы выровнены
+        // по 8 байтам.
+        struct Layout
+        {
+            size_t fat_hashes = 0;
+            size_t records = 0;
+            size_t extents = 0;
+            size_t hashes = 0;
+            size_t names = 0;
+            size_t length = 0;
+        };
+        static auto get_layout(const Header& header) -> Layout;
+
+    public:
+        ScanCache() = default;
+        ScanCache(const ScanCache&) = delete;
+        ScanCache& operator=(const ScanCache&) = delete;
+        ~ScanCache() { close(); }
+
+        // Отображение файла снимка в память. Возвращает false, если
+        // файла нет или он повреждён.
+        auto load(const std::string& path) -> bool;
+        auto close() -> void;
+        auto is_loaded() const -> bool { return m_header != nullptr; }
+
+        auto header() const -> const Header& { return *m_header; }
+        auto fat_hash(uint32_t sector) const -> uint32_t
+            { return m_fat_hashes[sector]; }
+        auto record(uint32_t index) const -> const Record&
+            { return m_records[index]; }
+        auto extent(uint32_t index) const -> const Extent&
+            { return m_extents[index]; }
+        auto hash(uint32_t index) const -> const DirCluster&
+            { return m_hashes[index]; }
+        auto name(const Record& record) const -> std::string_view
+            { return std::string_view(m_names + record.name_offset,
+                record.name_length); }
+
+        // Запись снимка. Файл заменяется целиком, поэтому отображённый
+        // в память прежний снимок остаётся действительным.
+        static auto save(const std::string& path, Contents& contents) -> bool;
+};
+
+#endif // SCAN_CACHE_H
@@ -0,0 +1,439 @@
+#include <sstream> // std::istringstream
+#include <cerrno>
+#include <sys/socket.h> // socket(), bind(), listen(), accept(), send()
+#include <sys/un.h> // sockaddr_un
+#include <unistd.h> // close(), unlink()
+
+#include "Service.h"
+
+bool Service::run()
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (m_socket_path.length() >= sizeof(address.sun_path))
+        return false;
+    m_socket_path.copy(address.sun_path, m_socket_path.length());
+
+    m_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_listen < 0)
+        return false;
+    unlink(m_socket_path.c_str());
+    if (bind(m_listen, reinterpret_cast<sockaddr*>(&address),
+            sizeof(address)) != 0 || listen(m_listen, 16) != 0)
+    {
+        close(m_listen);
+        m_listen = -1;
+        return false;
+    }
+
+    m_running = true;
+    while (m_running)
+    {
+        int client = accept(m_listen, nullptr, nullptr);
+        if (client < 0)
+        {
+            if (errno == EINTR && m_running)
+                continue;
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_clients_mutex);
+            ++m_clients;
+        }
+        // Завершившийся поток сообщает о себе уже после освобождения
+        // своих ресурсов, поэтому служба может быть уничтожена сразу
+        // после ожидания.
+        std::thread([this, client]()
+            {
+                serve_client(client);
+                std::unique_lock<std::mutex> lock(m_clients_mutex);
+                --m_clients;
+                std::notify_all_at_thread_exit(m_clients_done,
+                    std::move(lock));
+            }).detach();
+    }
+    m_running = false;
+    close(m_listen);
+    m_listen = -1;
+    unlink(m_socket_path.c_str());
+
+    // Ожидание клиентов и завершение очередей всех разделов.
+    {
+        std::unique_lock<std::mutex> lock(m_clients_mutex);
+        m_clients_done.wait(lock, [this]() { return m_clients == 0; });
+    }
+    std::map<std::string, std::shared_ptr<Volume>> volumes;
+    {
+        std::lock_guard<std::mutex> lock(m_volumes_mutex);
+        volumes.swap(m_volumes);
+    }
+    for (auto& [key, volume] : volumes)
+    {
+        {
+            std::lock_guard<std::mutex> lock(volume->mutex);
+            volume->stop = true;
+        }
+        volume->ready.notify_one();
+        volume->worker.join();
+    }
+    return true;
+}
+
+void Service::stop()
+{
+    // Прерывание accept() в цикле run().
+    m_running = false;
+    if (m_listen >= 0)
+        shutdown(m_listen, SHUT_RDWR);
+}
+
+void Service::send(int client, const std::string& line)
+{
+    std::string message = line + '\n';
+    size_t sent = 0;
+    while (sent < message.length())
+    {
+        // MSG_NOSIGNAL - отключившийся клиент не завершает службу.
+        ssize_t done = ::send(client, message.data() + sent,
+            message.length() - sent, MSG_NOSIGNAL);
+        if (done <= 0)
+            return;
+        sent += done;
+    }
+}
+
+void Service::serve_client(int client)
+{
+    // Задание - одна строка длиной не более 4 КиБ.
+    std::string line;
+    char ch;
+    while (line.length() < 4096U && recv(client, &ch, 1, 0) == 1
+        && ch != '\n')
+        line += ch;
+    if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+
+    std::istringstream request(line);
+    std::string command, device, path, option;
+    uint64_t offset = 0;
+    uint64_t budget = 0;
+    bool discard = false;
+    request >> command >> device >> offset >> path;
+    // Необязательные параметры: бюджет переноса и DISCARD.
+    while (request >> option)
+        if (option == "DISCARD")
+            discard = true;
+        else
+            std::istringstream(option) >> budget;
+
+    if (command == "SHUTDOWN")
+    {
+        send(client, "OK");
+        stop();
+    }
+    else if (command == "CANCEL")
+    {
+        send(client, cancel_volume(device, offset)
+            ? "OK" : "ERROR volume is not open");
+    }
+    else if (command == "RELEASE")
+    {
+        send(client, release_volume(device, offset)
+            ? "OK" : "ERROR volume is not open");
+    }
+    else if (command == "ANALYZE" || command == "DEFRAG"
+        || command == "TREE" || command == "CHECK" || command == "MAP")
+    {
+        std::shared_ptr<Volume> volume = get_volume(device, offset);
+        if (!volume)
+            send(client, "ERROR cannot open volume");
+        else
+        {
+            auto job = std::make_shared<Job>();
+            job->command = command;
+            job->path = path.empty() ? "/" : path;
+            job->budget = budget;
+            job->discard = discard;
+            job->client = client;
+            std::future<void> done = job->done.get_future();
+            size_t position;
+            {
+                std::lock_guard<std::mutex> lock(volume->mutex);
+                // Раздел мог быть закрыт после получения: обработчик
+                // очереди уже остановлен.
+                position = volume->stop ? 0 : volume->jobs.size() + 1U;
+                if (position != 0)
+                    volume->jobs.push_back(job);
+            }
+            if (position == 0)
+                send(client, "ERROR volume is being released");
+            else
+            {
+                volume->ready.notify_one();
+                send(client, "queued: " + std::to_string(position));
+                done.wait();
+            }
+        }
+    }
+    else
+        send(client, "ERROR unknown command");
+    close(client);
+}
+
+std::shared_ptr<Service::Volume> Service::get_volume
+    (const std::string& device, uint64_t offset)
+{
+    std::string key = device + ':' + std::to_string(offset);
+    std::shared_ptr<Volume> volume;
+    {
+        std::unique_lock<std::mutex> lock(m_volumes_mutex);
+        while (true)
+        {
+            auto found = m_volumes.find(key);
+            if (found == m_volumes.end())
+                break;
+            if (!found->second->opening && !found->second->closing)
+                return found->second;
+            m_volumes_changed.wait(lock);
+        }
+        volume = std::make_shared<Volume>();
+        volume->device = device;
+        volume->offset = offset;
+        volume->opening = true;
+        m_volumes[key] = volume;
+    }
+
+    // Открытие раздела (размонтирование, чтение таблицы FAT) не
+    // задерживает обращения к другим разделам.
+    auto partition = std::make_unique<Partition>(device, offset);
+    bool opened = partition->is_open();
+    {
+        std::lock_guard<std::mutex> lock(m_volumes_mutex);
+        if (opened)
+        {
+            volume->partition = std::move(partition);
+            volume->worker = std::thread(&Service::run_worker, this,
+                std::ref(*volume));
+            volume->opening = false;
+        }
+        else
+            m_volumes.erase(key);
+    }
+    m_volumes_changed.notify_all();
+    return opened ? volume : nullptr;
+}
+
+bool Service::release_volume(const std::string& device, uint64_t offset)
+{
+    std::string key = device + ':' + std::to_string(offset);
+    std::shared_ptr<Volume> volume;
+    {
+        std::unique_lock<std::mutex> lock(m_volumes_mutex);
+        auto found = m_volumes.find(key);
+        while (found != m_volumes.end() && found->second->opening)
+        {
+            m_volumes_changed.wait(lock);
+            found = m_volumes.find(key);
+        }
+        if (found == m_volumes.end() || found->second->closing)
+            return false;
+        volume = found->second;
+        volume->closing = true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(volume->mutex);
+        volume->stop = true;
+    }
+    volume->ready.notify_one();
+    // Запись удаляется только после завершения обработчика: до этого
+    // новые задания раздела ждут, а не открывают второй экземпляр.
+    volume->worker.join();
+    {
+        std::lock_guard<std::mutex> lock(m_volumes_mutex);
+        m_volumes.erase(key);
+    }
+    m_volumes_changed.notify_all();
+    return true;
+}
+
+bool Service::cancel_volume(const std::string& device, uint64_t offset)
+{
+    std::lock_guard<std::mutex> lock(m_volumes_mutex);
+    auto found = m_volumes.find(device + ':' + std::to_string(offset));
+    if (found == m_volumes.end() || found->second->opening)
+        return false;
+    // Раздел только получает запрос: отмена безопасна из любого потока.
+    found->second->partition->cancel();
+    return true;
+}
+
+void Service::run_worker(Volume& volume)
+{
+    while (true)
+    {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(volume.mutex);
+            volume.ready.wait(lock, [&volume]()
+                { return volume.stop || !volume.jobs.empty(); });
+            // Очередь дорабатывается и после запроса остановки.
+            if (volume.jobs.empty())
+                return;
+            job = volume.jobs.front();
+            volume.jobs.pop_front();
+            // Отмена относится к выполняемому заданию: запрос,
+            // оставшийся от предыдущего, сбрасывается при выборе
+            // следующего, а не в начале операции.
+            volume.partition->clear_cancel();
+        }
+        send(job->client, "started: " + job->command + ' ' + job->path);
+        run_job(*volume.partition, *job);
+        job->done.set_value();
+    }
+}
+
+void Service::run_job(Partition& partition, Job& job)
+{
+    if (job.command == "CHECK")
+    {
+        Partition::CheckReport report = partition.check_fat();
+        for (auto& issue : report.issues)
+            send(job.client, "issue: " + std::to_string(issue.type) + ' '
+                + std::to_string(issue.cluster) + ' ' + issue.name);
+        send(job.client, "lost_clusters: "
+            + std::to_string(report.lost_clusters));
+        send(job.client, "bad_clusters: "
+            + std::to_string(report.bad_clusters));
+        send(job.client, "blocked_files: "
+            + std::to_string(report.blocked_files));
+        auto& mirror = partition.get_fat_mirror_report();
+        send(job.client, "fat_copies: " + std::to_string(mirror.copies)
+            + " mismatched_sectors " 
+            + std::to_string(mirror.mismatched_sectors.size())
+            + " chosen " + std::to_string(mirror.chosen + 1U));
+        auto& scan = partition.get_scan_cache_stats();
+        send(job.client, "scan_cache: loaded "
+            + std::to_string(scan.loaded ? 1 : 0)
+            + " fat_sectors_changed " + std::to_string(scan.fat_sectors_changed)
+            + " dirs_reused " + std::to_string(scan.dirs_reused)
+            + " dirs_parsed " + std::to_string(scan.dirs_parsed)
+            + " chains_reused " + std::to_string(scan.chains_reused)
+            + " chains_walked " + std::to_string(scan.chains_walked));
+        send(job.client, "OK");
+        return;
+    }
+
+    if (job.command == "MAP")
+    {
+        Partition::ClusterMap map = partition.build_cluster_map();
+        if (!Partition::export_cluster_map(map, job.path))
+        {
+            send(job.client, "ERROR cannot write map");
+            return;
+        }
+        send(job.client, "map: " + std::to_string(map.width) + 'x'
+            + std::to_string(map.height) + ' '
+            + std::to_string(map.clusters_per_bucket));
+        send(job.client, "OK");
+        return;
+    }
+
+    std::string path = job.path;
+    Partition::FileInfo file = partition.get_file(path);
+    if (file.get_type() == Partition::NONE)
+    {
+        send(job.client, "ERROR file not found");
+        return;
+    }
+    send(job.client, "name: " + file.get_name());
+    bool is_file = file.get_type() == Partition::FILE;
+    send(job.client, std::string("type: ") + (is_file ? "file" : "dir"));
+
+    partition.set_discard(job.discard);
+    auto progress_line = [&job](const Partition::Progress& progress)
+        {
+            send(job.client, "progress: "
+                + std::to_string(progress.files_done) + '/'
+                + std::to_string(progress.files_total) + " files "
+                + std::to_string(progress.bytes_done) + '/'
+                + std::to_string(progress.bytes_total) + " bytes "
+                + std::to_string(progress.bytes_moved) + " moved "
+                + std::to_string(static_cast<uint64_t>
+                    (progress.megabytes_per_second)) + " MBps eta "
+                + std::to_string(static_cast<int64_t>
+                    (progress.eta_seconds)));
+        };
+
+    if (job.command == "ANALYZE")
+    {
+        if (is_file)
+            send(job.client, "fragments: "
+                + std::to_string(partition.is_file_fragmented(file)));
+        send(job.client, "free_clusters: "
+            + std::to_string(partition.get_free_clusters()));
+    }
+    else if (job.command == "DEFRAG")
+    {
+        uint32_t failures = partition.get_verify_failures();
+        partition.set_move_budget(job.budget);
+        partition.set_progress_callback(progress_line);
+        send(job.client, "defragmented: "
+            + std::to_string(partition.defragment(file)));
+        if (!is_file)
+            for (auto& entry : partition.get_schedule())
+                send(job.client, "schedule: " + entry.file.get_name() + ' '
+                    + std::to_string(entry.fragments) + ' '
+                    + std::to_string(entry.clusters) + ' '
+                    + std::to_string(static_cast<uint64_t>(entry.score))
+                    + (entry.moved ? " moved" : " skipped"));
+        for (auto& move : partition.get_partial_moves())
+            send(job.client, "partial: " + move.file.get_name() + ' '
+                + std::to_string(move.fragments_before) + ' '
+                + std::to_string(move.fragments_after));
+        send(job.client, "verify_failures: "
+            + std::to_string(partition.get_verify_failures() - failures));
+    }
+    else if (job.command == "TREE")
+    {
+        if (is_file)
+        {
+            send(job.client, "ERROR not a directory");
+            return;
+        }
+        partition.set_progress_callback(progress_line);
+        send(job.client, "moved: "
+            + std::to_string(partition.defragment_tree(file)));
+    }
+    partition.set_progress_callback(nullptr);
+    if (job.command != "ANALYZE")
+    {
+        if (partition.is_cancelled())
+            send(job.client, "cancelled: 1");
+        auto& profile = partition.get_io_profile();
+        if (profile.calibrated)
+            send(job.client, "io_profile: "
+                + std::to_string(profile.chunk_clusters) + " clusters "
+                + std::to_string(profile.queue_depth) + " requests "
+                + std::to_string(static_cast<uint64_t>
+                    (profile.megabytes_per_second)) + " MBps"
+                + (profile.cached ? " cached" : ""));
+        if (job.discard)
+        {
+            auto& discarded = partition.get_discard_stats();
+            send(job.client, "discarded: "
+                + std::to_string(discarded.requests) + " extents "
+                + std::to_string(discarded.bytes) + " bytes"
+                + (discarded.failures ? " unsupported" : ""));
+        }
+        for (int i = 0; i < Partition::COPY_METHODS; ++i)
+        {
+            auto& stats = partition.get_copy_stats
+                (static_cast<Partition::CopyMethod>(i));
+            send(job.client, std::string("copy_") 
+                + (i == Partition::KERNEL_COPY ? "kernel" : "user") + ": "
+                + std::to_string(stats.bytes) + " bytes "
+                + std::to_string(stats.nanoseconds) + " ns");
+        }
+    }
+    send(job.client, "OK");
+}
@@ -0,0 +1,125 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <condition_variable>
+
+#include "Partition.h"
+
+/* Служба дефрагментации. Принимает задания через локальный сокет
+ * (Unix domain socket) и выполняет их, держа разделы открытыми:
+ * загрузочная запись, таблица FAT и кэш директорий считываются
+ * один раз при первом обращении к разделу.
+ *
+ * Задание - одна строка вида:
+ *   ANALYZE <устройство> <смещение> <путь>
+ *   DEFRAG  <устройство> <смещение> <путь> [бюджет в байтах] [DISCARD]
+ *   TREE    <устройство> <смещение> <путь> [DISCARD]
+ *   CHECK   <устройство> <смещение>
+ *   MAP     <устройство> <смещение> <путь карты без расширения>
+ *   CANCEL  <устройство> <смещение>
+ *   RELEASE <устройство> <смещение>
+ *   SHUTDOWN
+ * Результат передаётся по мере выполнения строками "ключ: значение"
+ * и завершается строкой "OK" или "ERROR <описание>". Задания одного
+ * раздела выполняются по очереди, разных разделов - параллельно.
+ * С параметром DISCARD кластеры, оставленные перенесёнными файлами,
+ * освобождаются на накопителе. Во время DEFRAG и TREE передаются
+ * строки "progress: ...". CANCEL останавливает выполняемое задание
+ * раздела после перемещения текущего файла. CHECK сообщает также,
+ * какая часть тома взята из снимка прошлого обхода ("scan_cache: ..."). */
+class Service
+{
+    private:
+        // Задание в очереди раздела. Результат пишется в сокет
+        // клиента, promise сообщает о завершении.
+        struct Job
+        {
+            std::string command;
+            std::string path;
+            uint64_t budget = 0; // бюджет переноса DEFRAG в байтах
+            bool discard = false; // освобождение кластеров на накопителе
+            int client = -1;
+            std::promise<void> done;
+        };
+
+        // Открытый раздел с очередью заданий и обработчиком.
+        struct Volume
+        {
+            std::string device;
+            uint64_t offset = 0;
+            std::unique_ptr<Partition> partition;
+            std::deque<std::shared_ptr<Job>> jobs;
+            std::mutex mutex;
+            std::condition_variable ready;
+            bool stop = false;
+            std::thread worker;
+            // Раздел открывается или закрывается. Защищены
+            // m_volumes_mutex: пока признак выставлен, запись остаётся
+            // в m_volumes, и второй экземпляр раздела не создаётся.
+            bool opening = false;
+            bool closing = false;
+        };
+
+        std::string m_socket_path;
+        int m_listen = -1;
+        std::atomic<bool> m_running{ false };
+
+        // Разделы по ключу "устройство:смещение".
+        std::map<std::string, std::shared_ptr<Volume>> m_volumes;
+        std::mutex m_volumes_mutex;
+        // Сообщает об окончании открытия или закрытия раздела.
+        std::condition_variable m_volumes_changed;
+        // Количество обслуживаемых подключений. Потоки клиентов
+        // отсоединяются, а завершение службы ждёт, пока счётчик
+        // не обнулится.
+        size_t m_clients = 0;
+        std::mutex m_clients_mutex;
+        std::condition_variable m_clients_done;
+
+        // Обработка подключения: чтение задания, постановка в очередь
+        // раздела и ожидание завершения.
+        auto serve_client(int client) -> void;
+        // Раздел по устройству и смещению. Открывается при первом
+        // обращении, вместе с ним запускается обработчик очереди.
+        // Раздел открывается вне m_volumes_mutex; обращения к нему
+        // во время открытия или закрытия ждут их окончания.
+        auto get_volume(const std::string& device, uint64_t offset)
+            -> std::shared_ptr<Volume>;
+        // Закрытие раздела: очередь дорабатывается, раздел освобождается.
+        auto release_volume(const std::string& device, uint64_t offset)
+            -> bool;
+        // Запрос отмены задания, выполняемого над разделом.
+        auto cancel_volume(const std::string& device, uint64_t offset)
+            -> bool;
+        // Цикл обработчика очереди раздела.
+        auto run_worker(Volume& volume) -> void;
+        // Выполнение задания над открытым разделом.
+        auto run_job(Partition& partition, Job& job) -> void;
+
+        // Отправка строки клиенту.
+        static auto send(int client, const std::string& line) -> void;
+
+    public:
+        Service(const std::string& socket_path)
+            : m_socket_path(socket_path) {}
+        Service(const Service&) = delete;
+        Service& operator=(const Service&) = delete;
+        ~Service() { stop(); }
+
+        // Открытие сокета и цикл приёма подключений. Возвращает
+        // false, если сокет не удалось открыть. Завершается по
+        // заданию SHUTDOWN.
+        auto run() -> bool;
+        // Остановка приёма заданий и обработчиков разделов.
+        auto stop() -> void;
+};
+
+#endif // SERVICE_H
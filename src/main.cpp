@@ -1,7 +1,22 @@
+#include <iostream>
+#include <string>
+
 #include "Program.h"
+#include "Service.h"
 
 int main(int argc, char* argv[])
 {
+    // Режим службы: задания принимаются через локальный сокет.
+    if (argc > 1 && std::string(argv[1]) == "--daemon")
+    {
+        Service service(argc > 2 ? argv[2] : "/tmp/fat_defrag.sock");
+        if (!service.run())
+        {
+            std::cerr << "Не удалось открыть сокет службы.\n";
+            return 1;
+        }
+        return 0;
+    }
     Program program;
     program.start();
     return 0;
@@ -1 +1 @@
-clang++ -std=c++20 -o test test.cpp PBR.cpp Bytes.cpp Partition_search.cpp Partition_fragment.cpp
\ No newline at end of file
+clang++ -std=c++20 -o test test.cpp ImageGenerator.cpp PBR.cpp Bytes.cpp FatRuns.cpp Partition_search.cpp Partition_fragment.cpp Partition_owners.cpp Partition_placement.cpp Partition_schedule.cpp Partition_map.cpp Partition_mirror.cpp Partition_calibrate.cpp Partition_progress.cpp Partition_cache.cpp ScanCache.cpp Checksum.cpp Partition_check.cpp DriveIO.cpp
\ No newline at end of file
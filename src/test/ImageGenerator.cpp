@@ -0,0 +1,659 @@
+#include "ImageGenerator.h"
+
+#include <iostream>
+#include <fstream>
+#include <filesystem> // std::filesystem::resize_file
+#include <cstdio> // std::snprintf
+#include <cstring> // std::memcpy, std::memset
+#include <chrono> // std::chrono::steady_clock
+#include <algorithm> // std::min, std::max, std::sort
+
+#include "FAT_Layout.h"
+#include "Checksum.h"
+
+namespace
+{
+    namespace FL = FAT_Layout;
+
+    // Дата изменения всех записей: 1 января 2024 года.
+    const uint16_t entry_date = ((2024U - 1980U) << 9U) | (1U << 5U) | 1U;
+    // Размер блока при заполнении данных файлов.
+    const size_t fill_block = 1048576U;
+
+    uint32_t end_of_chain(uint32_t bits)
+    {
+        return bits == 12U ? 0xFFFU : bits == 16U ? 0xFFFFU : 0x0FFFFFFFU;
+    }
+
+    void set_fat_entry(Bytes& fat, uint32_t bits, uint32_t cluster,
+        uint32_t value)
+    {
+        char* data = fat;
+        if (bits == 12U)
+        {
+            size_t offset = cluster + cluster / 2U;
+            if (cluster & 1U)
+            {
+                data[offset] = static_cast<char>((data[offset] & 0x0F)
+                    | ((value << 4U) & 0xF0U));
+                data[offset + 1U] = static_cast<char>(value >> 4U);
+            }
+            else
+            {
+                data[offset] = static_cast<char>(value);
+                data[offset + 1U] = static_cast<char>((data[offset + 1U]
+                    & 0xF0) | ((value >> 8U) & 0x0FU));
+            }
+            return;
+        }
+        for (uint32_t i = 0; i < bits / 8U; ++i)
+            data[static_cast<size_t>(cluster) * bits / 8U + i]
+                = static_cast<char>(value >> 8U * i);
+    }
+
+    // Короткое имя из буквы и семизначного номера, 11 символов
+    // без завершающего нуля.
+    void make_name(char* name, char prefix, uint32_t number,
+        const char* extension)
+    {
+        char buff[32];
+        std::snprintf(buff, sizeof(buff), "%c%07u%.3s", prefix,
+            number % 10000000U, extension);
+        std::memcpy(name, buff, 11);
+    }
+
+    // Запись директории с именем в формате 8.3 (11 символов).
+    void fill_entry(char* entry, const char* name, uint8_t attributes,
+        uint32_t first_cluster, uint32_t size)
+    {
+        std::memcpy(entry + FL::DirEntry::name::offset, name,
+            FL::DirEntry::name::size + FL::DirEntry::extension::size);
+        FL::store<FL::DirEntry::attributes>(entry, attributes);
+        FL::store<FL::DirEntry::write_date>(entry, entry_date);
+        FL::store<FL::DirEntry::create_date>(entry, entry_date);
+        FL::store<FL::DirEntry::access_date>(entry, entry_date);
+        FL::MutableDirEntryView(entry).set_first_cluster(first_cluster, true);
+        FL::store<FL::DirEntry::file_size>(entry, size);
+    }
+}
+
+uint64_t ImageGenerator::next()
+{
+    uint64_t z = (m_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30U)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27U)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31U);
+}
+
+uint64_t ImageGenerator::uniform(uint64_t low, uint64_t high)
+{
+    if (high <= low)
+        return low;
+    return low + next() % (high - low + 1U);
+}
+
+uint64_t ImageGenerator::random_size()
+{
+    // Сначала выбирается порядок величины (число значащих бит),
+    // затем размер внутри него.
+    uint64_t low = std::max<uint64_t>(1U, m_config.min_file_size);
+    uint64_t high = std::max(low, m_config.max_file_size);
+    uint32_t low_bits = 64U - __builtin_clzll(low);
+    uint32_t high_bits = 64U - __builtin_clzll(high);
+    uint32_t bits = static_cast<uint32_t>(uniform(low_bits, high_bits));
+    uint64_t first = std::max<uint64_t>(low, 1ULL << (bits - 1U));
+    uint64_t last = bits >= 64U ? high
+        : std::min<uint64_t>(high, (1ULL << bits) - 1U);
+    return uniform(first, last);
+}
+
+bool ImageGenerator::compute_geometry()
+{
+    Geometry& g = m_geometry;
+    uint32_t bits = m_config.fat_bits;
+    if (bits != 12U && bits != 16U && bits != 32U)
+    {
+        std::cout << "Разрядность таблицы FAT должна быть 12, 16 или 32.\n";
+        return false;
+    }
+    if (m_config.cluster_size < sector_size
+        || m_config.cluster_size > 128U * sector_size
+        || (m_config.cluster_size & (m_config.cluster_size - 1U)) != 0)
+    {
+        std::cout << "Размер кластера должен быть степенью двойки "
+            << "от 512 байт до 64 Кб.\n";
+        return false;
+    }
+    uint64_t total_sectors = m_config.volume_size / sector_size;
+    if (total_sectors > 0xFFFFFFFFULL)
+    {
+        std::cout << "Размер раздела превышает 2 Тб.\n";
+        return false;
+    }
+    g.total_sectors = static_cast<uint32_t>(total_sectors);
+    g.sectors_per_cluster = m_config.cluster_size / sector_size;
+    g.reserved_sectors = bits == 32U ? 32U : 1U;
+    g.root_entries = bits == 32U ? 0 : 512U;
+    uint32_t root_sectors = g.root_entries * FL::DirEntry::size / sector_size;
+
+    // Размер таблицы зависит от числа кластеров, а оно - от размера
+    // таблицы: значения уточняются, пока не перестанут меняться.
+    g.fat_sectors = 1U;
+    for (int i = 0; i < 16; ++i)
+    {
+        uint64_t overhead = g.reserved_sectors + root_sectors
+            + static_cast<uint64_t>(fat_number) * g.fat_sectors;
+        if (overhead >= g.total_sectors)
+        {
+            std::cout << "Раздел слишком мал.\n";
+            return false;
+        }
+        g.clusters = static_cast<uint32_t>
+            ((g.total_sectors - overhead) / g.sectors_per_cluster);
+        uint64_t fat_bytes = ((static_cast<uint64_t>(g.clusters) + 2U)
+            * bits + 7U) / 8U;
+        uint32_t needed = static_cast<uint32_t>
+            ((fat_bytes + sector_size - 1U) / sector_size);
+        if (needed <= g.fat_sectors)
+            break;
+        g.fat_sectors = needed;
+    }
+    if ((bits == 12U && g.clusters >= 4085U)
+        || (bits == 16U && (g.clusters < 4085U || g.clusters > 65524U))
+        || (bits == 32U && g.clusters <= 65524U))
+    {
+        std::cout << "Количество кластеров (" << g.clusters
+            << ") не соответствует FAT" << bits << ": измените размер "
+            << "раздела или кластера.\n";
+        return false;
+    }
+    g.data_offset = (static_cast<uint64_t>(g.reserved_sectors)
+        + static_cast<uint64_t>(fat_number) * g.fat_sectors + root_sectors)
+        * sector_size;
+    return true;
+}
+
+uint64_t ImageGenerator::cluster_offset(uint32_t cluster) const
+{
+    return m_geometry.data_offset + static_cast<uint64_t>(cluster - 2U)
+        * m_config.cluster_size;
+}
+
+void ImageGenerator::create_objects()
+{
+    bool fat32 = m_config.fat_bits == 32U;
+    uint32_t cluster_size = m_config.cluster_size;
+    m_objects.assign(1U, Object{});
+    m_objects[0].directory = true;
+
+    // Директории образуют случайное дерево: родитель выбирается среди
+    // уже созданных. Корневая директория FAT12/FAT16 вмещает
+    // ограниченное число записей.
+    uint32_t root_capacity = fat32 ? 0xFFFFFFFFU : m_geometry.root_entries;
+    auto choose_parent = [&](uint32_t directories) -> uint32_t
+    {
+        uint32_t parent = static_cast<uint32_t>(uniform(0, directories - 1U));
+        if (parent == 0 && m_objects[0].children.size() >= root_capacity)
+            parent = directories > 1U
+                ? static_cast<uint32_t>(uniform(1U, directories - 1U))
+                : 0xFFFFFFFFU;
+        return parent;
+    };
+    for (uint32_t i = 0; i < m_config.directories; ++i)
+    {
+        uint32_t parent = choose_parent(i + 1U);
+        if (parent == 0xFFFFFFFFU)
+            break;
+        Object dir;
+        make_name(dir.name, 'D', i + 1U, "   ");
+        dir.directory = true;
+        dir.parent = parent;
+        m_objects[parent].children.push_back(m_objects.size());
+        m_objects.push_back(dir);
+    }
+    uint32_t directories = m_objects.size();
+
+    // Файлы занимают не более 90% области данных: остальное место -
+    // директории и свободные промежутки.
+    uint64_t budget = static_cast<uint64_t>(m_geometry.clusters) * 9U / 10U;
+    uint64_t used = 0;
+    for (uint32_t i = 0; i < m_config.files; ++i)
+    {
+        uint32_t parent = choose_parent(directories);
+        if (parent == 0xFFFFFFFFU)
+            break;
+        Object file;
+        file.size = std::min<uint64_t>(random_size(), 0xFFFFFFFFU);
+        file.clusters = static_cast<uint32_t>
+            ((file.size + cluster_size - 1U) / cluster_size);
+        if (used + file.clusters > budget)
+            break;
+        used += file.clusters;
+        make_name(file.name, 'F', i + 1U, "BIN");
+        file.parent = parent;
+        m_objects[parent].children.push_back(m_objects.size());
+        m_objects.push_back(file);
+    }
+
+    // Директории: записи "." и ".." (кроме корневой) и записи
+    // вложенных объектов, не менее одного кластера.
+    for (uint32_t i = 0; i < directories; ++i)
+    {
+        Object& dir = m_objects[i];
+        if (i == 0 && !fat32)
+            continue;
+        uint64_t entries = dir.children.size() + (i == 0 ? 0 : 2U);
+        dir.clusters = static_cast<uint32_t>(std::max<uint64_t>(1U,
+            (entries * FL::DirEntry::size + cluster_size - 1U)
+                / cluster_size));
+    }
+}
+
+std::vector<std::pair<uint32_t, ImageGenerator::Extent>>
+    ImageGenerator::split_objects()
+{
+    std::vector<std::pair<uint32_t, Extent>> pieces;
+    for (uint32_t i = 0; i < m_objects.size(); ++i)
+    {
+        Object& object = m_objects[i];
+        if (object.clusters == 0)
+            continue;
+        uint32_t fragments = 1U;
+        // Корневая директория FAT32 остаётся непрерывной в начале
+        // области данных, как после форматирования.
+        if (i != 0 && object.clusters > 1U && m_config.max_fragments > 1U
+            && uniform(1U, 100U) <= m_config.fragmented_percent)
+            fragments = static_cast<uint32_t>(uniform(2U,
+                std::min(m_config.max_fragments, object.clusters)));
+
+        // Точки разреза выбираются без повторов.
+        std::vector<uint32_t> cuts;
+        while (cuts.size() + 1U < fragments)
+        {
+            uint32_t cut = static_cast<uint32_t>(uniform(1U,
+                object.clusters - 1U));
+            if (std::find(cuts.begin(), cuts.end(), cut) == cuts.end())
+                cuts.push_back(cut);
+        }
+        std::sort(cuts.begin(), cuts.end());
+        cuts.push_back(object.clusters);
+        uint32_t start = 0;
+        for (auto cut : cuts)
+        {
+            // Длина части, её место задаётся при размещении.
+            pieces.push_back({ i, { 0, cut - start } });
+            start = cut;
+        }
+        object.extents.assign(cuts.size(), {});
+        m_report.fragments += cuts.size();
+        if (cuts.size() > 1U)
+            ++m_report.fragmented;
+    }
+    return pieces;
+}
+
+bool ImageGenerator::place_fragments
+    (std::vector<std::pair<uint32_t, Extent>>& pieces)
+{
+    // Номер части в цепочке объекта задаётся порядком до перемешивания.
+    std::vector<uint32_t> parts(pieces.size());
+    for (size_t i = 0, part = 0; i < pieces.size(); ++i)
+    {
+        part = (i > 0 && pieces[i].first == pieces[i - 1U].first)
+            ? part + 1U : 0;
+        parts[i] = part;
+    }
+    std::vector<size_t> order(pieces.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    // Перемешивание Фишера - Йетса; корневая директория FAT32 остаётся
+    // первой.
+    size_t fixed = (!pieces.empty() && pieces[0].first == 0) ? 1U : 0;
+    for (size_t i = order.size(); i > fixed + 1U; --i)
+        std::swap(order[i - 1U], order[uniform(fixed, i - 1U)]);
+
+    uint64_t needed = 0;
+    for (auto& piece : pieces)
+        needed += piece.second.count;
+    if (needed > m_geometry.clusters)
+    {
+        std::cout << "Файлы не помещаются в раздел.\n";
+        return false;
+    }
+    uint64_t slack = m_geometry.clusters - needed;
+    uint32_t cursor = 2U;
+    size_t previous = pieces.size();
+    for (auto index : order)
+    {
+        auto& [object, extent] = pieces[index];
+        uint64_t gap = 0;
+        if (uniform(1U, 100U) <= m_config.gap_percent)
+            gap = uniform(1U, std::max(1U, m_config.max_gap));
+        // Соседние части одной цепочки разделяются хотя бы одним
+        // кластером, иначе они сольются в один фрагмент.
+        if (previous < pieces.size() && pieces[previous].first == object
+            && parts[previous] + 1U == parts[index])
+            gap = std::max<uint64_t>(gap, 1U);
+        // Корневая директория FAT32 начинается с кластера 2.
+        if (object == 0 && parts[index] == 0)
+            gap = 0;
+        gap = std::min(gap, slack);
+        slack -= gap;
+        cursor += gap;
+        extent.first = cursor;
+        cursor += extent.count;
+        m_objects[object].extents[parts[index]] = extent;
+        previous = index;
+    }
+    m_report.used_clusters = static_cast<uint32_t>(needed);
+    return true;
+}
+
+Bytes ImageGenerator::build_fat() const
+{
+    uint32_t bits = m_config.fat_bits;
+    Bytes fat(static_cast<size_t>(m_geometry.fat_sectors) * sector_size);
+    std::memset(fat, 0, fat.length());
+    uint32_t eoc = end_of_chain(bits);
+    // Элемент 0 содержит тип носителя, элемент 1 - признак конца цепочки.
+    set_fat_entry(fat, bits, 0, (eoc & ~0xFFU) | 0xF8U);
+    set_fat_entry(fat, bits, 1U, eoc);
+    for (auto& object : m_objects)
+    {
+        uint32_t previous = 0;
+        for (auto& extent : object.extents)
+            for (uint32_t i = 0; i < extent.count; ++i)
+            {
+                if (previous != 0)
+                    set_fat_entry(fat, bits, previous, extent.first + i);
+                previous = extent.first + i;
+            }
+        if (previous != 0)
+            set_fat_entry(fat, bits, previous, eoc);
+    }
+    return fat;
+}
+
+Bytes ImageGenerator::build_directory(uint32_t index) const
+{
+    const Object& dir = m_objects[index];
+    size_t size = dir.clusters != 0
+        ? static_cast<size_t>(dir.clusters) * m_config.cluster_size
+        : static_cast<size_t>(m_geometry.root_entries) * FL::DirEntry::size;
+    Bytes buff(size);
+    std::memset(buff, 0, buff.length());
+    auto first_cluster = [this](uint32_t object) -> uint32_t
+    {
+        auto& extents = m_objects[object].extents;
+        return extents.empty() ? 0 : extents.front().first;
+    };
+    size_t offset = 0;
+    if (index != 0)
+    {
+        // Ссылка ".." на корневую директорию содержит 0.
+        fill_entry(buff + offset, ".          ", FL::DirEntry::directory,
+            first_cluster(index), 0);
+        offset += FL::DirEntry::size;
+        fill_entry(buff + offset, "..         ", FL::DirEntry::directory,
+            dir.parent == 0 ? 0 : first_cluster(dir.parent), 0);
+        offset += FL::DirEntry::size;
+    }
+    for (auto child : dir.children)
+    {
+        const Object& object = m_objects[child];
+        fill_entry(buff + offset, object.name, object.directory
+            ? FL::DirEntry::directory : FL::DirEntry::archive,
+            first_cluster(child), static_cast<uint32_t>(object.size));
+        offset += FL::DirEntry::size;
+    }
+    return buff;
+}
+
+Bytes ImageGenerator::build_boot_sector() const
+{
+    const Geometry& g = m_geometry;
+    bool fat32 = m_config.fat_bits == 32U;
+    Bytes boot(FL::BPB::size);
+    char* data = boot;
+    std::memset(data, 0, boot.length());
+    const char jump[3] = { '\xEB', fat32 ? '\x58' : '\x3C', '\x90' };
+    std::memcpy(data, jump, sizeof(jump));
+    std::memcpy(data + 3, "FATGEN  ", 8);
+    FL::store<FL::BPB::bytes_per_sector>(data, sector_size);
+    FL::store<FL::BPB::sectors_per_cluster>(data,
+        static_cast<uint8_t>(g.sectors_per_cluster));
+    FL::store<FL::BPB::reserved_sectors>(data,
+        static_cast<uint16_t>(g.reserved_sectors));
+    FL::store<FL::BPB::fat_number>(data, fat_number);
+    FL::store<FL::BPB::root_entries>(data,
+        static_cast<uint16_t>(g.root_entries));
+    if (g.total_sectors <= 0xFFFFU && !fat32)
+        FL::store<FL::BPB::small_sector_count>(data,
+            static_cast<uint16_t>(g.total_sectors));
+    else
+        FL::store<FL::BPB::large_sector_count>(data, g.total_sectors);
+    FL::store<FL::BPB::media>(data, 0xF8U);
+    FL::store<FL::BPB::sectors_per_track>(data, 63U);
+    FL::store<FL::BPB::heads>(data, 255U);
+
+    // Серийный номер определяется зерном, чтобы образы с разными
+    // параметрами не делили сохранённые результаты замеров.
+    uint32_t serial = static_cast<uint32_t>(m_config.seed * 2654435761U)
+        ^ g.total_sectors;
+    if (fat32)
+    {
+        FL::store<FL::EBPB32::sectors_per_fat>(data, g.fat_sectors);
+        FL::store<FL::EBPB32::root_dir_cluster>(data,
+            m_objects[0].extents.front().first);
+        FL::store<FL::EBPB32::fsinfo_sector>(data, 1U);
+        FL::store<FL::EBPB32::backup_sector>(data, 6U);
+        FL::store<FL::EBPB32::drive_number>(data, 0x80U);
+        FL::store<FL::EBPB32::signature>(data, 0x29U);
+        FL::store<FL::EBPB32::serial_number>(data, serial);
+        std::memcpy(data + FL::EBPB32::label::offset, "NO NAME    ", 11);
+        std::memcpy(data + FL::EBPB32::fs_type::offset, "FAT32   ", 8);
+    }
+    else
+    {
+        FL::store<FL::BPB::sectors_per_fat>(data,
+            static_cast<uint16_t>(g.fat_sectors));
+        FL::store<FL::EBPB16::drive_number>(data, 0x80U);
+        FL::store<FL::EBPB16::signature>(data, 0x29U);
+        FL::store<FL::EBPB16::serial_number>(data, serial);
+        std::memcpy(data + FL::EBPB16::label::offset, "NO NAME    ", 11);
+        std::memcpy(data + FL::EBPB16::fs_type::offset,
+            m_config.fat_bits == 12U ? "FAT12   " : "FAT16   ", 8);
+    }
+    FL::store<FL::BPB::signature>(data, FL::BPB::signature_value);
+    return boot;
+}
+
+std::string ImageGenerator::object_path(uint32_t index) const
+{
+    if (index == 0)
+        return "";
+    const Object& object = m_objects[index];
+    std::string name;
+    for (size_t i = 0; i < 8U && object.name[i] != ' '; ++i)
+        name += object.name[i];
+    if (!object.directory)
+    {
+        name += '.';
+        for (size_t i = 8U; i < 11U && object.name[i] != ' '; ++i)
+            name += object.name[i];
+    }
+    return object_path(object.parent) + '/' + name;
+}
+
+bool ImageGenerator::write_image(const std::string& path)
+{
+    const Geometry& g = m_geometry;
+    {
+        std::ofstream create(path, std::ios::binary | std::ios::trunc);
+        if (!create.is_open())
+        {
+            std::cout << "Не удалось создать файл образа.\n";
+            return false;
+        }
+    }
+    // Размер задаётся без записи: незаписанные участки остаются
+    // пустыми участками разреженного файла и читаются как нули.
+    std::error_code error;
+    std::filesystem::resize_file(path,
+        static_cast<uint64_t>(g.total_sectors) * sector_size, error);
+    std::fstream image(path, std::ios::binary | std::ios::in | std::ios::out);
+    if (error || !image.is_open())
+    {
+        std::cout << "Не удалось задать размер образа.\n";
+        return false;
+    }
+    auto write = [&](uint64_t offset, const char* data, size_t size)
+    {
+        image.seekp(offset, image.beg);
+        image.write(data, size);
+        m_report.bytes_written += size;
+    };
+
+    Bytes boot = build_boot_sector();
+    write(0, boot, boot.length());
+    if (m_config.fat_bits == 32U)
+    {
+        Bytes fsinfo(FL::FSInfo::size);
+        std::memset(fsinfo, 0, fsinfo.length());
+        FL::store<FL::FSInfo::lead_signature>(fsinfo, FL::FSInfo::lead_value);
+        FL::store<FL::FSInfo::struct_signature>(fsinfo,
+            FL::FSInfo::struct_value);
+        FL::store<FL::FSInfo::free_count>(fsinfo,
+            g.clusters - m_report.used_clusters);
+        FL::store<FL::FSInfo::next_free>(fsinfo, 0xFFFFFFFFU);
+        FL::store<FL::FSInfo::trail_signature>(fsinfo,
+            FL::FSInfo::trail_value);
+        write(sector_size, fsinfo, fsinfo.length());
+        write(6U * sector_size, boot, boot.length());
+        write(7U * sector_size, fsinfo, fsinfo.length());
+    }
+
+    Bytes fat = build_fat();
+    for (uint32_t i = 0; i < fat_number; ++i)
+        write((g.reserved_sectors + static_cast<uint64_t>(i) * g.fat_sectors)
+            * sector_size, fat, fat.length());
+
+    for (uint32_t i = 0; i < m_objects.size(); ++i)
+    {
+        Object& object = m_objects[i];
+        if (object.directory)
+        {
+            Bytes dir = build_directory(i);
+            if (object.extents.empty())
+            {
+                // Корневая директория FAT12/FAT16 следует за таблицами.
+                write((g.reserved_sectors + static_cast<uint64_t>(fat_number)
+                    * g.fat_sectors) * sector_size, dir, dir.length());
+                continue;
+            }
+            size_t done = 0;
+            for (auto& extent : object.extents)
+            {
+                size_t size = static_cast<size_t>(extent.count)
+                    * m_config.cluster_size;
+                write(cluster_offset(extent.first), dir + done, size);
+                done += size;
+            }
+            continue;
+        }
+        if (!m_config.fill_data)
+            continue;
+
+        // Данные файла: слова образца по порядку цепочки. Контрольная
+        // сумма считается по размеру файла, без хвоста кластера.
+        std::vector<uint64_t> block(fill_block / sizeof(uint64_t));
+        uint64_t word = 0;
+        uint64_t remaining = object.size;
+        object.checksum = 0;
+        for (auto& extent : object.extents)
+        {
+            uint64_t offset = cluster_offset(extent.first);
+            uint64_t size = static_cast<uint64_t>(extent.count)
+                * m_config.cluster_size;
+            for (uint64_t done = 0; done < size; )
+            {
+                size_t chunk = static_cast<size_t>
+                    (std::min<uint64_t>(fill_block, size - done));
+                for (size_t k = 0; k < chunk / sizeof(uint64_t); ++k)
+                    block[k] = static_cast<uint64_t>(i) << 32U | word++;
+                const char* bytes = reinterpret_cast<const char*>
+                    (block.data());
+                size_t counted = static_cast<size_t>
+                    (std::min<uint64_t>(chunk, remaining));
+                object.checksum = Checksum::crc32c(bytes, counted,
+                    object.checksum);
+                remaining -= counted;
+                write(offset + done, bytes, chunk);
+                done += chunk;
+            }
+        }
+    }
+    image.flush();
+    if (!image)
+    {
+        std::cout << "Ошибка записи образа.\n";
+        return false;
+    }
+    return true;
+}
+
+bool ImageGenerator::write_manifest(const std::string& path) const
+{
+    // Строка файла: путь, размер, число фрагментов и CRC32C данных
+    // (0, если данные не заполнялись); строка директории: путь
+    // с завершающим "/" и число фрагментов.
+    std::ofstream manifest(path + ".manifest");
+    if (!manifest.is_open())
+        return false;
+    for (uint32_t i = 1; i < m_objects.size(); ++i)
+    {
+        const Object& object = m_objects[i];
+        char checksum[9];
+        std::snprintf(checksum, sizeof(checksum), "%08X", object.checksum);
+        if (object.directory)
+            manifest << object_path(i) << "/ " << object.extents.size()
+                << '\n';
+        else
+            manifest << object_path(i) << ' ' << object.size << ' '
+                << object.extents.size() << ' ' << checksum << '\n';
+    }
+    return static_cast<bool>(manifest);
+}
+
+bool ImageGenerator::generate(const std::string& path)
+{
+    auto start = std::chrono::steady_clock::now();
+    m_report = {};
+    m_state = m_config.seed;
+    if (!compute_geometry())
+        return false;
+    m_report.clusters = m_geometry.clusters;
+    create_objects();
+    auto pieces = split_objects();
+    if (!place_fragments(pieces))
+        return false;
+    for (uint32_t i = 1; i < m_objects.size(); ++i)
+        ++(m_objects[i].directory ? m_report.directories : m_report.files);
+    if (!write_image(path) || !write_manifest(path))
+        return false;
+    m_report.seconds = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+void ImageGenerator::print_report() const
+{
+    std::cout << "Кластеров: " << m_report.clusters << ", занято "
+        << m_report.used_clusters << '\n'
+        << "Файлов: " << m_report.files << ", директорий "
+        << m_report.directories << '\n'
+        << "Фрагментов: " << m_report.fragments << ", фрагментировано "
+        << m_report.fragmented << " объектов\n"
+        << "Записано: " << m_report.bytes_written / 1048576.0 << " Mb за "
+        << m_report.seconds << " с\n";
+}
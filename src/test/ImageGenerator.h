@@ -0,0 +1,147 @@
+#ifndef IMAGE_GENERATOR_H
+#define IMAGE_GENERATOR_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Bytes.h"
+
+/* Генератор образов разделов FAT12/FAT16/FAT32 с фрагментированными
+ * файлами для проверки и замеров дефрагментации. Загрузочная запись,
+ * таблицы FAT и директории записываются прямо в файл образа, без
+ * монтирования и прав суперпользователя. Области данных, не занятые
+ * метаданными, остаются пустыми участками разреженного файла, поэтому
+ * образ в несколько гигабайт создаётся за секунды.
+ *
+ * Расположение файлов полностью определяется параметрами и зерном
+ * генератора случайных чисел: одинаковые параметры дают побайтно
+ * одинаковый образ на любой платформе. Рядом с образом записывается
+ * список файлов (<образ>.manifest) с размерами, числом фрагментов
+ * и контрольными суммами CRC32C данных. */
+class ImageGenerator
+{
+    public:
+        struct Config
+        {
+            // Разрядность таблицы: 12, 16 или 32. Количество кластеров
+            // должно соответствовать типу (FAT12 - менее 4085,
+            // FAT16 - до 65524, FAT32 - более).
+            uint32_t fat_bits = 16U;
+            uint64_t volume_size = 64ULL * 1048576U;
+            uint32_t cluster_size = 4096U;
+            uint64_t seed = 1U;
+            // Количество файлов и поддиректорий. Файлы, не поместившиеся
+            // в 90% области данных, не создаются.
+            uint32_t files = 1000U;
+            uint32_t directories = 16U;
+            // Размеры файлов распределены равномерно по порядку величины
+            // (логарифмически) между минимальным и максимальным.
+            uint64_t min_file_size = 1U;
+            uint64_t max_file_size = 1048576U;
+            // Доля фрагментированных файлов и директорий в процентах
+            // и наибольшее число фрагментов.
+            uint32_t fragmented_percent = 50U;
+            uint32_t max_fragments = 8U;
+            // Свободное место: перед фрагментом с указанной
+            // вероятностью (в процентах) остаётся промежуток
+            // от 1 до max_gap кластеров.
+            uint32_t gap_percent = 30U;
+            uint32_t max_gap = 4U;
+            // Заполнение данных файлов образцом: 8-байтовые слова
+            // (номер файла << 32 | номер слова в файле). Без заполнения
+            // данные файлов - нули, и образ записывается быстрее всего.
+            bool fill_data = false;
+        };
+
+        // Итоги создания образа.
+        struct Report
+        {
+            uint32_t clusters = 0;
+            uint32_t used_clusters = 0;
+            uint32_t files = 0;
+            uint32_t directories = 0;
+            uint32_t fragments = 0;
+            uint32_t fragmented = 0;
+            uint64_t bytes_written = 0;
+            double seconds = 0;
+        };
+
+    private:
+        struct Extent
+        {
+            uint32_t first = 0;
+            uint32_t count = 0;
+        };
+
+        // Файл или директория образа. Объект с индексом 0 - корневая
+        // директория.
+        struct Object
+        {
+            char name[11] = {};
+            uint32_t parent = 0;
+            bool directory = false;
+            uint64_t size = 0;
+            uint32_t clusters = 0;
+            // Участки в порядке цепочки.
+            std::vector<Extent> extents;
+            std::vector<uint32_t> children;
+            uint32_t checksum = 0;
+        };
+
+        // Геометрия раздела.
+        struct Geometry
+        {
+            uint32_t total_sectors = 0;
+            uint32_t reserved_sectors = 0;
+            uint32_t fat_sectors = 0;
+            uint32_t root_entries = 0;
+            uint32_t sectors_per_cluster = 0;
+            uint32_t clusters = 0;
+            uint64_t data_offset = 0;
+        };
+
+        static const uint32_t sector_size = 512U;
+        static const uint32_t fat_number = 2U;
+
+        Config m_config;
+        Geometry m_geometry;
+        Report m_report;
+        std::vector<Object> m_objects;
+        uint64_t m_state = 0;
+
+        // Генератор псевдослучайных чисел splitmix64. Реализован здесь,
+        // а не взят из <random>, потому что распределения стандартной
+        // библиотеки различаются между реализациями.
+        auto next() -> uint64_t;
+        // Равномерное целое в [low, high].
+        auto uniform(uint64_t low, uint64_t high) -> uint64_t;
+        // Размер файла, равномерный по порядку величины.
+        auto random_size() -> uint64_t;
+
+        // Этапы создания образа.
+        auto compute_geometry() -> bool;
+        auto create_objects() -> void;
+        auto split_objects() -> std::vector<std::pair<uint32_t, Extent>>;
+        auto place_fragments(std::vector<std::pair<uint32_t, Extent>>& pieces)
+            -> bool;
+        auto build_fat() const -> Bytes;
+        auto build_directory(uint32_t index) const -> Bytes;
+        auto build_boot_sector() const -> Bytes;
+        auto write_image(const std::string& path) -> bool;
+        auto write_manifest(const std::string& path) const -> bool;
+        // Путь объекта от корня.
+        auto object_path(uint32_t index) const -> std::string;
+        auto cluster_offset(uint32_t cluster) const -> uint64_t;
+
+    public:
+        ImageGenerator(const Config& config) : m_config(config) {}
+
+        // Создание образа по указанному пути. Существующий файл
+        // перезаписывается.
+        auto generate(const std::string& path) -> bool;
+        auto get_report() const -> const Report& { return m_report; }
+        auto print_report() const -> void;
+};
+
+#endif // IMAGE_GENERATOR_H
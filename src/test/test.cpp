@@ -1,5 +1,10 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
 #include "Partition.h"
+#include "ImageGenerator.h"
+#include "Checksum.h"
 
 // Наследник класса Partition, созданный с целью использования
 // методов предшествующего класса в альтернативных сценариях.
@@ -12,7 +17,7 @@ class TPart: public Partition
 
     void copy_cluster(uint32_t from, uint32_t to)
     {
-        Partition::copy_cluster(from, to);
+        Partition::copy_extent(from, to, 1U);
     }
     void print_pbr()
     {
@@ -26,6 +31,99 @@ class TPart: public Partition
     {
         return m_pbr.get_parameters().cluster_size;
     }
+
+    // Сравнение раздела со списком файлов, записанным генератором
+    // образов: размеры, число фрагментов и, если данные заполнялись,
+    // CRC32C данных файлов. Перед сравнением проверяется таблица FAT.
+    // Возвращает количество расхождений.
+    uint32_t compare_manifest(const std::string& manifest_path,
+        bool check_data)
+    {
+        std::ifstream manifest(manifest_path);
+        if (!manifest.is_open())
+        {
+            std::cout << "Не удалось открыть " << manifest_path << '\n';
+            return 1U;
+        }
+        set_scan_cache(false);
+        const CheckReport& report = check_fat();
+        uint32_t mismatches = report.issues.size()
+            + (report.lost_clusters > 0 ? 1U : 0);
+        if (mismatches > 0)
+            print_check_report(report);
+
+        uint32_t objects = 0;
+        std::string line;
+        while (std::getline(manifest, line))
+        {
+            std::istringstream fields(line);
+            std::string path;
+            uint32_t size = 0;
+            uint32_t fragments = 0;
+            std::string checksum;
+            fields >> path;
+            bool directory = !path.empty() && path.back() == '/';
+            if (directory)
+            {
+                path.pop_back();
+                fields >> fragments;
+            }
+            else
+                fields >> size >> fragments >> checksum;
+            if (path.empty())
+                continue;
+            ++objects;
+
+            std::string search = path;
+            FileInfo file = get_file(search);
+            std::string problem;
+            uint32_t actual = is_file_fragmented(file);
+            if (actual == 0 && file.get_first_cluster() != 0)
+                actual = 1U;
+            if (file.get_type() != (directory ? DIR : FILE))
+                problem = "не найден";
+            else if (!directory && file.get_size() != size)
+                problem = "размер " + std::to_string(file.get_size());
+            else if (actual != fragments)
+                problem = "фрагментов " + std::to_string(actual);
+            else if (!directory && check_data && std::stoul(checksum,
+                nullptr, 16) != data_checksum(file))
+                problem = "контрольная сумма данных";
+            if (!problem.empty())
+            {
+                std::cout << path << ": " << problem << '\n';
+                ++mismatches;
+            }
+        }
+        std::cout << "Сверено объектов: " << objects << ", расхождений: "
+            << mismatches << '\n';
+        return mismatches;
+    }
+
+    private:
+    // CRC32C данных файла по его размеру, без хвоста кластера.
+    uint32_t data_checksum(const FileInfo& file)
+    {
+        const uint32_t max_clusters = 256U;
+        uint32_t cluster_size = get_cluster_size();
+        Bytes buff(static_cast<size_t>(max_clusters) * cluster_size,
+            io_alignment());
+        uint64_t remaining = file.get_size();
+        uint32_t crc = 0;
+        for (auto& extent : get_chain_extents(file.get_first_cluster()))
+            for (uint32_t i = 0; i < extent.count && remaining > 0;
+                i += max_clusters)
+            {
+                uint32_t count = std::min(max_clusters, extent.count - i);
+                if (!read_clusters(buff, extent.first + i, count))
+                    return ~crc;
+                size_t counted = static_cast<size_t>(std::min<uint64_t>
+                    (remaining, static_cast<uint64_t>(count) * cluster_size));
+                crc = Checksum::crc32c(buff, counted, crc);
+                remaining -= counted;
+            }
+        return crc;
+    }
 };
 
 // Класс Test аналогичен по назначению классу Program, 
@@ -60,7 +158,8 @@ class Test
         {
             int num = -1;
             std::cout   << "open_partition()\t- 1\n"
-                        << "create_file()\t\t- 2\n";
+                        << "create_file()\t\t- 2\n"
+                        << "generate_image()\t- 3\n";
             std::cout << "Answer: ";
             std::cin >> num;
             switch(num)
@@ -82,9 +181,48 @@ class Test
                     create_file(name, cl, cl_size);
                     break;
                 }
+                case 3:
+                {
+                    ImageGenerator::Config config;
+                    std::string path;
+                    uint32_t size_mb;
+                    std::cout << "Enter path, fat bits, size (Mb), "
+                        << "cluster size, files, max fragments and seed: ";
+                    std::cin >> path >> config.fat_bits >> size_mb
+                        >> config.cluster_size >> config.files
+                        >> config.max_fragments >> config.seed;
+                    config.volume_size = size_mb * 1048576ULL;
+                    generate_image(path, config);
+                    break;
+                }
             }
         }
 
+        // Метод создаёт образ раздела с фрагментированными файлами,
+        // выводит итоги и сверяет образ со списком файлов.
+        bool generate_image(const std::string& path,
+            const ImageGenerator::Config& config)
+        {
+            ImageGenerator generator(config);
+            if (!generator.generate(path))
+                return false;
+            generator.print_report();
+            return verify_image(path, config.fill_data);
+        }
+
+        // Метод открывает созданный образ и сверяет его со списком
+        // файлов <образ>.manifest.
+        bool verify_image(const std::string& path, bool check_data)
+        {
+            TPart p(path);
+            if (!p.is_open())
+            {
+                std::cout << "Образ не открывается: " << path << '\n';
+                return false;
+            }
+            return p.compare_manifest(path + ".manifest", check_data) == 0;
+        }
+
         // Промежуточный метод, создающий экземпляр тестового класса.
         // Передаёт его в следующий метод.
         void open_partition()
@@ -139,8 +277,25 @@ class Test
 
 int main(int argc, char* argv[])
 {
-    std::cout << "Start test.\n";
     Test test;
+    // Создание образа без диалога, для сценариев замеров:
+    // test generate <path> [fat] [size_mb] [cluster] [files] [fragments]
+    //     [seed] [fill]
+    if (argc >= 3 && std::string(argv[1]) == "generate")
+    {
+        ImageGenerator::Config config;
+        auto arg = [&](int i, uint64_t value) -> uint64_t
+            { return argc > i ? std::stoull(argv[i]) : value; };
+        config.fat_bits = arg(3, config.fat_bits);
+        config.volume_size = arg(4, config.volume_size / 1048576U) * 1048576U;
+        config.cluster_size = arg(5, config.cluster_size);
+        config.files = arg(6, config.files);
+        config.max_fragments = arg(7, config.max_fragments);
+        config.seed = arg(8, config.seed);
+        config.fill_data = arg(9, 0) != 0;
+        return test.generate_image(argv[2], config) ? 0 : 1;
+    }
+    std::cout << "Start test.\n";
     test.start();
     
     return 0;